@@ -16,7 +16,10 @@
 #pragma once
 
 #include "dabClient.h"
+#include "dabLimiter.h"
+#include <array>
 #include <cassert>
+#include <set>
 
 namespace DAB
 {
@@ -30,24 +33,164 @@ namespace DAB
     // <ipAddress> and <params...> are type agnostic, however isCompatible is defined in bridge mode to take a string containing the ipAddress of the end-device.
 
 	// type list should be a list of types inheriting from dabClient (which itself inherits from dabInterface which is the base class we're interested in)
+    // the list may also contain compile-time policies (see dabPolicy.h).  A dabPipeline in the list wraps its interceptors around every request the bridge dispatches
+    // a threading policy (see dabThreading.h) in the list selects the threading model, all device classes must use the same model
 	template<typename ... C>
 	class dabBridge {
+    public:
+        using threadingPolicy = selectPolicy_t<isDabThreading, dabMultiThreaded, C...>;
+
+    private:
+        using pipelineType = selectPolicy_t<isDabPipeline, dabPipeline<>, C...>;
+        [[no_unique_address]] pipelineType pipeline;
+
         std::map<std::string, std::unique_ptr<dabInterface>, std::less<>> instances;
 
+        // adaptive concurrency limiters, one per device for each operation class (priority).   Empty unless enableConcurrencyLimits() has been called
+        std::map<std::string, std::array<dabConcurrencyLimiter<threadingPolicy>, (size_t) dabPriority::bulk + 1>, std::less<>> limiters;
+        bool limitConcurrency = false;
+        size_t initialConcurrency = 0;
+        size_t minConcurrency = 0;
+        size_t maxConcurrency = 0;
+
+        // token bucket rate limits.   Device wide limits are keyed by <deviceId>, per operation limits by the full dab/<deviceId>/<operation> topic
+        std::map<std::string, dabTokenBucket<threadingPolicy>, std::less<>> rateLimits;
+
+        // true if deviceId is handled by this process, see setDeviceOwner ()
+        std::function<bool ( std::string_view const & )> ownsDevice;
+
+        // true if topic is dab/<deviceId>/batch.   A batch is only a container, each of its operations is limited on its own (see addInstance)
+        static bool isBatch ( std::string_view const &deviceId, std::string_view const &topic )
+        {
+            return topic.size () == deviceId.size () + 10 && topic.ends_with ( "/batch" );
+        }
+
+        // check any rate limits that apply to the request.  Throws a 429 if either the operation or the device has run out of tokens
+        void checkRateLimits ( std::string_view const &deviceId, std::string_view const &topic )
+        {
+            auto operation = rateLimits.find ( topic );
+            if ( operation != rateLimits.end () && !operation->second.tryTake () )
+            {
+                throw DAB::dabException ( 429, "operation rate limit exceeded" );
+            }
+            if ( isBatch ( deviceId, topic ) )
+            {
+                return;
+            }
+            if ( auto it = rateLimits.find ( deviceId ); it != rateLimits.end () && !it->second.tryTake () )
+            {
+                // the request isn't executed so it mustn't use up the operation's allowance
+                if ( operation != rateLimits.end () )
+                {
+                    operation->second.giveBack ();
+                }
+                throw DAB::dabException ( 429, "device rate limit exceeded" );
+            }
+        }
+
+        void addLimiters ( std::string_view const &deviceId )
+        {
+            if ( limitConcurrency )
+            {
+                auto &deviceLimiters = limiters.try_emplace ( std::string ( deviceId ) ).first->second;
+                for ( auto &limiter : deviceLimiters )
+                {
+                    limiter.configure ( initialConcurrency, minConcurrency, maxConcurrency );
+                }
+            }
+        }
+
+        // set up a newly made instance.   Each operation of a batch the instance executes is subject to the same rate and concurrency limits as if
+        // it had been sent on its own.   Operations which must stay with the device's owning process (see isDeviceAffine) are refused if the
+        // batch was handled by some other process
+        dabInterface *addInstance ( std::string_view const &deviceId )
+        {
+            auto *instance = instances.find ( deviceId )->second.get ();
+            addLimiters ( deviceId );
+            instance->setBatchCallback ( [this, instance] ( jsonElement const &req ) -> jsonElement {
+                std::string const &topic = req["topic"];
+                auto deviceId = getDeviceId ( topic );
+                if ( ownsDevice && isDeviceAffine ( topic ) && !ownsDevice ( deviceId ) )
+                {
+                    throw DAB::dabException ( 400, "operation can not be batched" );
+                }
+                // admitted before the rate limits are checked, so that a refused operation doesn't use up any tokens
+                admission permit;
+                if ( !admit ( topic, permit ) )
+                {
+                    throw DAB::dabException ( 503, "too many requests in flight" );
+                }
+                if ( !rateLimits.empty () )
+                {
+                    checkRateLimits ( deviceId, topic );
+                }
+                if ( limitConcurrency )
+                {
+                    return limitedDispatch ( deviceId, topic, *instance, req );
+                }
+                return instance->dispatch ( req );
+            } );
+            return instance;
+        }
+
+        // dispatch against instance, giving the handler's latency to the device's limiter for the operation class.   The request was admitted
+        // (see admit ()) when it was received
+        jsonElement limitedDispatch ( std::string_view const &deviceId, std::string_view const &topic, dabInterface &instance, jsonElement const &json )
+        {
+            // the operation, the topic after dab/<deviceId>, selects the latency baseline the request is compared with
+            if ( isBatch ( deviceId, topic ) )
+            {
+                return instance.dispatch ( json );
+            }
+            auto operation = topic.substr ( deviceId.size () + 5 );
+            auto start = std::chrono::steady_clock::now ();
+            auto rsp = instance.dispatch ( json );
+            limiters.find ( deviceId )->second[(size_t) instance.getPriority ( topic )].record ( operation, std::chrono::duration_cast<std::chrono::microseconds> ( std::chrono::steady_clock::now () - start ) );
+            return rsp;
+        }
+
         // type list for our meta-program below
         template<class ...>
         struct types {
         };
 
     public:
+        // a request admitted by admit ()
+        using admission = typename dabConcurrencyLimiter<threadingPolicy>::permit;
+
+        // the instances must be drained while they're still fully constructed objects, so we do it here rather than leaving it to ~dabClient
+        virtual ~dabBridge()
+        {
+            drain ( std::chrono::steady_clock::now () + std::chrono::seconds ( 10 ) );
+        }
 
-        virtual ~dabBridge() = default;
+        // stop all device instances accepting requests and publishing telemetry, and wait until deadline for requests in progress to complete
+        bool drain ( std::chrono::time_point<std::chrono::steady_clock> deadline )
+        {
+            bool drained = true;
+            for ( auto &instance : instances )
+            {
+                drained = instance.second->drain ( deadline ) && drained;
+            }
+            return drained;
+        }
 
         std::function< void(jsonElement const &) > publishCallback;
 
-        // main topic dispatch entry point.   It extracts the topic, removes the dab/<device_id>/ portion and tries to find it in our map.  If it is there
-        // it will dispatch against the stored dispatcher (which will build the parameter lists from the passed in json and then call the specified class method
+        // main topic dispatch entry point.   It passes the request through the bridge's interceptor pipeline (if any) and then routes it to the device
         virtual jsonElement dispatch( jsonElement const &json ) {
+            return pipeline.invoke ( json, [this] ( jsonElement const &req ) { return route ( req ); } );
+        }
+
+        // returns the interceptor pipeline so that interceptors may be configured
+        pipelineType &getPipeline ()
+        {
+            return pipeline;
+        }
+
+        // It extracts the topic, removes the dab/<device_id>/ portion and tries to find it in our map.  If it is there
+        // it will dispatch against the stored dispatcher (which will build the parameter lists from the passed in json and then call the specified class method
+        jsonElement route( jsonElement const &json ) {
             if (json.has("topic")) {
                 std::string const &topic = json["topic"];
 
@@ -75,6 +218,14 @@ namespace DAB
                     auto deviceId = std::string_view(topic.begin() + 4, topic.begin() + 4 + (int)slashPos);
                     auto it = instances.find(deviceId);
                     if (it != instances.end()) {
+                        if ( !rateLimits.empty () )
+                        {
+                            checkRateLimits ( deviceId, topic );
+                        }
+                        if ( limitConcurrency )
+                        {
+                            return limitedDispatch ( deviceId, topic, *it->second, json );
+                        }
                         // now call the dabInterface associated with the deviceId;
                         return it->second->dispatch(json);
                     } else {
@@ -88,6 +239,142 @@ namespace DAB
             }
         }
 
+        // extract the <deviceId> from a "dab/<deviceId>/<method>" topic.   Returns an empty view if the topic isn't device specific (e.g. dab/discovery)
+        static std::string_view getDeviceId ( std::string_view const &topic )
+        {
+            if ( topic.starts_with ( "dab/" ) )
+            {
+                auto slashPos = topic.find_first_of ( '/', 4 );
+                if ( slashPos != std::string_view::npos )
+                {
+                    return topic.substr ( 4, slashPos - 4 );
+                }
+            }
+            return {};
+        }
+
+        // true if the operation addressed by topic keeps state for the device between requests (telemetry jobs), so that every request for
+        // that device must be handled by the same process
+        static bool isDeviceAffine ( std::string_view const &topic )
+        {
+            auto deviceId = getDeviceId ( topic );
+            if ( deviceId.empty () )
+            {
+                return false;
+            }
+            auto operation = topic.substr ( 4 + deviceId.size () );
+            return operation.starts_with ( "/device-telemetry/" ) || operation.starts_with ( "/app-telemetry/" );
+        }
+
+        // return the scheduling priority of the request addressed to topic.   This is looked up from the instance handling the deviceId
+        dabPriority getPriority ( std::string_view const &topic )
+        {
+            auto it = instances.find ( getDeviceId ( topic ) );
+            if ( it != instances.end () )
+            {
+                return it->second->getPriority ( topic );
+            }
+            return dabPriority::normal;
+        }
+
+        // admit a request for topic as it's received, before it's queued for its device.   With concurrency limits enabled this returns false if
+        // the device's limit for the operation class has been reached, the request must then be refused with a 503.   Otherwise permit counts the
+        // request against the limit until it's destroyed, which must not be before the request has been executed.   A batch is only a container,
+        // its operations are admitted on their own as they're executed
+        bool admit ( std::string_view const &topic, admission &permit )
+        {
+            if ( !limitConcurrency )
+            {
+                return true;
+            }
+            auto deviceId = getDeviceId ( topic );
+            auto it = limiters.find ( deviceId );
+            if ( it == limiters.end () || isBatch ( deviceId, topic ) )
+            {
+                return true;
+            }
+            permit = it->second[(size_t) getPriority ( topic )].acquire ();
+            return (bool) permit;
+        }
+
+        // enable adaptive concurrency limiting.   Each device has a limiter for each operation class which adjusts the number of requests allowed
+        // in flight, received but not yet completed, between minLimit and maxLimit based on observed handler latency.  Requests are counted from
+        // when an interface admits them (see admit ()) and requests over the limit are rejected with a 503.
+        // this must be called before the bridge starts receiving requests
+        void enableConcurrencyLimits ( size_t initialLimit = 8, size_t minLimit = 1, size_t maxLimit = 256 )
+        {
+            limitConcurrency = true;
+            initialConcurrency = initialLimit;
+            minConcurrency = minLimit;
+            maxConcurrency = maxLimit;
+            for ( auto const &instance : instances )
+            {
+                addLimiters ( instance.first );
+            }
+        }
+
+        // set by an interface sharing requests with other processes: owns ( deviceId ) is true if this process owns the device, and so handles its
+        // device affine operations (see isDeviceAffine).   Unset, every device is owned here.   Must be called before the bridge starts receiving requests
+        void setDeviceOwner ( decltype ( ownsDevice ) owns )
+        {
+            ownsDevice = std::move ( owns );
+        }
+
+        // limit the rate of requests to deviceId to ratePerSecond, allowing bursts of up to burst requests.  Requests over the limit are rejected with a 429.
+        // a batch doesn't take a token from the device's bucket, each of its operations does.   This must be called before the bridge starts receiving requests
+        void setRateLimit ( char const *deviceId, double ratePerSecond, double burst )
+        {
+            auto key = std::string ( deviceId );
+            rateLimits.erase ( key );
+            rateLimits.try_emplace ( std::move ( key ), ratePerSecond, burst );
+        }
+
+        // as above, but only applies to the specified operation (e.g. "input/key-press").  Both the device and operation limits must allow the request
+        void setRateLimit ( char const *deviceId, char const *operation, double ratePerSecond, double burst )
+        {
+            auto key = std::string ( "dab/" ) + deviceId + "/" + operation;
+            rateLimits.erase ( key );
+            rateLimits.try_emplace ( std::move ( key ), ratePerSecond, burst );
+        }
+
+        // return the configured rate limits and the number of requests rejected by each
+        jsonElement getRateLimitStatistics ()
+        {
+            jsonElement stats;
+            stats.makeObject ();
+            for ( auto &[key, bucket] : rateLimits )
+            {
+                stats[key.c_str ()] = bucket.getStatistics ();
+            }
+            return stats;
+        }
+
+        // return the state of the concurrency limiters for each device and operation class
+        jsonElement getConcurrencyStatistics ()
+        {
+            jsonElement stats;
+            stats.makeObject ();
+            for ( auto &[deviceId, deviceLimiters] : limiters )
+            {
+                for ( size_t priority = 0; priority < deviceLimiters.size (); priority++ )
+                {
+                    stats[deviceId.c_str ()][getPriorityName ( (dabPriority) priority )] = deviceLimiters[priority].getStatistics ();
+                }
+            }
+            return stats;
+        }
+
+        // single threaded builds only: publish any telemetry that is due on any device and return the time the next telemetry falls due
+        std::chrono::time_point<std::chrono::steady_clock> serviceTelemetry ()
+        {
+            auto next = std::chrono::time_point<std::chrono::steady_clock>::max ();
+            for ( auto &instance : instances )
+            {
+                next = std::min ( next, instance.second->serviceTelemetry () );
+            }
+            return next;
+        }
+
         // return a list of all operations supported by the specified class.   This is solely determined by implementation of the handler method.
         std::vector<std::string> getTopics() {
             std::vector<std::string> topics;
@@ -101,6 +388,30 @@ namespace DAB
             return topics;
         }
 
+        // true if deviceId is one of the bridge's devices
+        bool hasDevice ( std::string_view const &deviceId ) const
+        {
+            return instances.contains ( deviceId );
+        }
+
+        // the topics to subscribe to when routing locally: a dab/+/<operation> wildcard for each operation supported by any device, rather
+        // than a topic per device and operation.   Requests are routed to the device by route() as usual
+        std::vector<std::string> getWildcardTopics ()
+        {
+            std::vector<std::string> topics;
+            std::set<std::string, std::less<>> seen;
+            for ( auto const &topic : getTopics () )
+            {
+                auto deviceId = getDeviceId ( topic );
+                auto wildcard = deviceId.empty () ? topic : "dab/+" + topic.substr ( 4 + deviceId.size () );
+                if ( seen.insert ( wildcard ).second )
+                {
+                    topics.push_back ( std::move ( wildcard ) );
+                }
+            }
+            return topics;
+        }
+
         // This iterates through all the class's and sets the mqtt publish callback so that the class's can publish notifications (non-request/response)
         template<typename F>
         void setPublishCallback(F f)
@@ -132,18 +443,24 @@ namespace DAB
 		template<int dummy, class HEAD, class ... Tail, class ...VS>
 		dabInterface *makeInstances ( char const *deviceId, types<HEAD, Tail...>, VS &&...vs )
 		{
-            if ( sizeof... ( VS ) ) {
-                // check the name of type HEAD and see if it's the one we want to instantiate
-                if ( HEAD::isCompatible ( getFirstParameter(std::forward<VS>(vs)... ) ) ) {
-                    // it is, so instantiate HEAD and save a unique pointer to it in our map.  The key is the UUID
-                    instances.insert(std::move(std::make_pair(std::move(std::string(deviceId)), std::move(std::make_unique<HEAD>(deviceId, std::forward<VS>(vs)...)))));
-                    return instances.find(std::string_view(deviceId))->second.get();
+            if constexpr ( isDabPolicy<HEAD> ) {
+                // policies aren't device classes, skip over them
+                return makeInstances<dummy>(deviceId, types<Tail...>{}, std::forward<VS>(vs)...);
+            } else {
+                static_assert ( std::is_same_v<typename HEAD::threadingPolicy, threadingPolicy>, "device classes must use the same threading policy as the bridge" );
+                if constexpr ( sizeof... ( VS ) ) {
+                    // check the name of type HEAD and see if it's the one we want to instantiate
+                    if ( HEAD::isCompatible ( getFirstParameter(std::forward<VS>(vs)... ) ) ) {
+                        // it is, so instantiate HEAD and save a unique pointer to it in our map.  The key is the UUID
+                        instances.insert(std::move(std::make_pair(std::move(std::string(deviceId)), std::move(std::make_unique<HEAD>(deviceId, std::forward<VS>(vs)...)))));
+                        return addInstance ( deviceId );
+                    } else {
+                        return makeInstances<dummy>(deviceId, types<Tail...>{}, std::forward<VS>(vs)...);
+                    }
                 } else {
-                    return makeInstances<dummy>(deviceId, types<Tail...>{}, std::forward<VS>(vs)...);
+                    instances.insert(std::move(std::make_pair(std::move(std::string(deviceId)), std::move(std::make_unique<HEAD>(deviceId, std::forward<VS>(vs)...)))));
+                    return addInstance ( deviceId );
                 }
-            } else {
-                instances.insert(std::move(std::make_pair(std::move(std::string(deviceId)), std::move(std::make_unique<HEAD>(deviceId, std::forward<VS>(vs)...)))));
-                return instances.find(std::string_view(deviceId))->second.get();
             }
 		}
 
@@ -16,6 +16,8 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <initializer_list>
 #include <cassert>
@@ -23,10 +25,15 @@
 #include <cstring>
 #include <functional>
 #include <string>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <utility>
 
 #include "Json.h"
+#include "dabPipeline.h"
+#include "dabPolicy.h"
+#include "dabThreading.h"
 
 namespace DAB
 {
@@ -41,6 +48,28 @@ namespace DAB
         }
     };
 
+    // scheduling priority of an operation.   Control-plane operations (health-check, telemetry stop, ...) must never queue behind
+    //     bulk operations (output/image, voice/send-audio) which may take seconds to complete
+    enum class dabPriority
+    {
+        control,
+        normal,
+        bulk
+    };
+
+    inline char const *getPriorityName ( dabPriority priority )
+    {
+        switch ( priority )
+        {
+            case dabPriority::control:
+                return "control";
+            case dabPriority::bulk:
+                return "bulk";
+            default:
+                return "normal";
+        }
+    }
+
     class dabInterface;
 
     // our dispatcher base class.  This serves as the polymorphic interface to allow us to dispatch against specialized instances
@@ -213,6 +242,7 @@ namespace DAB
     class dabInterface
     {
         std::function< void(jsonElement const &) > publishCallback;
+        std::function< jsonElement(jsonElement const &) > batchCallback;
 
     public:
         virtual ~dabInterface () = default;
@@ -231,54 +261,97 @@ namespace DAB
             (publishCallback) ( elem );
         }
 
+        // set the callback used to execute each operation of a batch.   The bridge uses this to apply its limits to every operation.
+        // the callback may throw to refuse an operation
+        void setBatchCallback ( decltype ( batchCallback ) cb )
+        {
+            batchCallback = std::move ( cb );
+        }
+
+        // execute one operation of a batch, through the batch callback if one has been set
+        jsonElement dispatchBatched ( jsonElement const &req )
+        {
+            return batchCallback ? batchCallback ( req ) : dispatch ( req );
+        }
+
         // do nothing routine to return an array of topics that this class supports (for mqtt subscription)
         virtual std::vector<std::string> getTopics ()
         {
             return {};
         }
+
+        // return the scheduling priority of the operation addressed by topic
+        virtual dabPriority getPriority ( std::string_view const & /* topic */ )
+        {
+            return dabPriority::normal;
+        }
+
+        // stop accepting requests and wait (until deadline) for any requests being handled to complete.  Returns true if all completed
+        virtual bool drain ( std::chrono::time_point<std::chrono::steady_clock> /* deadline */ )
+        {
+            return true;
+        }
+
+        // single threaded builds only: publish any telemetry that is due and return the time the next telemetry falls due
+        virtual std::chrono::time_point<std::chrono::steady_clock> serviceTelemetry ()
+        {
+            return std::chrono::time_point<std::chrono::steady_clock>::max ();
+        }
     };
 
-    template< typename T >
+    // T is the class inheriting from dabClient (CRTP).   POLICIES is an optional list of compile-time policies (see dabPolicy.h):
+    //     a dabPipeline of interceptors wrapped around every request dispatched to this client
+    //     the threading model (dabMultiThreaded or dabSingleThreaded, see dabThreading.h)
+    template< typename T, typename ... POLICIES >
     class dabClient : public dabInterface
     {
+    public:
+        using threadingPolicy = selectPolicy_t<isDabThreading, dabMultiThreaded, POLICIES...>;
+
+    private:
+        using pipelineType = selectPolicy_t<isDabPipeline, dabPipeline<>, POLICIES...>;
+        [[no_unique_address]] pipelineType pipeline;
+
         const std::string protocolVersion = "2.0";          // version of the DAB protocol being implemented
         std::string ipAddress;                              // ip address for dab/discovery response
 
         // this is an XMACRO list of def() macro's.   It contains the dab method name, the name of the method to call and to arrays of fixed and optional parameters defined as string literals
+        // the last column is the dabPriority the operation is scheduled at
         // NOTE: multiple fixed or optional parameters need to be enclosed in ()   this is a preprocessor limitation, it will work just fine if you do this
 #define METHODS \
-            def( "/operations/list", opList, opList, {}, {} )                                                                                       \
-            def( "/applications/list", appList, appList, {}, {} )                                                                                   \
-            def( "/applications/launch", appLaunch, appLaunch, {"appId"}, {"parameters"} )                                                          \
-            def( "/applications/launch-with-content", appLaunchWithContent, appLaunchWithContent, ({ "appId", "contentId" }), { "parameters" } )    \
-            def( "/applications/get-state", appGetState, appGetState, { "appId" }, {} )                                                             \
-            def( "/applications/exit", appExit, appExit, {"appId"}, {"background"} )                                                                \
-            def( "/device/info", deviceInfo, deviceInfo, {}, {} )                                                                                   \
-            def( "/system/restart", systemRestart, systemRestart, {}, {} )                                                                          \
-            def( "/system/settings/list", systemSettingsList, systemSettingsList, {}, {} )                                                          \
-            def( "/system/settings/get", systemSettingsGet, systemSettingsGet, {}, {} )                                                             \
-            def( "/system/settings/set", systemSettingsSet, systemSettingsSet, { "*" }, {} )                                                 \
-            def( "/input/key/list", inputKeyList, inputKeyList, {}, {} )                                                                            \
-            def( "/input/key-press", inputKeyPress, inputKeyPress, { "keyCode"}, {} )                                                               \
-            def( "/input/long-key-press", inputKeyLongPress, inputKeyLongPress, ({ "keyCode", "durationMs" }), {} )                                \
-            def( "/output/image", outputImage, outputImage, {}, {} )                                                                                \
-            def( "/device-telemetry/start", deviceTelemetry, deviceTelemetryStartInternal, ({ "duration" }), {} )                          \
-            def( "/device-telemetry/stop", deviceTelemetry, deviceTelemetryStopInternal, {}, {} )                                                   \
-            def( "/app-telemetry/start", appTelemetry, appTelemetryStartInternal, ({ "appId", "duration" }), {} )                          \
-            def( "/app-telemetry/stop", appTelemetry, appTelemetryStopInternal, {"appId"}, {} )                                                     \
-            def( "/health-check/get", healthCheckGet, healthCheckGet, { }, {} )                                                                     \
-            def( "/voice/list", voiceList, voiceList, { }, {} )                                                                                     \
-            def( "/voice/set", voiceSet, voiceSet, { "voiceSystem" }, {} )                                                                         \
-            def( "/voice/send-audio", voiceSendAudio, voiceSendAudio, { "fileLocation" }, {"voiceSystem" } )                                       \
-            def( "/voice/send-text", voiceSendText, voiceSendText, { "requestText" }, {"voiceSystem" } )                                           \
-            def( "/version", version, version, { }, {} )
-
-        // map by operation storing a pointer to the dispatcher and a bool if it has been implemented by the user
-        std::map<std::string, std::pair<std::unique_ptr<dispatcher<T>>, bool>> dispatchMap;
+            def( "/operations/list", opList, opList, {}, {}, control )                                                                                      \
+            def( "/applications/list", appList, appList, {}, {}, normal )                                                                                   \
+            def( "/applications/launch", appLaunch, appLaunch, {"appId"}, {"parameters"}, normal )                                                          \
+            def( "/applications/launch-with-content", appLaunchWithContent, appLaunchWithContent, ({ "appId", "contentId" }), { "parameters" }, normal )    \
+            def( "/applications/get-state", appGetState, appGetState, { "appId" }, {}, normal )                                                             \
+            def( "/applications/exit", appExit, appExit, {"appId"}, {"background"}, normal )                                                                \
+            def( "/device/info", deviceInfo, deviceInfo, {}, {}, normal )                                                                                   \
+            def( "/system/restart", systemRestart, systemRestart, {}, {}, normal )                                                                          \
+            def( "/system/settings/list", systemSettingsList, systemSettingsList, {}, {}, normal )                                                          \
+            def( "/system/settings/get", systemSettingsGet, systemSettingsGet, {}, {}, normal )                                                             \
+            def( "/system/settings/set", systemSettingsSet, systemSettingsSet, { "*" }, {}, normal )                                                        \
+            def( "/input/key/list", inputKeyList, inputKeyList, {}, {}, normal )                                                                            \
+            def( "/input/key-press", inputKeyPress, inputKeyPress, { "keyCode"}, {}, normal )                                                               \
+            def( "/input/long-key-press", inputKeyLongPress, inputKeyLongPress, ({ "keyCode", "durationMs" }), {}, normal )                                 \
+            def( "/output/image", outputImage, outputImage, {}, {}, bulk )                                                                                  \
+            def( "/device-telemetry/start", deviceTelemetry, deviceTelemetryStartInternal, ({ "duration" }), {}, normal )                                   \
+            def( "/device-telemetry/stop", deviceTelemetry, deviceTelemetryStopInternal, {}, {}, control )                                                  \
+            def( "/app-telemetry/start", appTelemetry, appTelemetryStartInternal, ({ "appId", "duration" }), {}, normal )                                   \
+            def( "/app-telemetry/stop", appTelemetry, appTelemetryStopInternal, {"appId"}, {}, control )                                                    \
+            def( "/health-check/get", healthCheckGet, healthCheckGet, { }, {}, control )                                                                    \
+            def( "/voice/list", voiceList, voiceList, { }, {}, normal )                                                                                     \
+            def( "/voice/set", voiceSet, voiceSet, { "voiceSystem" }, {}, normal )                                                                          \
+            def( "/voice/send-audio", voiceSendAudio, voiceSendAudio, { "fileLocation" }, {"voiceSystem" }, bulk )                                          \
+            def( "/voice/send-text", voiceSendText, voiceSendText, { "requestText" }, {"voiceSystem" }, normal )                                            \
+            def( "/version", version, version, { }, {}, control )                                                                                           \
+            def( "/batch", batch, batch, { "operations" }, { "parallel" }, normal )
+
+        // map by operation storing a pointer to the dispatcher, a bool if it has been implemented by the user and the operation's scheduling priority
+        std::map<std::string, std::tuple<std::unique_ptr<dispatcher<T>>, bool, dabPriority>, std::less<>> dispatchMap;
 
         // telemetry mutex and condition variable for scheduling
-        std::mutex telemetryAccess;
-        std::condition_variable telemetryCondition;
+        typename threadingPolicy::mutex telemetryAccess;
+        typename threadingPolicy::condition_variable telemetryCondition;
 
         // base telemetry Executor class.   This will be specialized and should never be called directly.
         // we need this as the executor is polymorphic based on passed in types
@@ -376,9 +449,47 @@ namespace DAB
         }
 
         // telemetryTask is a worker thread, we use the exiting boolean to allow us to exit cleanly
-        std::atomic<bool> exiting = false;
+        typename threadingPolicy::template atomic<bool> exiting = false;
 
-        // this is our main scheduling thread
+        // number of requests currently being handled, and set once drain() has been called to refuse any new ones
+        typename threadingPolicy::template atomic<size_t> inFlight = 0;
+        typename threadingPolicy::template atomic<bool> draining = false;
+
+        // stop the telemetry worker.  Once this returns no further telemetry will be published
+        void stopTelemetry ()
+        {
+            {
+                std::lock_guard l1 ( telemetryAccess );
+                exiting = true;
+            }
+            telemetryCondition.notify_all ();
+            if ( telemetryThreadId.joinable () )
+            {
+                telemetryThreadId.join ();
+            }
+        }
+
+        // publish all telemetry that has fallen due and return the time at which the next telemetry falls due.  telemetryAccess must be held
+        std::chrono::time_point<std::chrono::steady_clock> publishDueTelemetry ()
+        {
+            auto now = std::chrono::steady_clock::now ();
+            // check to see if our next to fire event time has been passed, if so get the telemetry data and publish it
+            while ( !exiting && !telemetryScheduler.empty () && telemetryScheduler.begin ()->first <= now )
+            {
+                // get the telemetry data (calling the callback passed in during addTelemetry)
+                auto rsp = std::get<2>(telemetryScheduler.begin ()->second).get()->getTelemetry ();
+                // call the publish callback to send the telemetry data to any subscribers
+                publish ( { { "topic", std::get<1>(telemetryScheduler.begin ()->second) }, {"payload", rsp} } );
+
+                // extract the node entry, calculate a new key value (execution time) and reinsert (no reallocation or copying, just some pointer manipulation so this is fast
+                auto nodeHandle = telemetryScheduler.extract ( telemetryScheduler.begin ()->first );
+                nodeHandle.key () = std::get<2>(nodeHandle.mapped()).get()->getNextScheduledTime ();
+                telemetryScheduler.insert ( std::move(nodeHandle) );
+            }
+            return telemetryScheduler.empty () ? std::chrono::time_point<std::chrono::steady_clock>::max () : telemetryScheduler.begin ()->first;
+        }
+
+        // this is our main scheduling thread (multi-threaded builds only, single threaded builds call serviceTelemetry from the interface's loop)
         void telemetryTask ()
         {
             // keep going so long as our exiting boolean has not been set to true
@@ -395,22 +506,7 @@ namespace DAB
                     //    or until our next-scheduled telemetry time is exceeded
                     telemetryCondition.wait_until( l1, telemetryScheduler.begin ()->first );
                 }
-                if ( !telemetryScheduler.empty ())
-                {
-                    // check to see if our next to fire event time has been passed, if so get the telemetry data and publish it
-                    if ( telemetryScheduler.begin ()->first < std::chrono::steady_clock::now ())
-                    {
-                        // get the telemetry data (calling the callback passed in during addTelemetry)
-                        auto rsp = std::get<2>(telemetryScheduler.begin ()->second).get()->getTelemetry ();
-                        // call the publish callback to send the telemetry data to any subscribers
-                        publish ( { { "topic", std::get<1>(telemetryScheduler.begin ()->second) }, {"payload", rsp} } );
-
-                        // extract the node entry, calculate a new key value (execution time) and reinsert (no reallocation or copying, just some pointer manipulation so this is fast
-                        auto nodeHandle = telemetryScheduler.extract ( telemetryScheduler.begin ()->first );
-                        nodeHandle.key () = std::get<2>(nodeHandle.mapped()).get()->getNextScheduledTime ();
-                        telemetryScheduler.insert ( std::move(nodeHandle) );
-                    }
-                }
+                publishDueTelemetry ();
             }
         }
 
@@ -427,10 +523,10 @@ namespace DAB
             // XMACRO instantiation of our list of method names, methods and fixed and optional parameters
             // this is resolved into a map of method name and a pair of unique pointers to a nativeDispatcher
             //     instance and a bool indicating if the method was overridden by the instantiating class (must be done using CRTP)
-#define def( methName, detectFunc, callFunc, fixedParams, optionalParams )                                                                                                                                                                                            \
+#define def( methName, detectFunc, callFunc, fixedParams, optionalParams, priority )                                                                                                                                                                                          \
                 {                                                                                                       \
                     auto disp = std::make_unique<nativeDispatch<std::initializer_list<char const *>fixedParams.size (), std::initializer_list<char const *>optionalParams.size (), T, decltype(&T::callFunc)>> ( &T::callFunc, std::vector<std::string_view> fixedParams, std::vector<std::string_view> optionalParams );   \
-                    auto p1 = std::make_pair ( std::move ( disp ), !std::is_same_v<decltype(&dabClient::detectFunc), decltype(&T::detectFunc)> || !strcmp ( "/operations/list", (methName) ) || !strcmp ( "/version", (methName) ) );                                    \
+                    auto p1 = std::make_tuple ( std::move ( disp ), !std::is_same_v<decltype(&dabClient::detectFunc), decltype(&T::detectFunc)> || !strcmp ( "/operations/list", (methName) ) || !strcmp ( "/version", (methName) ) || !strcmp ( "/batch", (methName) ), dabPriority::priority );    \
                     auto p2 = std::make_pair ( std::string ( "dab/" ) + deviceId + (methName), std::move ( p1 ) );                                                                                                                                            \
                     dispatchMap.insert ( std::move ( p2) );                                                                                                                                                                                                    \
                 }
@@ -439,12 +535,22 @@ namespace DAB
             // dab/discovery.   special as it doesn't have deviceID
             {                                                                                                       \
                     auto disp = std::make_unique<nativeDispatch<0, 0, T, decltype(&T::discovery)>> ( &T::discovery, std::vector<std::string_view> {}, std::vector<std::string_view> {} );   \
-                    auto p1 = std::make_pair ( std::move ( disp ), false );                                    \
+                    auto p1 = std::make_tuple ( std::move ( disp ), false, dabPriority::normal );              \
                     auto p2 = std::make_pair ( std::string ( "dab/discovery" ), std::move ( p1 ) );                                                                                                                                            \
                     dispatchMap.insert ( std::move ( p2) );                                                                                                                                                                                                    \
             }
 
-            telemetryThreadId = std::thread ( &dabClient::telemetryTask, this );
+            if constexpr ( threadingPolicy::concurrent )
+            {
+                telemetryThreadId = std::thread ( &dabClient::telemetryTask, this );
+            }
+        }
+
+        // single threaded builds: publish any due telemetry and return when the next telemetry falls due
+        std::chrono::time_point<std::chrono::steady_clock> serviceTelemetry () override
+        {
+            std::lock_guard l1 ( telemetryAccess );
+            return publishDueTelemetry ();
         }
 
         // this is the getTopics instantiation.  It returns a list of all the operations we support so that we subscribe to them
@@ -454,7 +560,7 @@ namespace DAB
             std::vector<std::string> topics;
             for ( auto const &it: dispatchMap )
             {
-                if ( it.second.second )
+                if ( std::get<1> ( it.second ) )
                 {
                     // return operation, but trim off leading dab/<deviceId>/
                    topics.push_back ( it.first );
@@ -463,21 +569,49 @@ namespace DAB
             return topics;
         }
 
+        // return the scheduling priority of the operation as specified in the METHODS table
+        dabPriority getPriority ( std::string_view const &topic ) override
+        {
+            auto it = dispatchMap.find ( topic );
+            if ( it != dispatchMap.end ())
+            {
+                return std::get<2> ( it->second );
+            }
+            return dabPriority::normal;
+        }
+
+        // stop telemetry and any new requests, then wait for requests already being handled to complete.
+        // this must be called while the derived class still exists (the bridge does so before destroying its instances), by the time
+        // ~dabClient runs, the handlers have already been destroyed
+        bool drain ( std::chrono::time_point<std::chrono::steady_clock> deadline ) override
+        {
+            draining = true;
+            stopTelemetry ();
+            while ( inFlight )
+            {
+                if ( std::chrono::steady_clock::now () >= deadline )
+                {
+                    return false;
+                }
+                std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+            }
+            return true;
+        }
+
         ~dabClient () override
         {
             // set exiting, notify our telemetry worker thread and wait for it to exit
-            exiting = true;
-            telemetryCondition.notify_all();
-            telemetryThreadId.join();
+            stopTelemetry ();
         }
 
         // this is our implementation of opList.   It uses the overridden bool to specify if the operation is supported and only returns operations that the client supports
+        // batch is an adapter extension rather than a DAB operation, so it's subscribed to but not listed
         jsonElement opList ()
         {
             jsonElement elem;
             for ( auto const &it: dispatchMap )
             {
-                if ( it.second.second )
+                if ( std::get<1> ( it.second ) && !it.first.ends_with ( "/batch" ) )
                 {
                     // return operation, but trim off leading dab/<deviceId>/
                     elem["operations"].push_back ( std::string ( it.first.c_str() + it.first.find ( '/', it.first.find ( '/' ) + 1 ) + 1 ) );
@@ -494,6 +628,65 @@ namespace DAB
             return elem;
         }
 
+        // adapter extension: executes an ordered array of operations in a single request and returns an array of their responses in the same order
+        //     each element of operations is of the form { "operation": "input/key-press", "payload": { "keyCode": "KEY_ENTER" } }
+        // the operations are all for this device, so like the device's other requests they're executed one at a time, in order, on the worker
+        // executing the batch.   parallel is accepted for compatibility, running a device's operations concurrently would break that ordering
+        jsonElement batch ( jsonElement const &operations, bool /* parallel */ )
+        {
+            if ( !operations.isArray () )
+            {
+                throw dabException{400, "operations must be an array"};
+            }
+
+            // build the individual requests up front so that errors in the batch itself are reported before anything is executed
+            std::vector<jsonElement> requests;
+            requests.reserve ( operations.size () );
+            for ( auto it = operations.cbeginArray (); it != operations.cendArray (); it++ )
+            {
+                if ( !it->has ( "operation" ) )
+                {
+                    throw dabException{400, "missing parameter \"operation\""};
+                }
+                jsonElement req;
+                req["topic"] = std::string ( "dab/" ) + deviceId + "/" + (std::string const &) (*it)["operation"];
+                if ( it->has ( "payload" ) )
+                {
+                    req["payload"] = (*it)["payload"];
+                } else
+                {
+                    req["payload"].makeObject ();
+                }
+                requests.push_back ( std::move ( req ) );
+            }
+
+            // each operation goes through the normal dispatcher (and any limits the bridge applies), so responses (including errors) are exactly what
+            // the operation would have returned on its own
+            auto execute = [this] ( jsonElement const &req ) -> jsonElement {
+                std::string const &topic = req["topic"];
+                auto it = dispatchMap.find ( topic );
+                if ( it == dispatchMap.end () || !std::get<1> ( it->second ) || topic.ends_with ( "/batch" ) )
+                {
+                    return {{"status", 400}, {"error", "operation not supported"}};
+                }
+                try
+                {
+                    return dispatchBatched ( req );
+                } catch ( ... )
+                {
+                    return errorResponse ();
+                }
+            };
+
+            jsonElement rsp;
+            rsp["responses"].makeArray ().reserve ( requests.size () );
+            for ( auto const &req : requests )
+            {
+                rsp["responses"].push_back ( execute ( req ) );
+            }
+            return rsp;
+        }
+
         // returns the currently supported protocol version
         jsonElement discovery ()
         {
@@ -551,6 +744,41 @@ namespace DAB
         // publishes it using the response topic.
         // it catches any exceptions and builds appropriate dab error responses should a failure occur
         jsonElement dispatch ( jsonElement const &elem ) override
+        {
+            // track the number of requests in flight so that drain() can wait for them
+            inFlight++;
+            struct inFlightGuard
+            {
+                decltype ( dabClient::inFlight ) &inFlight;
+                ~inFlightGuard ()
+                {
+                    inFlight--;
+                }
+            } guard{inFlight};
+
+            try
+            {
+                if ( draining )
+                {
+                    throw dabException{503, "adapter shutting down"};
+                }
+                return pipeline.invoke ( elem, [this] ( jsonElement const &req ) { return invokeHandler ( req ); } );
+            } catch ( ... )
+            {
+                // an interceptor threw
+                return errorResponse ();
+            }
+        }
+
+        // returns the interceptor pipeline so that interceptors may be configured
+        pipelineType &getPipeline ()
+        {
+            return pipeline;
+        }
+
+    private:
+        // call the handler for the request and build the response
+        jsonElement invokeHandler ( jsonElement const &elem )
         {
             jsonElement rsp;
             try
@@ -560,28 +788,42 @@ namespace DAB
                 auto it = dispatchMap.find ( topic );
                 if ( it != dispatchMap.end ())
                 {
-                    rsp = (*it->second.first) ( static_cast<T *>(this), elem );
+                    rsp = (*std::get<0> ( it->second )) ( static_cast<T *>(this), elem );
                 }
                 if ( !rsp.has ( "status" ))
                 {
                     rsp["status"] = 200;
                 }
+            } catch ( ... )
+            {
+                rsp = errorResponse ();
+            }
+            return rsp;
+        }
+
+        // builds the dab error response for the exception currently being handled.  Must be called from within a catch block
+        static jsonElement errorResponse ()
+        {
+            try
+            {
+                throw;
             } catch ( std::pair<int, std::string> &e )
             {
-                rsp = { { "status", e.first, "error", e.second } };
+                return { { "status", e.first }, { "error", e.second } };
             } catch ( std::pair<int, char const *> &e )
             {
-                rsp = { { "status", e.first, "error", e.second } };
+                return { { "status", e.first }, { "error", e.second } };
             } catch ( dabException &e )
             {
-                rsp = { { "status", e.errorCode, "error", e.errorText } };
+                return { { "status", e.errorCode }, { "error", e.errorText } };
             } catch ( ... )
             {
-                rsp = { { "status", 400, "error", "unable to parse request" } };
+                return { { "status", 400 }, { "error", "unable to parse request" } };
             }
-            return rsp;
         }
 
+    public:
+
         /* support function to execute a system command and return the results */
         std::string execCmd ( std::string const &cmd )
         {
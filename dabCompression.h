@@ -0,0 +1,134 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#if defined ( DAB_COMPRESSION )
+#include <zlib.h>
+#endif
+
+// optional response payload compression.
+// a requester that can inflate responses says so with an "accept-encoding" MQTT 5 user property on its request, listing the encodings it
+// understands ("deflate").   Responses to it that are at least the configured size are deflated (zlib format, as in HTTP's deflate) and
+// carry a "content-encoding: deflate" user property.   Requesters that don't ask always get plain json, so enabling compression never
+// breaks an existing controller.
+// compression needs zlib and is only built when DAB_COMPRESSION is defined (the DAB_COMPRESSION cmake option)
+namespace DAB
+{
+    // names of the user properties used to negotiate compression
+    constexpr std::string_view acceptEncodingProperty = "accept-encoding";
+    constexpr std::string_view contentEncodingProperty = "content-encoding";
+    constexpr std::string_view deflateEncoding = "deflate";
+
+    // is compression built in
+    constexpr bool dabCompressionAvailable =
+#if defined ( DAB_COMPRESSION )
+            true;
+#else
+            false;
+#endif
+
+    // true if the comma separated list of encodings in an accept-encoding property includes deflate
+    inline bool dabAcceptsDeflate ( std::string_view acceptEncoding )
+    {
+        while ( !acceptEncoding.empty () )
+        {
+            auto end = acceptEncoding.find ( ',' );
+            auto encoding = acceptEncoding.substr ( 0, end );
+            while ( !encoding.empty () && encoding.front () == ' ' )
+            {
+                encoding.remove_prefix ( 1 );
+            }
+            while ( !encoding.empty () && encoding.back () == ' ' )
+            {
+                encoding.remove_suffix ( 1 );
+            }
+            if ( encoding == deflateEncoding )
+            {
+                return true;
+            }
+            if ( end == std::string_view::npos )
+            {
+                break;
+            }
+            acceptEncoding.remove_prefix ( end + 1 );
+        }
+        return false;
+    }
+
+    // deflates payloads into a caller supplied buffer.   The zlib stream (and its ~256KB of state) is set up once and reset between payloads,
+    // so a thread keeps one and compresses without allocating
+    class dabDeflater
+    {
+#if defined ( DAB_COMPRESSION )
+        z_stream stream{};
+        bool initialized = false;
+#endif
+
+    public:
+        dabDeflater () = default;
+        dabDeflater ( dabDeflater const & ) = delete;
+        dabDeflater &operator= ( dabDeflater const & ) = delete;
+
+        ~dabDeflater ()
+        {
+#if defined ( DAB_COMPRESSION )
+            if ( initialized )
+            {
+                deflateEnd ( &stream );
+            }
+#endif
+        }
+
+        // compress in to out.   Returns false, leaving out undefined, if compression isn't built in or wouldn't make the payload smaller
+        bool deflate ( std::string_view in, std::string &out )
+        {
+#if defined ( DAB_COMPRESSION )
+            if ( !initialized )
+            {
+                // favour speed, responses are compressed on the worker thread that produced them
+                if ( deflateInit ( &stream, Z_BEST_SPEED ) != Z_OK )
+                {
+                    return false;
+                }
+                initialized = true;
+            } else
+            {
+                deflateReset ( &stream );
+            }
+
+            // anything that doesn't fit in the size of the input isn't worth sending compressed
+            out.resize ( in.size () );
+            stream.next_in = (Bytef *) in.data ();
+            stream.avail_in = (uInt) in.size ();
+            stream.next_out = (Bytef *) out.data ();
+            stream.avail_out = (uInt) out.size ();
+            if ( ::deflate ( &stream, Z_FINISH ) != Z_STREAM_END )
+            {
+                return false;
+            }
+            out.resize ( stream.total_out );
+            return true;
+#else
+            (void) in;
+            (void) out;
+            return false;
+#endif
+        }
+    };
+}
@@ -0,0 +1,236 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "Json.h"
+#include "dabThreading.h"
+
+namespace DAB
+{
+    // outbound traffic classes.   Responses are always sent before telemetry
+    enum class dabTrafficClass
+    {
+        response,
+        telemetry
+    };
+
+    // weighted fair queue of outbound messages keyed by device, using deficit round robin.
+    // each traffic class has its own round of active devices.   When a device reaches the front of the round it may send messages until their
+    // total cost (bytes) exceeds its deficit, after which it's topped up by quantum * weight and moved to the back.   A device sending large or
+    // frequent messages therefore gets the same share of the connection as any other device, rather than a share proportional to its traffic.
+    // the response class is always served first, so a chatty device's telemetry can never delay another device's responses.
+    //
+    // telemetry is bounded per device.   When a device's telemetry backlog exceeds maxTelemetryDepth the oldest sample is dropped, a stale
+    // sample being of little use when a newer one is waiting behind it.
+    //
+    // push and pop are intended to be called from a single thread (the publisher), the mutex only serializes them with getStatistics().
+    // popped values are recycled: push swaps the caller's value with a spare so that buffers are handed back rather than freed
+    template< typename T, typename THREADING = dabMultiThreaded >
+    class dabFairQueue
+    {
+        constexpr static size_t nClasses = (size_t) dabTrafficClass::telemetry + 1;
+
+        struct entry
+        {
+            std::chrono::time_point<std::chrono::steady_clock> queued;
+            size_t cost;
+            T value;
+        };
+
+        struct device
+        {
+            std::array<std::deque<entry>, nClasses> queues;
+            std::array<int64_t, nClasses> deficit{};
+            std::array<bool, nClasses> active{};
+            uint32_t weight = 1;
+
+            // metrics
+            uint64_t sent = 0;
+            uint64_t dropped = 0;
+            uint64_t totalWaitUs = 0;
+            uint64_t maxWaitUs = 0;
+        };
+
+        typename THREADING::mutex access;
+
+        std::map<std::string, device, std::less<>> devices;            // never erased, so device pointers are stable
+        std::array<std::deque<device *>, nClasses> rounds;
+        std::vector<T> spares;
+        size_t queued = 0;
+
+        size_t quantum = 16 * 1024;
+        size_t maxTelemetryDepth = 256;
+
+        device &getDevice ( std::string_view const &deviceId )
+        {
+            auto it = devices.find ( deviceId );
+            if ( it == devices.end () )
+            {
+                it = devices.emplace ( std::string ( deviceId ), device{} ).first;
+            }
+            return it->second;
+        }
+
+        void recycle ( T &&value )
+        {
+            spares.push_back ( std::move ( value ) );
+        }
+
+    public:
+        // quantum is the number of bytes a device of weight 1 may send each round
+        void configure ( size_t quantumBytes, size_t telemetryDepth )
+        {
+            std::lock_guard l1 ( access );
+            quantum = std::max ( quantumBytes, (size_t) 1 );
+            maxTelemetryDepth = std::max ( telemetryDepth, (size_t) 1 );
+        }
+
+        // a device of weight n receives n times the share of a device of weight 1
+        void setWeight ( std::string_view const &deviceId, uint32_t weight )
+        {
+            std::lock_guard l1 ( access );
+            getDevice ( deviceId ).weight = std::max ( weight, (uint32_t) 1 );
+        }
+
+        // queue value for deviceId.   value is swapped with a recycled T, so on return it holds the buffers of a previously sent message
+        void push ( std::string_view const &deviceId, dabTrafficClass trafficClass, std::chrono::time_point<std::chrono::steady_clock> queuedAt, size_t cost, T &value )
+        {
+            std::lock_guard l1 ( access );
+            auto &dev = getDevice ( deviceId );
+            auto cls = (size_t) trafficClass;
+            auto &q = dev.queues[cls];
+
+            if ( trafficClass == dabTrafficClass::telemetry && q.size () >= maxTelemetryDepth )
+            {
+                recycle ( std::move ( q.front ().value ) );
+                q.pop_front ();
+                queued--;
+                dev.dropped++;
+            }
+
+            entry e{queuedAt, cost, {}};
+            if ( !spares.empty () )
+            {
+                e.value = std::move ( spares.back () );
+                spares.pop_back ();
+            }
+            std::swap ( e.value, value );
+            q.push_back ( std::move ( e ) );
+            queued++;
+
+            if ( !dev.active[cls] )
+            {
+                dev.active[cls] = true;
+                dev.deficit[cls] = (int64_t) (quantum * dev.weight);
+                rounds[cls].push_back ( &dev );
+            }
+        }
+
+        // remove the next message due to be sent and call func ( T & ) with it.   Returns false if there is nothing queued
+        template< typename F >
+        bool pop ( F &&func )
+        {
+            std::unique_lock l1 ( access );
+            for ( size_t cls = 0; cls < nClasses; cls++ )
+            {
+                auto &round = rounds[cls];
+                while ( !round.empty () )
+                {
+                    auto *dev = round.front ();
+                    auto &q = dev->queues[cls];
+                    if ( q.empty () )
+                    {
+                        // nothing left to send, leave the round
+                        dev->active[cls] = false;
+                        round.pop_front ();
+                        continue;
+                    }
+                    if ( (int64_t) q.front ().cost > dev->deficit[cls] )
+                    {
+                        // used up its share for this round
+                        dev->deficit[cls] += (int64_t) (quantum * dev->weight);
+                        round.pop_front ();
+                        round.push_back ( dev );
+                        continue;
+                    }
+
+                    auto e = std::move ( q.front () );
+                    q.pop_front ();
+                    queued--;
+                    dev->deficit[cls] -= (int64_t) e.cost;
+                    if ( q.empty () )
+                    {
+                        // an idle device doesn't bank credit
+                        dev->active[cls] = false;
+                        dev->deficit[cls] = 0;
+                        round.pop_front ();
+                    }
+
+                    auto waited = (uint64_t) std::chrono::duration_cast<std::chrono::microseconds> ( std::chrono::steady_clock::now () - e.queued ).count ();
+                    dev->sent++;
+                    dev->totalWaitUs += waited;
+                    dev->maxWaitUs = std::max ( dev->maxWaitUs, waited );
+
+                    // don't hold the lock while sending, we're the only consumer so the entry is ours
+                    l1.unlock ();
+                    func ( e.value );
+                    l1.lock ();
+                    recycle ( std::move ( e.value ) );
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool empty ()
+        {
+            std::lock_guard l1 ( access );
+            return !queued;
+        }
+
+        // per device queue depths, messages sent and dropped, and the average and maximum time messages waited to be sent
+        jsonElement getStatistics ()
+        {
+            std::lock_guard l1 ( access );
+            jsonElement stats;
+            stats["queued"] = queued;
+            stats["devices"].makeObject ();
+            for ( auto const &[deviceId, dev] : devices )
+            {
+                stats["devices"][deviceId.c_str ()] = {{"responsesQueued", dev.queues[(size_t) dabTrafficClass::response].size ()},
+                                                       {"telemetryQueued", dev.queues[(size_t) dabTrafficClass::telemetry].size ()},
+                                                       {"sent",            dev.sent},
+                                                       {"dropped",         dev.dropped},
+                                                       {"avgWaitUs",       dev.sent ? dev.totalWaitUs / dev.sent : 0},
+                                                       {"maxWaitUs",       dev.maxWaitUs},
+                                                       {"weight",          (int64_t) dev.weight}};
+            }
+            return stats;
+        }
+    };
+}
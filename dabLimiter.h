@@ -0,0 +1,250 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "Json.h"
+#include "dabThreading.h"
+
+namespace DAB
+{
+    // adaptive concurrency limiter using additive-increase/multiplicative-decrease
+    // the limit bounds the number of requests admitted for a device: received and not yet completed, whether they're executing or queued
+    // behind the device's earlier requests.   A request is admitted by acquire () as it arrives and counts against the limit until its permit
+    // is destroyed.
+    // the limiter tracks the lowest recent handler latency of each operation (its latency on an unloaded device), from samples given to
+    // record ().   As long as handlers complete within tolerance * their operation's baseline and we're actually using our allowance, the
+    // limit grows by one per window.   Once handler latency starts to climb the device is struggling, so the limit is cut back
+    // multiplicatively and further requests are refused straight away rather than left to wait behind it.
+    // baselines are kept per operation because operations in one class can differ widely (a cached device/info against an app launch), and are
+    // the minimum over the last one to two windows of samples, so a single fast outlier is forgotten and a device which has become permanently
+    // slower doesn't stay pinned at minLimit.
+    template< typename THREADING = dabMultiThreaded >
+    class dabConcurrencyLimiter
+    {
+        typename THREADING::mutex access;
+
+        double limit = 8;
+        double minLimit = 1;
+        double maxLimit = 256;
+        size_t inFlight = 0;
+
+        constexpr static double tolerance = 2.0;              // latency above tolerance * baseline is considered congested
+        constexpr static double minExcessUs = 1000;           // ... and exceeds it by this much, so jitter on a fast handler isn't congestion
+        constexpr static double backoff = 0.9;                // multiplicative decrease on congestion
+        constexpr static uint32_t baselineWindow = 256;       // samples of an operation per baseline window
+        constexpr static size_t maxBaselines = 64;            // operations tracked separately, any others share one baseline
+
+        // minimum latency, in microseconds, over the previous and the current window of samples
+        struct baseline
+        {
+            double previous = 0;
+            double current = 0;
+            uint32_t samples = 0;
+
+            double update ( double sample )
+            {
+                current = current == 0 ? sample : std::min ( current, sample );
+                auto result = previous == 0 ? current : std::min ( previous, current );
+                if ( ++samples == baselineWindow )
+                {
+                    previous = current;
+                    current = 0;
+                    samples = 0;
+                }
+                return result;
+            }
+        };
+
+        std::map<std::string, baseline, std::less<>> baselines;
+        uint64_t rejected = 0;
+
+        // a request admitted by acquire () has completed (or been discarded)
+        void release ()
+        {
+            std::lock_guard l1 ( access );
+            inFlight--;
+        }
+
+    public:
+        void configure ( size_t initialLimit, size_t minimumLimit, size_t maximumLimit )
+        {
+            std::lock_guard l1 ( access );
+            minLimit = (double) std::max ( minimumLimit, (size_t) 1 );
+            maxLimit = (double) std::max ( maximumLimit, minimumLimit );
+            limit = std::clamp ( (double) initialLimit, minLimit, maxLimit );
+        }
+
+        // an admitted request.   It counts against the limit until the permit is destroyed
+        class permit
+        {
+            dabConcurrencyLimiter *limiter = nullptr;
+
+            friend dabConcurrencyLimiter;
+
+            explicit permit ( dabConcurrencyLimiter *limiter ) : limiter ( limiter )
+            {
+            }
+
+        public:
+            permit () = default;
+            permit ( permit const & ) = delete;
+            permit &operator= ( permit const & ) = delete;
+
+            permit ( permit &&old ) noexcept : limiter ( old.limiter )
+            {
+                old.limiter = nullptr;
+            }
+
+            permit &operator= ( permit &&old ) noexcept
+            {
+                if ( this != &old )
+                {
+                    if ( limiter )
+                    {
+                        limiter->release ();
+                    }
+                    limiter = old.limiter;
+                    old.limiter = nullptr;
+                }
+                return *this;
+            }
+
+            ~permit ()
+            {
+                if ( limiter )
+                {
+                    limiter->release ();
+                }
+            }
+
+            explicit operator bool () const
+            {
+                return limiter != nullptr;
+            }
+        };
+
+        // try to admit a request.   Returns an empty permit if we're at our current limit, in which case the request must be rejected
+        permit acquire ()
+        {
+            std::lock_guard l1 ( access );
+            if ( (double) inFlight >= limit )
+            {
+                rejected++;
+                return {};
+            }
+            inFlight++;
+            return permit ( this );
+        }
+
+        // an admitted request's handler completed successfully after latency.   Requests that failed aren't samples, they may never have
+        // reached the device
+        void record ( std::string_view operation, std::chrono::microseconds latency )
+        {
+            std::lock_guard l1 ( access );
+
+            // only grow if we've been using at least half our allowance, otherwise we'd grow without bound on an idle device
+            bool saturated = (double) inFlight * 2 >= limit;
+
+            auto it = baselines.find ( operation );
+            if ( it == baselines.end () )
+            {
+                it = baselines.try_emplace ( std::string ( baselines.size () < maxBaselines ? operation : std::string_view () ) ).first;
+            }
+            auto latencyUs = (double) std::max ( latency.count (), (int64_t) 1 );
+            auto baselineLatency = it->second.update ( latencyUs );
+
+            if ( latencyUs > baselineLatency * tolerance && latencyUs > baselineLatency + minExcessUs )
+            {
+                limit = std::max ( minLimit, limit * backoff );
+            } else if ( saturated )
+            {
+                limit = std::min ( maxLimit, limit + 1.0 / limit );
+            }
+        }
+
+        jsonElement getStatistics ()
+        {
+            std::lock_guard l1 ( access );
+            jsonElement stats{ {"limit",    (int64_t) limit},
+                               {"inFlight", inFlight},
+                               {"rejected", rejected} };
+            stats["baselineLatencyUs"].makeObject ();
+            for ( auto const &[operation, b] : baselines )
+            {
+                stats["baselineLatencyUs"][operation.c_str ()] = (int64_t) (b.previous == 0 ? b.current : b.current == 0 ? b.previous : std::min ( b.previous, b.current ));
+            }
+            return stats;
+        }
+    };
+
+    // token bucket rate limiter.   Tokens are added at rate per second up to a maximum of burst.   Each request consumes one token.
+    // used to keep fragile end devices from being driven harder than they can absorb (key presses faster than the UI can process for instance)
+    template< typename THREADING = dabMultiThreaded >
+    class dabTokenBucket
+    {
+        typename THREADING::mutex access;
+
+        double rate;
+        double burst;
+        double tokens;
+        std::chrono::time_point<std::chrono::steady_clock> lastRefill;
+        uint64_t limited = 0;
+
+    public:
+        dabTokenBucket ( double ratePerSecond, double burst ) : rate ( ratePerSecond ), burst ( std::max ( burst, 1.0 ) ), tokens ( this->burst ), lastRefill ( std::chrono::steady_clock::now () )
+        {
+        }
+
+        // returns true if a token was available (and consumed)
+        bool tryTake ()
+        {
+            std::lock_guard l1 ( access );
+            auto now = std::chrono::steady_clock::now ();
+            tokens = std::min ( burst, tokens + std::chrono::duration<double> ( now - lastRefill ).count () * rate );
+            lastRefill = now;
+            if ( tokens < 1.0 )
+            {
+                limited++;
+                return false;
+            }
+            tokens -= 1.0;
+            return true;
+        }
+
+        // return a token taken by tryTake () for a request that was then refused by another limit
+        void giveBack ()
+        {
+            std::lock_guard l1 ( access );
+            tokens = std::min ( burst, tokens + 1.0 );
+        }
+
+        jsonElement getStatistics ()
+        {
+            std::lock_guard l1 ( access );
+            return {{"rate",    rate},
+                    {"burst",   burst},
+                    {"limited", limited}};
+        }
+    };
+}
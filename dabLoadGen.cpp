@@ -0,0 +1,948 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+// end to end load generator and latency benchmark.
+// an adapter with M simulated devices is run in this process and N simulated controllers send it a weighted mix of DAB operations through a
+// real transport.   Load is open loop: each controller sends on a fixed (or poisson) schedule whatever the adapter's response times, and a
+// request's latency is measured from when it was due to be sent, so an adapter that stalls shows up as latency rather than as a lower request
+// rate.   Every request carries MQTT 5 correlation data and its controller's response topic, and responses are matched back to their request.
+//     dab-loadgen [options]
+//         --transport T         loopback: in process, no sockets (default)
+//                               shm: shared memory rings, see dabShmInterface.h
+//                               broker: the adapter's embedded broker, controllers connect over tcp
+//                               mqtt: an external broker at --broker, the adapter connects with dabMQTTNativeInterface
+//                               mqtt-local: as mqtt, but the broker is a dabMQTTBrokerInterface without devices run in this process, so
+//                               the native client can be tested without an external broker
+//         --broker host:port    the broker for mqtt (127.0.0.1:1883), the listen address for broker (127.0.0.1:18830) and mqtt-local
+//                               (127.0.0.1:18831)
+//         --socket path         the unix socket for shm (/tmp/dab-loadgen.sock)
+//         --controllers N       simulated controllers (4)
+//         --devices M           simulated devices (16)
+//         --rate R              requests per second, across all controllers (10000)
+//         --duration S          seconds of measured load (10)
+//         --warmup S            seconds of load before that, not included in the results (1)
+//         --timeout S           seconds to wait for outstanding responses once the load stops (5)
+//         --mix op=weight,...   the operations to send and their proportions
+//                               (input/key-press=60,applications/get-state=20,system/settings/get=10,device/info=10)
+//         --poisson             exponentially distributed gaps between a controller's requests instead of a fixed interval
+//         --service-us U        microseconds each simulated device operation takes (0)
+//         --slowdown U          microseconds each simulated device operation takes once the warmup is over, as if the devices had become
+//                               overloaded (no slowdown)
+//         --threads T           sender threads, controllers are divided among them (the smaller of N and 4)
+//         --queue-limits G,D    the adapter's global and per device queue limits (65536,65536)
+//         --concurrency-limits I,MIN,MAX
+//                               enable the bridge's adaptive concurrency limits, with these initial, minimum and maximum limits (off)
+//         --json                print the results as json
+//         --stats               print the adapter's statistics after the run
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dabLoopbackInterface.h"
+#include "dabMqttBrokerInterface.h"
+#include "dabMqttCodec.h"
+#include "dabMqttNativeInterface.h"
+#include "dabShmInterface.h"
+#include "dabShmRing.h"
+
+struct options
+{
+    std::string transport = "loopback";
+    std::string broker;
+    std::string socketPath = "/tmp/dab-loadgen.sock";
+    size_t controllers = 4;
+    size_t devices = 16;
+    double rate = 10000;
+    double duration = 10;
+    double warmup = 1;
+    double timeout = 5;
+    std::string mix = "input/key-press=60,applications/get-state=20,system/settings/get=10,device/info=10";
+    bool poisson = false;
+    size_t threads = 0;
+    size_t globalQueueLimit = 65536;
+    size_t deviceQueueLimit = 65536;
+    bool limitConcurrency = false;
+    size_t initialConcurrency = 8;
+    size_t minConcurrency = 1;
+    size_t maxConcurrency = 256;
+    bool json = false;
+    bool stats = false;
+};
+
+static std::chrono::microseconds serviceTime{ 0 };
+
+// once slowFrom has passed operations take slowServiceTime instead, see --slowdown
+static std::chrono::microseconds slowServiceTime{ 0 };
+static std::atomic<std::chrono::time_point<std::chrono::steady_clock>> slowFrom{ std::chrono::time_point<std::chrono::steady_clock>::max () };
+
+// a device that answers every operation in the default mix (and a few more) after serviceTime
+class loadgenDevice : public DAB::dabClient<loadgenDevice>
+{
+    static void work ()
+    {
+        auto time = std::chrono::steady_clock::now () >= slowFrom.load ( std::memory_order_relaxed ) ? slowServiceTime : serviceTime;
+        if ( time.count () )
+        {
+            std::this_thread::sleep_for ( time );
+        }
+    }
+
+public:
+    loadgenDevice ( std::string const &deviceId, std::string const &ipAddress ) : dabClient ( deviceId, ipAddress )
+    {}
+
+    static bool isCompatible ( char const * )
+    {
+        return true;
+    }
+
+    DAB::jsonElement appList ()
+    {
+        work ();
+        DAB::jsonElement rsp;
+        rsp["status"] = 200;
+        rsp["applications"].makeArray ();
+        rsp["applications"].push_back ( "loadgen" );
+        return rsp;
+    }
+
+    DAB::jsonElement appLaunch ( std::string const &, DAB::jsonElement const & )
+    {
+        work ();
+        return {{"status", 200},
+                {"state",  "launched"}};
+    }
+
+    DAB::jsonElement appGetState ( std::string const & )
+    {
+        work ();
+        return {{"status", 200},
+                {"state",  "FOREGROUND"}};
+    }
+
+    DAB::jsonElement deviceInfo ()
+    {
+        work ();
+        return {{"status",  200},
+                {"version", "2.0"}};
+    }
+
+    DAB::jsonElement systemSettingsGet ()
+    {
+        work ();
+        return {{"status",      200},
+                {"language",    "en-US"},
+                {"audioVolume", 20},
+                {"mute",        false}};
+    }
+
+    DAB::jsonElement inputKeyPress ( std::string const & )
+    {
+        work ();
+        return {{"status", 200}};
+    }
+
+    DAB::jsonElement healthCheckGet ()
+    {
+        work ();
+        return {{"status",  200},
+                {"healthy", true}};
+    }
+};
+
+using loadgenBridge = DAB::dabBridge<loadgenDevice>;
+
+// called with a response's correlation data and payload
+using responseHandler = std::function<void ( std::string_view, std::string_view )>;
+
+struct operation
+{
+    std::string name;
+    std::string payload;
+    double weight;
+};
+
+// the request payload for an operation, the operations that need parameters are given ones the simulated device accepts
+static std::string payloadFor ( std::string_view name )
+{
+    if ( name == "applications/launch" || name == "applications/get-state" || name == "applications/exit" )
+    {
+        return R"({"appId":"loadgen"})";
+    }
+    if ( name == "input/key-press" )
+    {
+        return R"({"keyCode":"KEY_ENTER"})";
+    }
+    return "{}";
+}
+
+// a request's latency when the transport wouldn't take it
+constexpr int64_t REFUSED = -2;
+
+// one simulated controller: its schedule, fixed before the run starts, and what came back
+struct controller
+{
+    std::vector<int64_t> due;                                           // when each request is due, nanoseconds from the start of the run
+    std::vector<uint32_t> topic;                                        // index of each request's topic, device * operations + operation
+    std::vector<int64_t> latency;                                       // nanoseconds, -1 until answered (by the receiving thread), REFUSED if never sent
+    std::vector<int64_t> lag;                                           // nanoseconds each request was sent after it was due
+    std::string responseTopic;
+
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> failed = 0;                                   // the transport refused the request
+    std::atomic<uint64_t> received = 0;
+    std::atomic<uint64_t> unmatched = 0;                                // correlation data we didn't send, or a second response
+    std::atomic<uint64_t> shed = 0;                                     // 503, the adapter's queues were full
+    std::atomic<uint64_t> errors = 0;                                   // any other status
+};
+
+// controllers talking to dabLoopbackInterface, responses are delivered on the adapter's publisher thread
+class loopbackLink
+{
+    DAB::dabLoopbackInterface<loadgenBridge> &adapter;
+
+public:
+    loopbackLink ( DAB::dabLoopbackInterface<loadgenBridge> &adapter, std::string const &responseTopic, responseHandler handler ) : adapter ( adapter )
+    {
+        adapter.subscribe ( responseTopic, [handler = std::move ( handler )] ( auto const &msg ) { handler ( msg.correlationData, msg.payload ); } );
+    }
+
+    bool publish ( std::string_view topic, std::string_view payload, std::string_view responseTopic, std::string_view correlationData )
+    {
+        return adapter.publish ( topic, payload, responseTopic, correlationData );
+    }
+};
+
+// controllers talking to dabShmInterface, each has its own channel and a thread reading its response ring
+class shmLink
+{
+    DAB::dabShmClient client;
+    std::atomic<bool> stopping = false;
+    std::thread receiver;
+
+public:
+    shmLink ( std::string const &socketPath, std::string const &responseTopic, responseHandler handler ) : client ( socketPath )
+    {
+        client.subscribe ( responseTopic );
+        receiver = std::thread ( [this, handler = std::move ( handler )] ()
+                                 {
+                                     while ( !stopping )
+                                     {
+                                         client.receive ( [&] ( auto const &msg ) { handler ( msg.correlationData, msg.payload ); }, std::chrono::milliseconds ( 100 ) );
+                                     }
+                                 } );
+    }
+
+    ~shmLink ()
+    {
+        stopping = true;
+        receiver.join ();
+    }
+
+    bool publish ( std::string_view topic, std::string_view payload, std::string_view responseTopic, std::string_view correlationData )
+    {
+        return client.publish ( topic, payload, responseTopic, correlationData );
+    }
+};
+
+// controllers talking to a broker (the adapter's own or an external one), a minimal MQTT 5 client with a thread reading responses
+class mqttLink
+{
+    int fd = -1;
+    std::string rx;
+    size_t rxUsed = 0;
+    std::string packet;
+    DAB::mqttPropertyWriter props;
+    std::thread receiver;
+
+    // read until rx holds a complete packet.   Returns its length, 0 once the connection has closed
+    size_t readPacket ( size_t &headerLen )
+    {
+        for ( ;; )
+        {
+            auto len = DAB::mqttFrameLength ( {rx.data (), rxUsed}, headerLen );
+            if ( len == SIZE_MAX )
+            {
+                return 0;
+            }
+            if ( len )
+            {
+                return len;
+            }
+            if ( rx.size () - rxUsed < 64 * 1024 )
+            {
+                rx.resize ( rx.size () + 64 * 1024 );
+            }
+            auto n = ::read ( fd, rx.data () + rxUsed, rx.size () - rxUsed );
+            if ( n <= 0 )
+            {
+                if ( n < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                return 0;
+            }
+            rxUsed += (size_t) n;
+        }
+    }
+
+    void consumePacket ( size_t len )
+    {
+        std::memmove ( rx.data (), rx.data () + len, rxUsed - len );
+        rxUsed -= len;
+    }
+
+    bool writeAll ( iovec *iov, int count )
+    {
+        while ( count )
+        {
+            auto n = ::writev ( fd, iov, count );
+            if ( n < 0 )
+            {
+                if ( errno == EINTR )
+                {
+                    continue;
+                }
+                return false;
+            }
+            while ( count && (size_t) n >= iov->iov_len )
+            {
+                n -= (ssize_t) iov->iov_len;
+                iov++;
+                count--;
+            }
+            if ( count )
+            {
+                iov->iov_base = static_cast<char *> ( iov->iov_base ) + n;
+                iov->iov_len -= (size_t) n;
+            }
+        }
+        return true;
+    }
+
+    // send packet and wait for the reply of type expected
+    void handshake ( DAB::mqttPacketType expected, std::string const &what )
+    {
+        iovec iov{ packet.data (), packet.size () };
+        size_t headerLen = 0;
+        size_t len;
+        if ( !writeAll ( &iov, 1 ) || !(len = readPacket ( headerLen )) || (DAB::mqttPacketType) ((uint8_t) rx[0] >> 4) != expected )
+        {
+            throw DAB::dabException ( 500, what + " failed" );
+        }
+        consumePacket ( len );
+    }
+
+public:
+    mqttLink ( std::string const &brokerAddress, std::string const &clientId, std::string const &responseTopic, responseHandler handler )
+    {
+        std::string_view address ( brokerAddress );
+        for ( auto scheme : {"tcp://", "mqtt://"} )
+        {
+            if ( address.starts_with ( scheme ) )
+            {
+                address.remove_prefix ( std::strlen ( scheme ) );
+            }
+        }
+        auto colon = address.rfind ( ':' );
+        auto host = std::string ( address.substr ( 0, colon ) );
+        auto port = colon == std::string_view::npos ? std::string ( "1883" ) : std::string ( address.substr ( colon + 1 ) );
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        if ( auto rc = getaddrinfo ( host.c_str (), port.c_str (), &hints, &result ) )
+        {
+            throw DAB::dabException ( rc, std::string ( "Failed to resolve " ) + host );
+        }
+        for ( auto *ai = result; ai; ai = ai->ai_next )
+        {
+            fd = ::socket ( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol );
+            if ( fd >= 0 && !::connect ( fd, ai->ai_addr, ai->ai_addrlen ) )
+            {
+                break;
+            }
+            if ( fd >= 0 )
+            {
+                ::close ( fd );
+                fd = -1;
+            }
+        }
+        freeaddrinfo ( result );
+        if ( fd < 0 )
+        {
+            throw DAB::dabException ( errno, std::string ( "Failed to connect to " ) + brokerAddress );
+        }
+        int one = 1;
+        setsockopt ( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof ( one ) );
+
+        DAB::encodeConnect ( packet, clientId, 0, true, props );
+        handshake ( DAB::mqttPacketType::connack, "CONNECT" );
+        packet.clear ();
+        DAB::encodeSubscribe ( packet, 1, {responseTopic}, 0 );
+        handshake ( DAB::mqttPacketType::suback, "SUBSCRIBE" );
+
+        receiver = std::thread ( [this, handler = std::move ( handler )] ()
+                                 {
+                                     size_t headerLen = 0;
+                                     while ( auto len = readPacket ( headerLen ) )
+                                     {
+                                         auto first = (uint8_t) rx[0];
+                                         DAB::mqttPublish pub;
+                                         if ( (DAB::mqttPacketType) (first >> 4) == DAB::mqttPacketType::publish && DAB::decodePublish ( first & 0x0F, std::string_view ( rx.data () + headerLen, len - headerLen ), pub ) )
+                                         {
+                                             handler ( pub.props.correlationData, pub.payload );
+                                         }
+                                         consumePacket ( len );
+                                     }
+                                 } );
+    }
+
+    ~mqttLink ()
+    {
+        packet.clear ();
+        DAB::encodeDisconnect ( packet );
+        iovec iov{ packet.data (), packet.size () };
+        writeAll ( &iov, 1 );
+        ::shutdown ( fd, SHUT_RDWR );
+        receiver.join ();
+        ::close ( fd );
+    }
+
+    bool publish ( std::string_view topic, std::string_view payload, std::string_view responseTopic, std::string_view correlationData )
+    {
+        props.clear ();
+        props.string ( DAB::mqttProperty::responseTopic, responseTopic );
+        props.string ( DAB::mqttProperty::correlationData, correlationData );
+        packet.clear ();
+        DAB::encodePublishHeader ( packet, topic, 0, false, 0, props, payload.size () );
+        iovec iov[2] = {{packet.data (),          packet.size ()},
+                        {(void *) payload.data (), payload.size ()}};
+        return writeAll ( iov, 2 );
+    }
+};
+
+// parse op=weight,op=weight
+static std::vector<operation> parseMix ( std::string_view mix )
+{
+    std::vector<operation> ops;
+    while ( !mix.empty () )
+    {
+        auto end = mix.find ( ',' );
+        auto item = mix.substr ( 0, end );
+        auto equals = item.find ( '=' );
+        auto name = std::string ( item.substr ( 0, equals ) );
+        double weight = equals == std::string_view::npos ? 1 : std::strtod ( std::string ( item.substr ( equals + 1 ) ).c_str (), nullptr );
+        if ( name.empty () || weight <= 0 )
+        {
+            throw DAB::dabException ( 400, std::string ( "invalid mix entry: " ) + std::string ( item ) );
+        }
+        ops.push_back ( {name, payloadFor ( name ), weight} );
+        mix.remove_prefix ( end == std::string_view::npos ? mix.size () : end + 1 );
+    }
+    if ( ops.empty () )
+    {
+        throw DAB::dabException ( 400, std::string ( "empty mix" ) );
+    }
+    return ops;
+}
+
+// fill in each controller's schedule.   Controllers are phase shifted so that with fixed intervals they don't all send at once
+static void buildSchedules ( std::vector<std::unique_ptr<controller>> &controllers, std::vector<operation> const &ops, options const &opts )
+{
+    auto perController = opts.rate / (double) controllers.size ();
+    auto interval = 1e9 / perController;
+    auto end = (opts.warmup + opts.duration) * 1e9;
+    std::vector<double> weights;
+    for ( auto const &op : ops )
+    {
+        weights.push_back ( op.weight );
+    }
+
+    for ( size_t c = 0; c < controllers.size (); c++ )
+    {
+        auto &ctl = *controllers[c];
+        std::mt19937_64 rng ( c + 1 );
+        std::discrete_distribution<uint32_t> pickOp ( weights.begin (), weights.end () );
+        std::uniform_int_distribution<uint32_t> pickDevice ( 0, (uint32_t) opts.devices - 1 );
+        std::exponential_distribution<double> gap ( perController / 1e9 );
+
+        auto t = opts.poisson ? gap ( rng ) : interval * (double) c / (double) controllers.size ();
+        while ( t < end )
+        {
+            ctl.due.push_back ( (int64_t) t );
+            ctl.topic.push_back ( pickDevice ( rng ) * (uint32_t) ops.size () + pickOp ( rng ) );
+            t += opts.poisson ? gap ( rng ) : interval;
+        }
+        ctl.latency.assign ( ctl.due.size (), -1 );
+        ctl.lag.assign ( ctl.due.size (), 0 );
+    }
+}
+
+// the response handler for controller ctl, matches the response to its request by correlation data.   start is set once the links are up,
+// it's atomic because the order of its store and a response arriving isn't visible to tools when it's carried by shared memory
+static responseHandler makeHandler ( controller &ctl, std::atomic<std::chrono::time_point<std::chrono::steady_clock>> const &start )
+{
+    return [&ctl, &start] ( std::string_view correlationData, std::string_view payload )
+    {
+        auto now = std::chrono::steady_clock::now ();
+        uint64_t seq = 0;
+        auto [ptr, ec] = std::from_chars ( correlationData.data (), correlationData.data () + correlationData.size (), seq );
+        if ( ec != std::errc () || ptr != correlationData.data () + correlationData.size () || seq >= ctl.due.size () || ctl.latency[seq] >= 0 )
+        {
+            ctl.unmatched++;
+            return;
+        }
+        ctl.latency[seq] = std::chrono::duration_cast<std::chrono::nanoseconds> ( now - start.load ( std::memory_order_relaxed ) ).count () - ctl.due[seq];
+
+        int status = 0;
+        auto pos = payload.find ( "\"status\":" );
+        if ( pos != std::string_view::npos )
+        {
+            payload.remove_prefix ( pos + 9 );
+            std::from_chars ( payload.data (), payload.data () + payload.size (), status );
+        }
+        if ( status == 503 )
+        {
+            ctl.shed++;
+        } else if ( status != 200 )
+        {
+            ctl.errors++;
+        }
+        ctl.received++;
+    };
+}
+
+// send the controllers' requests as they fall due.   Each thread serves every threads'th controller, always sending the earliest due request
+// next.   A thread that falls behind sends immediately until it has caught up, it never skips or delays the schedule
+template< typename LINK >
+static void sendRequests ( std::vector<std::unique_ptr<controller>> &controllers, std::vector<std::unique_ptr<LINK>> &links, std::vector<std::string> const &topics, std::vector<operation> const &ops, size_t first, size_t step, std::chrono::time_point<std::chrono::steady_clock> start )
+{
+    using entry = std::pair<int64_t, size_t>;
+    std::priority_queue<entry, std::vector<entry>, std::greater<>> next;
+    std::vector<size_t> position ( controllers.size (), 0 );
+    for ( size_t c = first; c < controllers.size (); c += step )
+    {
+        if ( !controllers[c]->due.empty () )
+        {
+            next.emplace ( controllers[c]->due[0], c );
+        }
+    }
+
+    char correlationData[24];
+    while ( !next.empty () )
+    {
+        auto [due, c] = next.top ();
+        next.pop ();
+        auto when = start + std::chrono::nanoseconds ( due );
+        // sleeping is only accurate to tens of microseconds, the last stretch is spun, yielding so that on a machine with few cores the
+        // adapter's own threads still run
+        for ( auto now = std::chrono::steady_clock::now (); now < when; now = std::chrono::steady_clock::now () )
+        {
+            if ( when - now > std::chrono::microseconds ( 200 ) )
+            {
+                std::this_thread::sleep_until ( when - std::chrono::microseconds ( 100 ) );
+            } else
+            {
+                std::this_thread::yield ();
+            }
+        }
+
+        auto &ctl = *controllers[c];
+        auto seq = position[c]++;
+        ctl.lag[seq] = std::chrono::duration_cast<std::chrono::nanoseconds> ( std::chrono::steady_clock::now () - when ).count ();
+        auto len = std::to_chars ( correlationData, correlationData + sizeof ( correlationData ), seq ).ptr - correlationData;
+        auto topic = ctl.topic[seq];
+        if ( links[c]->publish ( topics[topic], ops[topic % ops.size ()].payload, ctl.responseTopic, std::string_view ( correlationData, (size_t) len ) ) )
+        {
+            ctl.sent++;
+        } else
+        {
+            ctl.latency[seq] = REFUSED;
+            ctl.failed++;
+        }
+        if ( position[c] < ctl.due.size () )
+        {
+            next.emplace ( ctl.due[position[c]], c );
+        }
+    }
+}
+
+static double percentile ( std::vector<int64_t> const &sorted, double p )
+{
+    if ( sorted.empty () )
+    {
+        return 0;
+    }
+    auto index = std::min ( sorted.size () - 1, (size_t) (p / 100.0 * (double) sorted.size ()) );
+    return (double) sorted[index] / 1000.0;
+}
+
+// drive adapter with controllers connected through links made by makeLink ( controllerIndex, responseTopic, handler ), then report
+template< DAB::dabTransport ADAPTER, typename MAKELINK >
+static int run ( ADAPTER &adapter, options const &opts, MAKELINK &&makeLink )
+{
+    auto ops = parseMix ( opts.mix );
+    std::vector<std::string> topics;
+    for ( size_t d = 0; d < opts.devices; d++ )
+    {
+        for ( auto const &op : ops )
+        {
+            topics.push_back ( "dab/loadgen-" + std::to_string ( d ) + "/" + op.name );
+        }
+    }
+
+    adapter.setQueueLimits ( opts.globalQueueLimit, opts.deviceQueueLimit );
+    adapter.connect ();
+
+    std::vector<std::unique_ptr<controller>> controllers;
+    for ( size_t c = 0; c < opts.controllers; c++ )
+    {
+        controllers.push_back ( std::make_unique<controller> () );
+        controllers.back ()->responseTopic = "loadgen/" + std::to_string ( c ) + "/response";
+    }
+    buildSchedules ( controllers, ops, opts );
+
+    std::atomic<std::chrono::time_point<std::chrono::steady_clock>> start;
+    std::vector<decltype ( makeLink ( size_t{}, std::string{}, responseHandler{} ) )> links;
+    for ( size_t c = 0; c < opts.controllers; c++ )
+    {
+        links.push_back ( makeLink ( c, controllers[c]->responseTopic, makeHandler ( *controllers[c], start ) ) );
+    }
+
+    // load
+    start = std::chrono::steady_clock::now () + std::chrono::milliseconds ( 10 );
+    if ( slowServiceTime.count () )
+    {
+        slowFrom = start.load () + std::chrono::duration_cast<std::chrono::steady_clock::duration> ( std::chrono::duration<double> ( opts.warmup ) );
+    }
+    auto nThreads = opts.threads ? std::min ( opts.threads, opts.controllers ) : std::min<size_t> ( opts.controllers, 4 );
+    std::vector<std::thread> senders;
+    for ( size_t t = 0; t < nThreads; t++ )
+    {
+        senders.emplace_back ( [&, t] () { sendRequests ( controllers, links, topics, ops, t, nThreads, start.load () ); } );
+    }
+    for ( auto &sender : senders )
+    {
+        sender.join ();
+    }
+    auto loadEnd = std::chrono::steady_clock::now ();
+
+    // wait for the stragglers
+    auto outstanding = [&] ()
+    {
+        uint64_t count = 0;
+        for ( auto const &ctl : controllers )
+        {
+            count += ctl->sent - std::min<uint64_t> ( ctl->sent, ctl->received );
+        }
+        return count;
+    };
+    auto deadline = loadEnd + std::chrono::duration_cast<std::chrono::steady_clock::duration> ( std::chrono::duration<double> ( opts.timeout ) );
+    while ( outstanding () && std::chrono::steady_clock::now () < deadline )
+    {
+        std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+    }
+    links.clear ();
+    adapter.disconnect ();
+
+    // results, only requests due after the warmup count
+    auto warmupEnd = (int64_t) (opts.warmup * 1e9);
+    std::vector<int64_t> all;
+    std::vector<int64_t> lag;
+    std::vector<std::vector<int64_t>> byOp ( ops.size () );
+    uint64_t lost = 0, sent = 0, failed = 0, received = 0, shed = 0, errors = 0, unmatched = 0;
+    for ( auto const &ctl : controllers )
+    {
+        for ( size_t seq = 0; seq < ctl->due.size (); seq++ )
+        {
+            if ( ctl->due[seq] < warmupEnd )
+            {
+                continue;
+            }
+            if ( ctl->latency[seq] == REFUSED )
+            {
+                continue;
+            }
+            lag.push_back ( ctl->lag[seq] );
+            if ( ctl->latency[seq] < 0 )
+            {
+                lost++;
+                continue;
+            }
+            all.push_back ( ctl->latency[seq] );
+            byOp[ctl->topic[seq] % ops.size ()].push_back ( ctl->latency[seq] );
+        }
+        sent += ctl->sent;
+        failed += ctl->failed;
+        received += ctl->received;
+        shed += ctl->shed;
+        errors += ctl->errors;
+        unmatched += ctl->unmatched;
+    }
+    std::sort ( all.begin (), all.end () );
+    std::sort ( lag.begin (), lag.end () );
+    for ( auto &latencies : byOp )
+    {
+        std::sort ( latencies.begin (), latencies.end () );
+    }
+    auto throughput = (double) all.size () / opts.duration;
+
+    if ( opts.json )
+    {
+        auto latencyJson = [] ( std::vector<int64_t> const &sorted ) -> DAB::jsonElement
+        {
+            return {{"count", (uint64_t) sorted.size ()},
+                    {"p50",   percentile ( sorted, 50 )},
+                    {"p99",   percentile ( sorted, 99 )},
+                    {"p999",  percentile ( sorted, 99.9 )},
+                    {"max",   sorted.empty () ? 0.0 : (double) sorted.back () / 1000.0}};
+        };
+        DAB::jsonElement result;
+        result["transport"] = opts.transport;
+        result["controllers"] = (uint64_t) opts.controllers;
+        result["devices"] = (uint64_t) opts.devices;
+        result["offeredRate"] = opts.rate;
+        result["duration"] = opts.duration;
+        result["throughput"] = throughput;
+        result["sent"] = sent;
+        result["failed"] = failed;
+        result["received"] = received;
+        result["lost"] = lost;
+        result["shed"] = shed;
+        result["errors"] = errors;
+        result["unmatched"] = unmatched;
+        result["latencyUs"] = latencyJson ( all );
+        result["sendLagUs"] = latencyJson ( lag );
+        for ( size_t loop = 0; loop < ops.size (); loop++ )
+        {
+            result["operations"][ops[loop].name.c_str ()] = latencyJson ( byOp[loop] );
+        }
+        std::string out;
+        result.serialize ( out, true );
+        std::cout << out << std::endl;
+    } else
+    {
+        std::cout << opts.transport << ": " << opts.controllers << " controllers, " << opts.devices << " devices, " << opts.rate << " requests/s offered for " << opts.duration << "s after a " << opts.warmup << "s warmup, " << (opts.poisson ? "poisson" : "fixed") << " arrivals" << std::endl;
+        std::cout << "sent " << sent << ", refused " << failed << ", answered " << received << ", lost " << lost << ", shed " << shed << ", errors " << errors << ", unmatched " << unmatched << std::endl;
+        std::cout << "throughput " << std::fixed << std::setprecision ( 1 ) << throughput << " responses/s" << std::endl;
+        std::cout << std::left << std::setw ( 28 ) << "latency (us)" << std::right << std::setw ( 10 ) << "count" << std::setw ( 10 ) << "p50" << std::setw ( 10 ) << "p99" << std::setw ( 10 ) << "p99.9" << std::setw ( 10 ) << "max" << std::endl;
+        auto line = [] ( std::string const &name, std::vector<int64_t> const &sorted )
+        {
+            std::cout << std::left << std::setw ( 28 ) << name << std::right << std::setw ( 10 ) << sorted.size () << std::setw ( 10 ) << percentile ( sorted, 50 ) << std::setw ( 10 ) << percentile ( sorted, 99 ) << std::setw ( 10 ) << percentile ( sorted, 99.9 ) << std::setw ( 10 ) << (sorted.empty () ? 0.0 : (double) sorted.back () / 1000.0) << std::endl;
+        };
+        line ( "all", all );
+        for ( size_t loop = 0; loop < ops.size (); loop++ )
+        {
+            line ( ops[loop].name, byOp[loop] );
+        }
+        // latency is measured from when a request was due, this is how much of it was the load generator itself being late
+        line ( "send lag", lag );
+    }
+    if ( opts.stats )
+    {
+        std::string out;
+        adapter.getStatistics ().serialize ( out, true );
+        std::cout << out << std::endl;
+    }
+    return lost || failed || errors || unmatched ? 2 : 0;
+}
+
+static options parseOptions ( int argc, char *argv[] )
+{
+    options opts;
+    for ( int loop = 1; loop < argc; loop++ )
+    {
+        std::string_view arg ( argv[loop] );
+        auto value = [&] () -> std::string
+        {
+            if ( loop + 1 >= argc )
+            {
+                throw DAB::dabException ( 400, std::string ( "missing value for " ) + std::string ( arg ) );
+            }
+            return argv[++loop];
+        };
+        if ( arg == "--transport" )
+        {
+            opts.transport = value ();
+        } else if ( arg == "--broker" )
+        {
+            opts.broker = value ();
+        } else if ( arg == "--socket" )
+        {
+            opts.socketPath = value ();
+        } else if ( arg == "--controllers" )
+        {
+            opts.controllers = std::strtoull ( value ().c_str (), nullptr, 10 );
+        } else if ( arg == "--devices" )
+        {
+            opts.devices = std::strtoull ( value ().c_str (), nullptr, 10 );
+        } else if ( arg == "--rate" )
+        {
+            opts.rate = std::strtod ( value ().c_str (), nullptr );
+        } else if ( arg == "--duration" )
+        {
+            opts.duration = std::strtod ( value ().c_str (), nullptr );
+        } else if ( arg == "--warmup" )
+        {
+            opts.warmup = std::strtod ( value ().c_str (), nullptr );
+        } else if ( arg == "--timeout" )
+        {
+            opts.timeout = std::strtod ( value ().c_str (), nullptr );
+        } else if ( arg == "--mix" )
+        {
+            opts.mix = value ();
+        } else if ( arg == "--poisson" )
+        {
+            opts.poisson = true;
+        } else if ( arg == "--service-us" )
+        {
+            serviceTime = std::chrono::microseconds ( std::strtoull ( value ().c_str (), nullptr, 10 ) );
+        } else if ( arg == "--slowdown" )
+        {
+            slowServiceTime = std::chrono::microseconds ( std::strtoull ( value ().c_str (), nullptr, 10 ) );
+        } else if ( arg == "--threads" )
+        {
+            opts.threads = std::strtoull ( value ().c_str (), nullptr, 10 );
+        } else if ( arg == "--queue-limits" )
+        {
+            auto limits = value ();
+            char *end = nullptr;
+            opts.globalQueueLimit = std::strtoull ( limits.c_str (), &end, 10 );
+            opts.deviceQueueLimit = *end == ',' ? std::strtoull ( end + 1, nullptr, 10 ) : opts.globalQueueLimit;
+        } else if ( arg == "--concurrency-limits" )
+        {
+            auto limits = value ();
+            char *end = nullptr;
+            opts.limitConcurrency = true;
+            opts.initialConcurrency = std::strtoull ( limits.c_str (), &end, 10 );
+            if ( *end == ',' )
+            {
+                opts.minConcurrency = std::strtoull ( end + 1, &end, 10 );
+            }
+            if ( *end == ',' )
+            {
+                opts.maxConcurrency = std::strtoull ( end + 1, &end, 10 );
+            }
+        } else if ( arg == "--json" )
+        {
+            opts.json = true;
+        } else if ( arg == "--stats" )
+        {
+            opts.stats = true;
+        } else
+        {
+            throw DAB::dabException ( 400, std::string ( "unknown option " ) + std::string ( arg ) );
+        }
+    }
+    if ( !opts.controllers || !opts.devices || opts.rate <= 0 || opts.duration <= 0 || opts.warmup < 0 )
+    {
+        throw DAB::dabException ( 400, std::string ( "controllers, devices, rate and duration must be positive" ) );
+    }
+    return opts;
+}
+
+int main ( int argc, char *argv[] )
+{
+    try
+    {
+        auto opts = parseOptions ( argc, argv );
+
+        loadgenBridge bridge;
+        for ( size_t d = 0; d < opts.devices; d++ )
+        {
+            bridge.makeDeviceInstance ( ("loadgen-" + std::to_string ( d )).c_str (), "127.0.0.1" );
+        }
+        if ( opts.limitConcurrency )
+        {
+            bridge.enableConcurrencyLimits ( opts.initialConcurrency, opts.minConcurrency, opts.maxConcurrency );
+        }
+
+        if ( opts.transport == "loopback" )
+        {
+            DAB::dabLoopbackInterface adapter ( bridge );
+            return run ( adapter, opts, [&adapter] ( size_t, std::string const &responseTopic, responseHandler handler )
+            {
+                return std::make_unique<loopbackLink> ( adapter, responseTopic, std::move ( handler ) );
+            } );
+        } else if ( opts.transport == "shm" )
+        {
+            DAB::dabShmInterface adapter ( bridge, opts.socketPath );
+            return run ( adapter, opts, [&opts] ( size_t, std::string const &responseTopic, responseHandler handler )
+            {
+                return std::make_unique<shmLink> ( opts.socketPath, responseTopic, std::move ( handler ) );
+            } );
+        } else if ( opts.transport == "broker" )
+        {
+            auto address = opts.broker.empty () ? std::string ( "127.0.0.1:18830" ) : opts.broker;
+            DAB::dabMQTTBrokerInterface adapter ( bridge, address );
+            return run ( adapter, opts, [&address] ( size_t c, std::string const &responseTopic, responseHandler handler )
+            {
+                return std::make_unique<mqttLink> ( address, "loadgen-controller-" + std::to_string ( c ), responseTopic, std::move ( handler ) );
+            } );
+        } else if ( opts.transport == "mqtt" )
+        {
+            auto address = opts.broker.empty () ? std::string ( "127.0.0.1:1883" ) : opts.broker;
+            DAB::dabMQTTNativeInterface adapter ( bridge, address );
+            return run ( adapter, opts, [&address] ( size_t c, std::string const &responseTopic, responseHandler handler )
+            {
+                return std::make_unique<mqttLink> ( address, "loadgen-controller-" + std::to_string ( c ), responseTopic, std::move ( handler ) );
+            } );
+        } else if ( opts.transport == "mqtt-local" )
+        {
+            // a broker that only routes publishes between its clients, the adapter and the controllers
+            auto address = opts.broker.empty () ? std::string ( "127.0.0.1:18831" ) : opts.broker;
+            loadgenBridge brokerBridge;
+            DAB::dabMQTTBrokerInterface broker ( brokerBridge, address );
+            broker.connect ();
+            DAB::dabMQTTNativeInterface adapter ( bridge, address );
+            auto rc = run ( adapter, opts, [&address] ( size_t c, std::string const &responseTopic, responseHandler handler )
+            {
+                return std::make_unique<mqttLink> ( address, "loadgen-controller-" + std::to_string ( c ), responseTopic, std::move ( handler ) );
+            } );
+            broker.disconnect ();
+            return rc;
+        }
+        throw DAB::dabException ( 400, std::string ( "unknown transport " ) + opts.transport );
+    } catch ( DAB::dabException &e )
+    {
+        std::cout << "error (" << e.errorCode << "): " << e.errorText << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,182 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "dabMqttCodec.h"
+#include "dabMqttInterfaceBase.h"
+
+// in process transport with no broker and no sockets.   Requests are published by calling publish () and go through exactly the same path as
+// requests from a broker: decoding, scheduling, dispatch to the bridge, serialization and the outbound queues.   Responses and telemetry are
+// handed to in process subscribers instead of being written to a connection.
+// this lets benchmarks and tests drive the whole adapter and measure its own costs, isolated from the network and the broker.
+// with dabSingleThreaded, publish () executes the request and delivers its response before it returns.
+
+namespace DAB
+{
+    template< typename BRIDGE >
+    class dabLoopbackInterface : public dabMQTTInterfaceBase<dabLoopbackInterface<BRIDGE>, BRIDGE>
+    {
+        using base = dabMQTTInterfaceBase<dabLoopbackInterface<BRIDGE>, BRIDGE>;
+        friend base;
+
+        using typename base::threadingPolicy;
+        using typename base::outboundMessage;
+        using base::bridge;
+        using base::running;
+        using base::runningMutex;
+        using base::stopped;
+        using base::topics;
+
+        constexpr static auto PERIOD = std::chrono::seconds ( 5 );
+
+    public:
+        // a message published by the adapter, valid only for the duration of the callback
+        struct delivery
+        {
+            std::string_view topic;
+            std::string_view correlationData;
+            std::string_view payload;
+            bool deflated = false;
+        };
+
+        using subscriber = std::function<void ( delivery const & )>;
+
+    private:
+        typename threadingPolicy::mutex subscribersMutex;
+        std::vector<std::pair<std::string, subscriber>> subscribers;
+
+        // the adapter's request topics, requests for anything else are ignored as a broker would never deliver them
+        mqttTopicFilterSet adapterTopics;
+        typename threadingPolicy::template atomic<bool> connected = false;
+
+        typename threadingPolicy::template atomic<uint64_t> published = 0;
+        typename threadingPolicy::template atomic<uint64_t> delivered = 0;
+
+        // hand a message to every subscriber whose filter matches its topic.   Called by the publisher
+        bool send ( outboundMessage &msg )
+        {
+            delivery d{ msg.topic, msg.correlationData, msg.payload, msg.deflated };
+            std::lock_guard l1 ( subscribersMutex );
+            for ( auto const &[filter, callback] : subscribers )
+            {
+                if ( mqttTopicMatches ( filter, msg.topic ) )
+                {
+                    callback ( d );
+                    delivered++;
+                }
+            }
+            return true;
+        }
+
+    public:
+        explicit dabLoopbackInterface ( BRIDGE &bridge ) : base ( bridge )
+        {
+            static_assert ( dabOutboundTransport<dabLoopbackInterface> );
+            this->startPublisher ();
+        }
+
+        ~dabLoopbackInterface ()
+        {
+            this->shutdown ();
+        }
+
+        // receive the adapter's publishes on topics matching filter (+ and # wildcards as in mqtt).   With dabMultiThreaded callbacks are made on
+        // the publisher thread, one at a time, and must not subscribe themselves
+        void subscribe ( std::string const &filter, subscriber callback )
+        {
+            std::lock_guard l1 ( subscribersMutex );
+            subscribers.emplace_back ( filter, std::move ( callback ) );
+        }
+
+        // publish a request to the adapter.   Returns false if topic isn't one of the adapter's request topics or we aren't connected
+        bool publish ( std::string_view topic, std::string_view payload, std::string_view responseTopic = {}, std::string_view correlationData = {}, std::string_view acceptEncoding = {} )
+        {
+            if ( !connected || !adapterTopics.matches ( topic ) )
+            {
+                return false;
+            }
+            published++;
+            this->handleRequest ( topic, payload, responseTopic, correlationData, acceptEncoding );
+            return true;
+        }
+
+        // return the adapter's request statistics, along with the number of requests published and messages delivered
+        jsonElement getStatistics ()
+        {
+            auto stats = base::getStatistics ();
+            stats["loopback"] = {{"published", (uint64_t) published},
+                                 {"delivered", (uint64_t) delivered}};
+            return stats;
+        }
+
+        // there is nothing to connect to, the adapter's request topics are accepted from now on
+        auto connect ()
+        {
+            auto connectStart = std::chrono::steady_clock::now ();
+            topics = this->requestTopics ();
+            adapterTopics.assign ( topics.begin (), topics.end () );
+            connected = true;
+            this->markReady ( connectStart, connectStart, topics.size (), 0 );
+            return 0;
+        }
+
+        // stops accepting requests and drains the adapter exactly as dabMQTTInterface::disconnect() does
+        auto disconnect ( std::chrono::milliseconds deadline = std::chrono::milliseconds ( 10000 ) )
+        {
+            connected = false;
+            this->drain ( std::chrono::steady_clock::now () + deadline );
+            std::lock_guard l1 ( runningMutex );
+            running.notify_all ();
+            return 0;
+        }
+
+        // waits until disconnect() is called.   In single threaded builds nothing arrives by itself, requests are executed by publish (), so
+        // this only runs telemetry as it falls due
+        void wait ()
+        {
+            if constexpr ( threadingPolicy::concurrent )
+            {
+                std::unique_lock l1 ( runningMutex );
+                running.wait ( l1 );
+            } else
+            {
+                while ( !stopped )
+                {
+                    std::chrono::time_point<std::chrono::steady_clock> next;
+                    try
+                    {
+                        next = bridge.serviceTelemetry ();
+                    } catch ( DAB::dabException &e )
+                    {
+                        std::cout << "error (" << e.errorCode << "): " << e.errorText << std::endl;
+                        next = std::chrono::steady_clock::now () + PERIOD;
+                    }
+                    std::this_thread::sleep_until ( std::min ( next, std::chrono::steady_clock::now () + PERIOD ) );
+                }
+            }
+        }
+    };
+}
@@ -0,0 +1,438 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dabMqttInterfaceBase.h"
+#include "MQTTAsync.h"
+
+// mqtt interface built on the asynchronous paho client (paho-mqtt3a/3as).
+// with the synchronous client every publish waits for the message to be written to the broker socket, so throughput is bounded by the
+// publisher's round trip to the broker.   Here publishes are handed to paho and complete via callbacks.   The publisher keeps up to a
+// configurable window of publishes in flight and only stops sending when that window is full.
+// the connection uses MQTT 5, the response topic and correlation data the adapter relies on are MQTT 5 properties.
+// connect(), wait() and disconnect() behave exactly as they do for dabMQTTInterface, blocking until the operation has completed.
+// unlike dabMQTTInterface there is no reconnection.   Once the connection is lost wait() returns, anything still queued is discarded and
+// the application must destroy the interface and create a new one to reconnect.
+
+namespace DAB
+{
+    template< typename BRIDGE >
+    class dabMQTTAsyncInterface : public dabMQTTInterfaceBase<dabMQTTAsyncInterface<BRIDGE>, BRIDGE>
+    {
+        using base = dabMQTTInterfaceBase<dabMQTTAsyncInterface<BRIDGE>, BRIDGE>;
+        friend base;
+
+        using typename base::threadingPolicy;
+        using typename base::outboundMessage;
+        using base::bridge;
+        using base::running;
+        using base::runningMutex;
+        using base::topics;
+
+        static_assert ( threadingPolicy::concurrent, "the asynchronous client delivers messages on its own threads and can not be used with dabSingleThreaded" );
+
+        constexpr static auto CONNECT_TIMEOUT = std::chrono::seconds ( 30 );
+
+        MQTTAsync client{};
+        std::string brokerAddress;
+
+        // completion of a single asynchronous operation (connect, subscribe, ...).   Every operation has its own, shared between the waiter
+        // and paho's callback, so a callback arriving after we've given up waiting never references a destroyed object, and never completes
+        // a later operation in place of its own
+        struct completion
+        {
+            std::mutex access;
+            std::condition_variable condition;
+            bool done = false;
+            int rc = MQTTASYNC_SUCCESS;
+
+            void finish ( int code )
+            {
+                {
+                    std::lock_guard l1 ( access );
+                    done = true;
+                    rc = code;
+                }
+                condition.notify_all ();
+            }
+
+            // returns the result of the operation, or -1 if it didn't complete by deadline
+            int wait ( std::chrono::time_point<std::chrono::steady_clock> deadline )
+            {
+                std::unique_lock l1 ( access );
+                if ( !condition.wait_until ( l1, deadline, [this] () { return done; } ) )
+                {
+                    return -1;
+                }
+                return rc;
+            }
+
+            // the context is the callback's share of the completion, released once it has been called.   paho calls exactly one of these
+            static void onSuccess ( void *context, MQTTAsync_successData5 * )
+            {
+                std::unique_ptr<std::shared_ptr<completion>> share ( reinterpret_cast<std::shared_ptr<completion> *>(context) );
+                (*share)->finish ( MQTTASYNC_SUCCESS );
+            }
+
+            static void onFailure ( void *context, MQTTAsync_failureData5 *response )
+            {
+                std::unique_ptr<std::shared_ptr<completion>> share ( reinterpret_cast<std::shared_ptr<completion> *>(context) );
+                (*share)->finish ( response && response->code ? response->code : -1 );
+            }
+
+            // start an operation: fill in the callbacks of its options structure so that they complete a new completion, which is returned
+            template< typename OPTIONS >
+            static std::shared_ptr<completion> attach ( OPTIONS &options )
+            {
+                auto op = std::make_shared<completion> ();
+                options.onSuccess5 = onSuccess;
+                options.onFailure5 = onFailure;
+                options.context = new std::shared_ptr<completion> ( op );
+                return op;
+            }
+
+            // paho didn't accept the operation, so no callback will release its share
+            template< typename OPTIONS >
+            static void detach ( OPTIONS &options )
+            {
+                delete reinterpret_cast<std::shared_ptr<completion> *>(options.context);
+                options.context = nullptr;
+            }
+        };
+
+        // issue a request per chunk of topics with request ( first, last, options ), then wait for them all.   The requests are all issued
+        // before waiting for any of them, so a chunked subscription costs a single round trip.   Returns the first failure, or -1 if they
+        // didn't all complete by deadline
+        template< typename F >
+        int requestChunked ( F &&request, std::chrono::time_point<std::chrono::steady_clock> deadline, size_t *requests = nullptr )
+        {
+            int rc = MQTTASYNC_SUCCESS;
+            std::vector<std::shared_ptr<completion>> issued;
+            std::vector<char *> topicPtrs;
+            auto chunks = this->forEachSubscribeChunk ( topics, [&] ( auto first, auto last )
+            {
+                if ( rc != MQTTASYNC_SUCCESS )
+                {
+                    return;
+                }
+                topicPtrs.clear ();
+                for ( auto it = first; it != last; it++ )
+                {
+                    topicPtrs.push_back ( it->data () );
+                }
+                MQTTAsync_responseOptions opts = MQTTAsync_responseOptions_initializer;
+                auto op = completion::attach ( opts );
+                rc = request ( topicPtrs, opts );
+                if ( rc == MQTTASYNC_SUCCESS )
+                {
+                    issued.push_back ( std::move ( op ) );
+                } else
+                {
+                    completion::detach ( opts );
+                }
+            } );
+            for ( auto &op : issued )
+            {
+                if ( auto waitRc = op->wait ( deadline ); waitRc && rc == MQTTASYNC_SUCCESS )
+                {
+                    rc = waitRc;
+                }
+            }
+            if ( requests )
+            {
+                *requests = chunks;
+            }
+            return rc;
+        }
+
+        // publishes handed to paho whose success or failure callback has not yet arrived
+        size_t maxInFlight = 256;
+        std::atomic<size_t> inFlight = 0;
+        std::atomic<uint64_t> published = 0;
+        std::atomic<uint64_t> publishFailures = 0;
+
+        // set once the connection has been lost, we've disconnected or we're being destroyed, and ends wait().   paho may never complete the
+        // publishes in flight at that point, so the window no longer applies and anything still queued is handed to paho to fail immediately.
+        // cleared by connect()
+        std::atomic<bool> closing = false;
+
+        // reused for every publish, only touched by the publisher.   paho copies the message when it's queued so the buffers are free for
+        // reuse as soon as sendMessage returns
+        MQTTAsync_message clientMessage = MQTTAsync_message_initializer;
+        MQTTAsync_responseOptions publishOptions = MQTTAsync_responseOptions_initializer;
+
+        static void onPublishSuccess ( void *context, MQTTAsync_successData5 * )
+        {
+            auto *mqttInterface = reinterpret_cast<dabMQTTAsyncInterface *>(context);
+            mqttInterface->published++;
+            mqttInterface->inFlight--;
+            // the window has opened up
+            mqttInterface->wakePublisher ();
+        }
+
+        static void onPublishFailure ( void *context, MQTTAsync_failureData5 * )
+        {
+            auto *mqttInterface = reinterpret_cast<dabMQTTAsyncInterface *>(context);
+            mqttInterface->publishFailures++;
+            mqttInterface->inFlight--;
+            mqttInterface->wakePublisher ();
+        }
+
+        // number of publishes the publisher may start now
+        size_t sendWindow ()
+        {
+            if ( closing )
+            {
+                return SIZE_MAX;
+            }
+            auto current = inFlight.load ();
+            return current >= maxInFlight ? 0 : maxInFlight - current;
+        }
+
+        // hand a single message to paho.   Called by the publisher
+        bool send ( outboundMessage &msg )
+        {
+            clientMessage.payload = msg.payload.data ();
+            clientMessage.payloadlen = (int) msg.payload.size ();
+            clientMessage.qos = 0;
+            clientMessage.retained = 0;
+
+            if ( !msg.correlationData.empty () )
+            {
+                MQTTProperty corr_data_resp_prop;
+                corr_data_resp_prop.identifier = MQTTPROPERTY_CODE_CORRELATION_DATA;
+                corr_data_resp_prop.value.data.data = msg.correlationData.data ();
+                corr_data_resp_prop.value.data.len = (int) msg.correlationData.size ();
+
+                MQTTProperties_add ( &clientMessage.properties, &corr_data_resp_prop );
+            }
+            if ( msg.deflated )
+            {
+                MQTTProperty encoding_prop;
+                encoding_prop.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+                encoding_prop.value.data.data = const_cast<char *> ( contentEncodingProperty.data () );
+                encoding_prop.value.data.len = (int) contentEncodingProperty.size ();
+                encoding_prop.value.value.data = const_cast<char *> ( deflateEncoding.data () );
+                encoding_prop.value.value.len = (int) deflateEncoding.size ();
+
+                MQTTProperties_add ( &clientMessage.properties, &encoding_prop );
+            }
+
+            inFlight++;
+            auto rc = MQTTAsync_sendMessage ( client, msg.topic.c_str (), &clientMessage, &publishOptions );
+            MQTTProperties_free ( &clientMessage.properties );
+            if ( rc != MQTTASYNC_SUCCESS )
+            {
+                // no callback will be made for a message paho didn't accept
+                inFlight--;
+                publishFailures++;
+                return false;
+            }
+            return true;
+        }
+
+        // returns the value of a binary or string property of a paho message, or an empty view if it isn't present
+        static std::string_view getProperty ( MQTTProperties *properties, MQTTPropertyCodes code )
+        {
+            if ( MQTTProperties_hasProperty ( properties, code ) )
+            {
+                auto *property = MQTTProperties_getProperty ( properties, code );
+                return {property->value.data.data, (size_t) property->value.data.len};
+            }
+            return {};
+        }
+
+        // returns the value of the user property named name, or an empty view if the message doesn't have one
+        static std::string_view getUserProperty ( MQTTProperties *properties, std::string_view name )
+        {
+            for ( int i = 0; i < properties->count; i++ )
+            {
+                auto const &property = properties->array[i];
+                if ( property.identifier == MQTTPROPERTY_CODE_USER_PROPERTY && std::string_view ( property.value.data.data, (size_t) property.value.data.len ) == name )
+                {
+                    return {property.value.value.data, (size_t) property.value.value.len};
+                }
+            }
+            return {};
+        }
+
+        // called on one of paho's threads.   As with the synchronous interface, we only decode the request here and hand it to the scheduler
+        static int messageArrived ( void *context, char *topic, int, MQTTAsync_message *message )
+        {
+            auto *mqttInterface = reinterpret_cast<dabMQTTAsyncInterface *>(context);
+
+            mqttInterface->handleRequest ( topic, {(char const *) message->payload, (size_t) message->payloadlen}, getProperty ( &message->properties, MQTTPROPERTY_CODE_RESPONSE_TOPIC ), getProperty ( &message->properties, MQTTPROPERTY_CODE_CORRELATION_DATA ), getUserProperty ( &message->properties, acceptEncodingProperty ) );
+
+            MQTTAsync_freeMessage ( &message );
+            MQTTAsync_free ( topic );
+            return 1;
+        }
+
+        static void connectionLost ( void *context, char * )
+        {
+            auto *mqttInterface = reinterpret_cast<dabMQTTAsyncInterface *>(context);
+            mqttInterface->closing = true;
+            mqttInterface->wakePublisher ();
+            std::lock_guard l1 ( mqttInterface->runningMutex );
+            mqttInterface->running.notify_all ();
+        }
+
+    public:
+
+        // the client id is "dab", see setClientId()
+        dabMQTTAsyncInterface ( BRIDGE &bridge, std::string const &brokerAddress ) : base ( bridge ), brokerAddress ( brokerAddress )
+        {
+            publishOptions.onSuccess5 = onPublishSuccess;
+            publishOptions.onFailure5 = onPublishFailure;
+            publishOptions.context = this;
+
+            static_assert ( dabOutboundTransport<dabMQTTAsyncInterface> );
+            this->startPublisher ();
+        }
+
+        ~dabMQTTAsyncInterface ()
+        {
+            closing = true;
+            this->shutdown ();
+            if ( client )
+            {
+                MQTTAsync_destroy ( &client );
+            }
+        }
+
+        // set the maximum number of publishes that may be outstanding (handed to the client library but not yet written to the broker).
+        // a larger window hides more broker latency at the cost of more memory held in the client library
+        void setInflightWindow ( size_t window )
+        {
+            maxInFlight = std::max ( window, (size_t) 1 );
+            this->wakePublisher ();
+        }
+
+        // return the adapter's request statistics, along with the state of the publish window
+        jsonElement getStatistics ()
+        {
+            auto stats = base::getStatistics ();
+            stats["publish"] = {{"inFlight",  inFlight.load ()},
+                                {"window",    maxInFlight},
+                                {"published", published.load ()},
+                                {"failed",    publishFailures.load ()}};
+            return stats;
+        }
+
+        // this is the method to actually establish a connection with the mqtt broker.  At this point any initialization that needs to be done should have finished
+        // it returns once the connection has been established and all request topics subscribed
+        auto connect ()
+        {
+            auto connectStart = std::chrono::steady_clock::now ();
+
+            // the client is created here rather than by the constructor as its id may be set up to now
+            MQTTAsync_createOptions createOpts = MQTTAsync_createOptions_initializer5;
+            if ( auto rc = MQTTAsync_createWithOptions ( &client, brokerAddress.c_str (), this->clientIdOf ( 0 ).c_str (), MQTTASYNC_PERSISTENCE_NONE, nullptr, &createOpts ) )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to create client" ) );
+            }
+            if ( auto rc = MQTTAsync_setCallbacks ( client, this, connectionLost, messageArrived, nullptr ) )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to set callbacks" ) );
+            }
+
+            MQTTAsync_connectOptions conn_opts = MQTTAsync_connectOptions_initializer5;
+
+            conn_opts.keepAliveInterval = 20;
+            conn_opts.connectTimeout = (int) CONNECT_TIMEOUT.count ();
+            auto connected = completion::attach ( conn_opts );
+
+            closing = false;
+            if ( auto rc = MQTTAsync_connect ( client, &conn_opts ) )
+            {
+                completion::detach ( conn_opts );
+                throw DAB::dabException ( rc, std::string ( "Failed to set connect" ) );
+            }
+            if ( auto rc = connected->wait ( std::chrono::steady_clock::now () + CONNECT_TIMEOUT ) )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to set connect" ) );
+            }
+
+            topics = this->subscriptionTopics ();
+
+            auto subscribeStart = std::chrono::steady_clock::now ();
+            size_t requests = 0;
+            std::vector<int> qos;
+            auto rc = requestChunked ( [this, &qos] ( std::vector<char *> &topicPtrs, MQTTAsync_responseOptions &opts )
+                                       {
+                                           qos.assign ( topicPtrs.size (), 1 );
+                                           return MQTTAsync_subscribeMany ( client, (int) topicPtrs.size (), topicPtrs.data (), qos.data (), &opts );
+                                       }, subscribeStart + CONNECT_TIMEOUT, &requests );
+            if ( rc )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to subscribe" ) );
+            }
+            this->markReady ( connectStart, subscribeStart, topics.size (), requests );
+            return 0;
+        }
+
+        // drains the adapter before disconnecting, exactly as dabMQTTInterface::disconnect() does.   In addition, once everything has been
+        // handed to the client library, we wait (until the deadline) for all publishes in flight to complete
+        auto disconnect ( std::chrono::milliseconds deadline = std::chrono::milliseconds ( 10000 ) )
+        {
+            auto until = std::chrono::steady_clock::now () + deadline;
+
+            requestChunked ( [this] ( std::vector<char *> &topicPtrs, MQTTAsync_responseOptions &opts )
+                             {
+                                 return MQTTAsync_unsubscribeMany ( client, (int) topicPtrs.size (), topicPtrs.data (), &opts );
+                             }, until );
+
+            this->drain ( until );
+
+            while ( inFlight && !closing && std::chrono::steady_clock::now () < until )
+            {
+                std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+            }
+
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds> ( until - std::chrono::steady_clock::now () );
+            MQTTAsync_disconnectOptions disc_opts = MQTTAsync_disconnectOptions_initializer5;
+            disc_opts.timeout = (int) std::max ( remaining.count (), (int64_t) 0 );
+            auto disconnected = completion::attach ( disc_opts );
+            if ( auto rc = MQTTAsync_disconnect ( client, &disc_opts ) )
+            {
+                completion::detach ( disc_opts );
+                throw DAB::dabException ( rc, std::string ( "Failed to disconnect" ));
+            }
+            disconnected->wait ( std::max ( until, std::chrono::steady_clock::now () + std::chrono::milliseconds ( 100 ) ) );
+
+            std::lock_guard l1 ( runningMutex );
+            closing = true;
+            running.notify_all ();
+            return 0;
+        }
+
+        // this function will wait until the mqtt interface has been properly shut down, or errors due to connectivity loss.
+        void wait ()
+        {
+            std::unique_lock l1 ( runningMutex );
+            running.wait ( l1, [this] () { return closing.load (); } );
+        }
+    };
+}
@@ -0,0 +1,977 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#if !defined ( __linux__ )
+#error dabMQTTBrokerInterface requires epoll and is only available on linux
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dabMqttCodec.h"
+#include "dabMqttInterfaceBase.h"
+
+// mqtt interface that is itself a small MQTT 5 broker, for devices that host their own adapter.   Controllers and other local clients connect
+// to the adapter directly.   Publishes to the adapter's request topics are handed to the request decoder in process, responses and telemetry
+// are written straight to the sockets of the clients subscribed to them, so a request never crosses a second process or network hop.
+// publishes are also routed between clients as any broker would, so a client can watch requests or another client's telemetry.
+// it is deliberately minimal: sessions aren't kept once a client disconnects, messages are delivered at qos 0 (qos 1 publishes from clients
+// are acknowledged on receipt), and there are no retained messages, wills or shared subscriptions.
+// a single reactor thread accepts connections and reads from every client.   Any thread may write to a client, writes hold brokerMutex.
+// a client that falls too far behind is disconnected rather than slowing the adapter or other clients down.
+
+namespace DAB
+{
+    template< typename BRIDGE >
+    class dabMQTTBrokerInterface : public dabMQTTInterfaceBase<dabMQTTBrokerInterface<BRIDGE>, BRIDGE>
+    {
+        using base = dabMQTTInterfaceBase<dabMQTTBrokerInterface<BRIDGE>, BRIDGE>;
+        friend base;
+
+        using typename base::threadingPolicy;
+        using typename base::outboundMessage;
+        using base::running;
+        using base::runningMutex;
+        using base::topics;
+
+        static_assert ( threadingPolicy::concurrent, "the embedded broker runs its own reactor thread and can not be used with dabSingleThreaded" );
+
+        constexpr static auto CONNECT_TIMEOUT = std::chrono::seconds ( 10 );   // a client must send CONNECT within this
+        constexpr static size_t READ_SIZE = 64 * 1024;                  // minimum free space in a receive buffer for each read
+        constexpr static uint32_t MAX_PACKET_SIZE = 1024 * 1024;        // largest packet accepted from a client
+        constexpr static size_t WRITE_HIGH_WATER = 4 * 1024 * 1024;     // a client with more than this waiting to be written is disconnected
+        constexpr static size_t MAX_CLIENTS = 256;
+
+        // mqtt 5 reason codes used by the broker
+        constexpr static uint8_t RC_NO_SUBSCRIPTION = 0x11;
+        constexpr static uint8_t RC_MALFORMED = 0x81;
+        constexpr static uint8_t RC_PROTOCOL_ERROR = 0x82;
+        constexpr static uint8_t RC_SHUTTING_DOWN = 0x8B;
+        constexpr static uint8_t RC_KEEP_ALIVE_TIMEOUT = 0x8D;
+        constexpr static uint8_t RC_TAKEN_OVER = 0x8E;
+        constexpr static uint8_t RC_FILTER_INVALID = 0x8F;
+        constexpr static uint8_t RC_TOPIC_INVALID = 0x90;
+        constexpr static uint8_t RC_TOPIC_ALIAS_INVALID = 0x94;
+        constexpr static uint8_t RC_PACKET_TOO_LARGE = 0x95;
+        constexpr static uint8_t RC_QOS_NOT_SUPPORTED = 0x9B;
+        constexpr static uint8_t RC_SHARED_NOT_SUPPORTED = 0x9E;
+
+        struct session
+        {
+            int fd = -1;
+            std::string rx;                                             // only the reactor touches the receive side
+            size_t rxUsed = 0;
+            std::string pendingOut;                                     // bytes the socket wouldn't take, guarded by brokerMutex
+            bool writeArmed = false;
+            bool connected = false;                                     // CONNECT has been received
+            bool closing = false;                                       // set by a failed write, the reactor closes the session
+            std::string clientId;
+            std::chrono::seconds keepAlive{ 0 };
+            std::chrono::time_point<std::chrono::steady_clock> lastRead;
+            uint32_t maximumPacketSize = 0;                             // the client's limit, 0 if it didn't give one
+            std::vector<std::string> filters;
+        };
+
+        // heterogeneous lookup so that routing a publish doesn't have to build a std::string from its topic
+        struct topicHash
+        {
+            using is_transparent = void;
+
+            size_t operator() ( std::string_view topic ) const
+            {
+                return std::hash<std::string_view>{} ( topic );
+            }
+        };
+
+        std::string host;
+        std::string port;
+
+        int listenFd = -1;
+        int wakeFd = -1;                                                // eventfd, used to stop the reactor and to have it close sessions
+        int epollFd = -1;
+        std::thread reactorThread;
+        std::atomic<bool> listening = false;
+        std::atomic<bool> dispatching = false;                          // requests are handed to the adapter
+        std::atomic<bool> sweepNeeded = false;
+
+        // client sessions and subscriptions.   Sessions are only created and destroyed by the reactor, but anything that reads the
+        // subscription tables or writes to a client holds brokerMutex
+        std::mutex brokerMutex;
+        std::map<int, std::unique_ptr<session>> sessions;
+        std::unordered_multimap<std::string, session *, topicHash, std::equal_to<>> exactSubscriptions;
+        std::vector<std::pair<std::string, session *>> filterSubscriptions;
+        std::vector<session *> targets;
+        std::string publishHeader;
+        mqttPropertyWriter publishProps;                                // built by the publisher
+        mqttPropertyWriter forwardProps;                                // built by the reactor
+        uint64_t nextClientId = 0;
+
+        // the adapter's own request topics (or wildcard filters), fixed once listening
+        mqttTopicFilterSet adapterTopics;
+
+        std::atomic<size_t> clients = 0;
+        std::atomic<uint64_t> accepted = 0;
+        std::atomic<uint64_t> received = 0;
+        std::atomic<uint64_t> dispatched = 0;
+        std::atomic<uint64_t> delivered = 0;
+        std::atomic<uint64_t> dropped = 0;
+        std::atomic<uint64_t> slowDisconnects = 0;
+
+        // wake the reactor so that it closes sessions marked as closing
+        void kickReactor ()
+        {
+            sweepNeeded = true;
+            uint64_t one = 1;
+            [[maybe_unused]] auto rc = ::write ( wakeFd, &one, sizeof ( one ) );
+        }
+
+        // ask the reactor to tell us when the client's socket is writable.   Called with brokerMutex held
+        void armWrite ( session &s, bool arm )
+        {
+            if ( arm != s.writeArmed )
+            {
+                s.writeArmed = arm;
+                epoll_event ev{};
+                ev.events = EPOLLIN | (arm ? (uint32_t) EPOLLOUT : 0);
+                ev.data.fd = s.fd;
+                epoll_ctl ( epollFd, EPOLL_CTL_MOD, s.fd, &ev );
+            }
+        }
+
+        // write iov to a client, buffering whatever its socket won't take.   A client that can't keep up is closed.   Called with brokerMutex held
+        void writeLocked ( session &s, iovec *iov, size_t iovCount )
+        {
+            if ( s.closing )
+            {
+                return;
+            }
+
+            size_t total = 0;
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                total += iov[loop].iov_len;
+            }
+
+            ssize_t written = 0;
+            if ( s.pendingOut.empty () )
+            {
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovCount;
+                written = ::sendmsg ( s.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+                if ( written < 0 )
+                {
+                    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                    {
+                        s.closing = true;
+                        kickReactor ();
+                        return;
+                    }
+                    written = 0;
+                }
+                if ( (size_t) written == total )
+                {
+                    return;
+                }
+            }
+
+            if ( s.pendingOut.size () + total - (size_t) written > WRITE_HIGH_WATER )
+            {
+                slowDisconnects++;
+                s.closing = true;
+                kickReactor ();
+                return;
+            }
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                auto len = iov[loop].iov_len;
+                if ( (size_t) written >= len )
+                {
+                    written -= (ssize_t) len;
+                    continue;
+                }
+                s.pendingOut.append ( (char const *) iov[loop].iov_base + written, len - (size_t) written );
+                written = 0;
+            }
+            armWrite ( s, true );
+        }
+
+        void writePacket ( session &s, std::string_view packet )
+        {
+            iovec iov{ (void *) packet.data (), packet.size () };
+            std::lock_guard l1 ( brokerMutex );
+            writeLocked ( s, &iov, 1 );
+        }
+
+        // the client's socket has become writable, send what we buffered
+        void flushPending ( session &s )
+        {
+            std::lock_guard l1 ( brokerMutex );
+            while ( !s.pendingOut.empty () )
+            {
+                auto written = ::send ( s.fd, s.pendingOut.data (), s.pendingOut.size (), MSG_NOSIGNAL | MSG_DONTWAIT );
+                if ( written < 0 )
+                {
+                    if ( errno == EINTR )
+                    {
+                        continue;
+                    }
+                    if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                    {
+                        s.closing = true;
+                        sweepNeeded = true;
+                    }
+                    break;
+                }
+                s.pendingOut.erase ( 0, (size_t) written );
+            }
+            if ( s.pendingOut.empty () )
+            {
+                armWrite ( s, false );
+            }
+        }
+
+        // publish to every client with a matching subscription.   A client matching several of its filters gets one copy.   Called with brokerMutex held
+        void deliverLocked ( std::string_view topic, mqttPropertyWriter const &props, std::string_view payload )
+        {
+            targets.clear ();
+            auto [first, last] = exactSubscriptions.equal_range ( topic );
+            for ( ; first != last; first++ )
+            {
+                targets.push_back ( first->second );
+            }
+            for ( auto const &[filter, s] : filterSubscriptions )
+            {
+                if ( mqttTopicMatches ( filter, topic ) )
+                {
+                    targets.push_back ( s );
+                }
+            }
+            if ( targets.empty () )
+            {
+                return;
+            }
+            if ( targets.size () > 1 )
+            {
+                std::sort ( targets.begin (), targets.end () );
+                targets.erase ( std::unique ( targets.begin (), targets.end () ), targets.end () );
+            }
+
+            publishHeader.clear ();
+            encodePublishHeader ( publishHeader, topic, 0, false, 0, props, payload.size () );
+            auto packetSize = publishHeader.size () + payload.size ();
+            iovec iov[2] = {{publishHeader.data (),  publishHeader.size ()},
+                            {(void *) payload.data (), payload.size ()}};
+            for ( auto *s : targets )
+            {
+                if ( s->maximumPacketSize && packetSize > s->maximumPacketSize )
+                {
+                    dropped++;
+                    continue;
+                }
+                writeLocked ( *s, iov, payload.empty () ? 1 : 2 );
+                delivered++;
+            }
+        }
+
+        // publish a single message from the adapter to the clients subscribed to it.   Called by the publisher.   Having no subscriber isn't a
+        // failure, the message is discarded just as an external broker would
+        bool send ( outboundMessage &msg )
+        {
+            std::lock_guard l1 ( brokerMutex );
+            publishProps.clear ();
+            if ( !msg.correlationData.empty () )
+            {
+                publishProps.string ( mqttProperty::correlationData, msg.correlationData );
+            }
+            if ( msg.deflated )
+            {
+                publishProps.userProperty ( contentEncodingProperty, deflateEncoding );
+            }
+            deliverLocked ( msg.topic, publishProps, msg.payload );
+            return true;
+        }
+
+        // wildcards must occupy a whole level and # can only be the last
+        static bool isValidFilter ( std::string_view filter )
+        {
+            if ( filter.empty () )
+            {
+                return false;
+            }
+            for ( size_t pos = 0; pos < filter.size (); pos++ )
+            {
+                if ( filter[pos] != '+' && filter[pos] != '#' )
+                {
+                    continue;
+                }
+                if ( (pos && filter[pos - 1] != '/') || (pos + 1 < filter.size () && filter[pos + 1] != '/') )
+                {
+                    return false;
+                }
+                if ( filter[pos] == '#' && pos + 1 != filter.size () )
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // add or remove a client's subscription.   Called with brokerMutex held
+        void subscribeLocked ( session &s, std::string_view filter )
+        {
+            if ( std::find ( s.filters.begin (), s.filters.end (), filter ) != s.filters.end () )
+            {
+                return;
+            }
+            s.filters.emplace_back ( filter );
+            if ( filter.find_first_of ( "+#" ) == std::string_view::npos )
+            {
+                exactSubscriptions.emplace ( std::string ( filter ), &s );
+            } else
+            {
+                filterSubscriptions.emplace_back ( std::string ( filter ), &s );
+            }
+        }
+
+        bool unsubscribeLocked ( session &s, std::string_view filter )
+        {
+            auto it = std::find ( s.filters.begin (), s.filters.end (), filter );
+            if ( it == s.filters.end () )
+            {
+                return false;
+            }
+            s.filters.erase ( it );
+            auto [first, last] = exactSubscriptions.equal_range ( filter );
+            for ( ; first != last; first++ )
+            {
+                if ( first->second == &s )
+                {
+                    exactSubscriptions.erase ( first );
+                    return true;
+                }
+            }
+            std::erase_if ( filterSubscriptions, [&s, filter] ( auto const &sub ) { return sub.second == &s && sub.first == filter; } );
+            return true;
+        }
+
+        // remove a session and its subscriptions.   Runs on the reactor with brokerMutex held
+        void closeSessionLocked ( int fd, uint8_t reasonCode = 0 )
+        {
+            auto it = sessions.find ( fd );
+            if ( it == sessions.end () )
+            {
+                return;
+            }
+            auto &s = *it->second;
+            if ( reasonCode && s.connected && !s.closing )
+            {
+                // best effort, let the client know why
+                std::string packet;
+                encodeDisconnect ( packet, reasonCode );
+                [[maybe_unused]] auto rc = ::send ( s.fd, packet.data (), packet.size (), MSG_NOSIGNAL | MSG_DONTWAIT );
+            }
+            while ( !s.filters.empty () )
+            {
+                unsubscribeLocked ( s, std::string ( s.filters.back () ) );
+            }
+            epoll_ctl ( epollFd, EPOLL_CTL_DEL, s.fd, nullptr );
+            ::close ( s.fd );
+            sessions.erase ( it );
+            clients--;
+        }
+
+        void closeSession ( session &s, uint8_t reasonCode = 0 )
+        {
+            std::lock_guard l1 ( brokerMutex );
+            closeSessionLocked ( s.fd, reasonCode );
+        }
+
+        // the first packet from a client must be its CONNECT.   Returns false if the session has been closed
+        bool handleConnect ( session &s, uint8_t first, std::string_view body )
+        {
+            mqttConnect pkt;
+            if ( (mqttPacketType) (first >> 4) != mqttPacketType::connect || !decodeConnect ( body, pkt ) )
+            {
+                closeSession ( s );
+                return false;
+            }
+            if ( pkt.version != 5 )
+            {
+                // MQTT 3.1.1 CONNACK, unacceptable protocol version
+                char connack[] = {0x20, 0x02, 0x00, 0x01};
+                [[maybe_unused]] auto rc = ::send ( s.fd, connack, sizeof ( connack ), MSG_NOSIGNAL | MSG_DONTWAIT );
+                closeSession ( s );
+                return false;
+            }
+
+            mqttPropertyWriter props;
+            props.byte ( mqttProperty::maximumQos, 1 ).byte ( mqttProperty::retainAvailable, 0 ).byte ( mqttProperty::sharedSubAvailable, 0 )
+                 .byte ( mqttProperty::subscriptionIdAvailable, 0 ).u32 ( mqttProperty::maximumPacketSize, MAX_PACKET_SIZE );
+
+            std::lock_guard l1 ( brokerMutex );
+            if ( pkt.clientId.empty () )
+            {
+                s.clientId = "dab-local-" + std::to_string ( ++nextClientId );
+                props.string ( mqttProperty::assignedClientId, s.clientId );
+            } else
+            {
+                s.clientId = pkt.clientId;
+                // a client reconnecting with the same id takes over from its old connection
+                for ( auto &[fd, other] : sessions )
+                {
+                    if ( other.get () != &s && other->connected && !other->closing && other->clientId == s.clientId )
+                    {
+                        std::string packet;
+                        encodeDisconnect ( packet, RC_TAKEN_OVER );
+                        iovec iov{ packet.data (), packet.size () };
+                        writeLocked ( *other, &iov, 1 );
+                        other->closing = true;
+                        sweepNeeded = true;
+                    }
+                }
+            }
+            s.connected = true;
+            s.keepAlive = std::chrono::seconds ( pkt.keepAlive );
+            s.maximumPacketSize = pkt.props.maximumPacketSize;
+
+            std::string packet;
+            encodeConnack ( packet, false, 0, props );
+            iovec iov{ packet.data (), packet.size () };
+            writeLocked ( s, &iov, 1 );
+            return true;
+        }
+
+        // decode and act on a single packet from a client.   Runs on the reactor.   Returns false if the session has been closed
+        bool handlePacket ( session &s, uint8_t first, std::string_view body )
+        {
+            if ( !s.connected )
+            {
+                return handleConnect ( s, first, body );
+            }
+
+            switch ( (mqttPacketType) (first >> 4) )
+            {
+                case mqttPacketType::publish:
+                {
+                    mqttPublish pkt;
+                    if ( !decodePublish ( first & 0x0F, body, pkt ) )
+                    {
+                        closeSession ( s, RC_MALFORMED );
+                        return false;
+                    }
+                    if ( pkt.qos > 1 )
+                    {
+                        closeSession ( s, RC_QOS_NOT_SUPPORTED );
+                        return false;
+                    }
+                    if ( pkt.props.topicAlias )
+                    {
+                        // we never grant topic aliases, so every publish must carry its topic
+                        closeSession ( s, RC_TOPIC_ALIAS_INVALID );
+                        return false;
+                    }
+                    if ( pkt.topic.empty () || pkt.topic.find_first_of ( "+#" ) != std::string_view::npos )
+                    {
+                        closeSession ( s, RC_TOPIC_INVALID );
+                        return false;
+                    }
+                    if ( pkt.qos == 1 )
+                    {
+                        std::string ack;
+                        encodeAck ( ack, mqttPacketType::puback, pkt.packetId );
+                        writePacket ( s, ack );
+                    }
+                    received++;
+
+                    {
+                        std::lock_guard l1 ( brokerMutex );
+                        forwardProps.clear ();
+                        forwardProps.raw ( pkt.props.raw );
+                        deliverLocked ( pkt.topic, forwardProps, pkt.payload );
+                    }
+
+                    // requests for the adapter are decoded right here, with no copy and no further hop
+                    if ( dispatching && adapterTopics.matches ( pkt.topic ) )
+                    {
+                        dispatched++;
+                        this->handleRequest ( pkt.topic, pkt.payload, pkt.props.responseTopic, pkt.props.correlationData, pkt.props.acceptEncoding );
+                    }
+                    break;
+                }
+                case mqttPacketType::subscribe:
+                {
+                    uint16_t packetId = 0;
+                    mqttProperties props;
+                    std::string reasonCodes;
+                    std::lock_guard l1 ( brokerMutex );
+                    auto ok = decodeSubscribe ( body, packetId, props, [&] ( std::string_view filter, uint8_t )
+                    {
+                        if ( filter.starts_with ( "$share/" ) )
+                        {
+                            reasonCodes.push_back ( (char) RC_SHARED_NOT_SUPPORTED );
+                        } else if ( !isValidFilter ( filter ) )
+                        {
+                            reasonCodes.push_back ( (char) RC_FILTER_INVALID );
+                        } else
+                        {
+                            // granted qos 0
+                            subscribeLocked ( s, filter );
+                            reasonCodes.push_back ( 0 );
+                        }
+                    } );
+                    if ( !ok || reasonCodes.empty () )
+                    {
+                        closeSessionLocked ( s.fd, RC_PROTOCOL_ERROR );
+                        return false;
+                    }
+                    std::string packet;
+                    encodeSubAck ( packet, mqttPacketType::suback, packetId, reasonCodes );
+                    iovec iov{ packet.data (), packet.size () };
+                    writeLocked ( s, &iov, 1 );
+                    break;
+                }
+                case mqttPacketType::unsubscribe:
+                {
+                    uint16_t packetId = 0;
+                    mqttProperties props;
+                    std::string reasonCodes;
+                    std::lock_guard l1 ( brokerMutex );
+                    auto ok = decodeUnsubscribe ( body, packetId, props, [&] ( std::string_view filter )
+                    {
+                        reasonCodes.push_back ( (char) (unsubscribeLocked ( s, filter ) ? 0 : RC_NO_SUBSCRIPTION) );
+                    } );
+                    if ( !ok || reasonCodes.empty () )
+                    {
+                        closeSessionLocked ( s.fd, RC_PROTOCOL_ERROR );
+                        return false;
+                    }
+                    std::string packet;
+                    encodeSubAck ( packet, mqttPacketType::unsuback, packetId, reasonCodes );
+                    iovec iov{ packet.data (), packet.size () };
+                    writeLocked ( s, &iov, 1 );
+                    break;
+                }
+                case mqttPacketType::pingreq:
+                {
+                    std::string packet;
+                    encodePing ( packet, mqttPacketType::pingresp );
+                    writePacket ( s, packet );
+                    break;
+                }
+                case mqttPacketType::disconnect:
+                    closeSession ( s );
+                    return false;
+                case mqttPacketType::puback:
+                    // we only deliver at qos 0, nothing to acknowledge
+                    break;
+                default:
+                    closeSession ( s, RC_PROTOCOL_ERROR );
+                    return false;
+            }
+            return true;
+        }
+
+        // decode every complete packet in the client's receive buffer.   Returns false if the session has been closed
+        bool processReceived ( session &s )
+        {
+            size_t pos = 0;
+            while ( pos < s.rxUsed )
+            {
+                std::string_view view ( s.rx.data () + pos, s.rxUsed - pos );
+                size_t headerLen = 0;
+                auto len = mqttFrameLength ( view, headerLen );
+                if ( len == SIZE_MAX )
+                {
+                    closeSession ( s, RC_MALFORMED );
+                    return false;
+                }
+                if ( len > MAX_PACKET_SIZE || (!len && view.size () > MAX_PACKET_SIZE) )
+                {
+                    closeSession ( s, RC_PACKET_TOO_LARGE );
+                    return false;
+                }
+                if ( !len )
+                {
+                    break;
+                }
+                if ( !handlePacket ( s, (uint8_t) view[0], view.substr ( headerLen, len - headerLen ) ) )
+                {
+                    return false;
+                }
+                pos += len;
+            }
+            if ( pos )
+            {
+                std::memmove ( s.rx.data (), s.rx.data () + pos, s.rxUsed - pos );
+                s.rxUsed -= pos;
+            }
+            return true;
+        }
+
+        // read whatever a client has sent
+        void readSession ( session &s )
+        {
+            for ( ;; )
+            {
+                if ( s.rx.size () - s.rxUsed < READ_SIZE )
+                {
+                    s.rx.resize ( s.rxUsed + READ_SIZE );
+                }
+                auto len = ::recv ( s.fd, s.rx.data () + s.rxUsed, s.rx.size () - s.rxUsed, MSG_DONTWAIT );
+                if ( len > 0 )
+                {
+                    s.rxUsed += (size_t) len;
+                    s.lastRead = std::chrono::steady_clock::now ();
+                    if ( !processReceived ( s ) )
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                if ( len < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                if ( len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+                {
+                    return;
+                }
+                closeSession ( s );
+                return;
+            }
+        }
+
+        void acceptClients ()
+        {
+            for ( ;; )
+            {
+                auto fd = ::accept4 ( listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC );
+                if ( fd < 0 )
+                {
+                    if ( errno == EINTR )
+                    {
+                        continue;
+                    }
+                    return;
+                }
+                if ( clients >= MAX_CLIENTS )
+                {
+                    ::close ( fd );
+                    continue;
+                }
+                int one = 1;
+                setsockopt ( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof ( one ) );
+
+                auto s = std::make_unique<session> ();
+                s->fd = fd;
+                s->lastRead = std::chrono::steady_clock::now ();
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.fd = fd;
+                epoll_ctl ( epollFd, EPOLL_CTL_ADD, fd, &ev );
+
+                std::lock_guard l1 ( brokerMutex );
+                sessions.emplace ( fd, std::move ( s ) );
+                clients++;
+                accepted++;
+            }
+        }
+
+        // close sessions that failed a write, never sent CONNECT or have gone quiet for 1.5 times their keep alive
+        void sweepSessions ( bool checkTimeouts )
+        {
+            auto now = std::chrono::steady_clock::now ();
+            std::lock_guard l1 ( brokerMutex );
+            std::vector<std::pair<int, uint8_t>> expired;
+            for ( auto &[fd, s] : sessions )
+            {
+                if ( s->closing )
+                {
+                    expired.emplace_back ( fd, 0 );
+                } else if ( checkTimeouts && !s->connected && now - s->lastRead > CONNECT_TIMEOUT )
+                {
+                    expired.emplace_back ( fd, 0 );
+                } else if ( checkTimeouts && s->connected && s->keepAlive.count () && now - s->lastRead > s->keepAlive * 3 / 2 )
+                {
+                    expired.emplace_back ( fd, RC_KEEP_ALIVE_TIMEOUT );
+                }
+            }
+            for ( auto [fd, reasonCode] : expired )
+            {
+                closeSessionLocked ( fd, reasonCode );
+            }
+        }
+
+        void reactorTask ()
+        {
+            epoll_event events[64];
+            auto lastSweep = std::chrono::steady_clock::now ();
+
+            while ( listening )
+            {
+                auto n = epoll_wait ( epollFd, events, 64, 1000 );
+                for ( int loop = 0; loop < n; loop++ )
+                {
+                    auto fd = events[loop].data.fd;
+                    if ( fd == wakeFd )
+                    {
+                        uint64_t value;
+                        [[maybe_unused]] auto rc = ::read ( wakeFd, &value, sizeof ( value ) );
+                        continue;
+                    }
+                    if ( fd == listenFd )
+                    {
+                        acceptClients ();
+                        continue;
+                    }
+                    // sessions are only erased by this thread, the pointer stays valid until we close it
+                    auto it = sessions.find ( fd );
+                    if ( it == sessions.end () )
+                    {
+                        continue;
+                    }
+                    auto &s = *it->second;
+                    if ( events[loop].events & EPOLLOUT )
+                    {
+                        flushPending ( s );
+                    }
+                    if ( events[loop].events & (EPOLLIN | EPOLLHUP | EPOLLERR) )
+                    {
+                        readSession ( s );
+                    }
+                }
+
+                auto now = std::chrono::steady_clock::now ();
+                auto checkTimeouts = now - lastSweep >= std::chrono::seconds ( 1 );
+                if ( sweepNeeded.exchange ( false ) || checkTimeouts )
+                {
+                    sweepSessions ( checkTimeouts );
+                    if ( checkTimeouts )
+                    {
+                        lastSweep = now;
+                    }
+                }
+            }
+        }
+
+        void openListener ()
+        {
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            addrinfo *result = nullptr;
+            if ( auto rc = getaddrinfo ( host.empty () ? nullptr : host.c_str (), port.c_str (), &hints, &result ) )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to resolve " ) + host );
+            }
+            for ( auto *ai = result; ai; ai = ai->ai_next )
+            {
+                listenFd = ::socket ( ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol );
+                if ( listenFd < 0 )
+                {
+                    continue;
+                }
+                int one = 1;
+                setsockopt ( listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof ( one ) );
+                if ( !::bind ( listenFd, ai->ai_addr, ai->ai_addrlen ) && !::listen ( listenFd, SOMAXCONN ) )
+                {
+                    break;
+                }
+                ::close ( listenFd );
+                listenFd = -1;
+            }
+            freeaddrinfo ( result );
+            if ( listenFd < 0 )
+            {
+                throw DAB::dabException ( errno, std::string ( "Failed to listen on " ) + host + ":" + port );
+            }
+        }
+
+        // stop the reactor and close every socket
+        void closeListener ()
+        {
+            listening = false;
+            if ( reactorThread.joinable () )
+            {
+                uint64_t one = 1;
+                [[maybe_unused]] auto rc = ::write ( wakeFd, &one, sizeof ( one ) );
+                reactorThread.join ();
+            }
+            std::lock_guard l1 ( brokerMutex );
+            while ( !sessions.empty () )
+            {
+                closeSessionLocked ( sessions.begin ()->first );
+            }
+            for ( auto *f : {&listenFd, &epollFd, &wakeFd} )
+            {
+                if ( *f >= 0 )
+                {
+                    ::close ( *f );
+                    *f = -1;
+                }
+            }
+        }
+
+    public:
+
+        // listenAddress is the address clients connect to: host:port, tcp://host:port or mqtt://host:port.   Use 0.0.0.0 (or an empty host) to
+        // accept connections on every interface, 127.0.0.1 for clients on this device only.   The default port is 1883
+        dabMQTTBrokerInterface ( BRIDGE &bridge, std::string const &listenAddress ) : base ( bridge )
+        {
+            std::string_view address ( listenAddress );
+            for ( auto scheme : {"tcp://", "mqtt://"} )
+            {
+                if ( address.starts_with ( scheme ) )
+                {
+                    address.remove_prefix ( std::strlen ( scheme ) );
+                }
+            }
+            auto colon = address.rfind ( ':' );
+            if ( colon != std::string_view::npos && address.find ( ']' , colon ) == std::string_view::npos )
+            {
+                host = std::string ( address.substr ( 0, colon ) );
+                port = std::string ( address.substr ( colon + 1 ) );
+            } else
+            {
+                host = std::string ( address );
+                port = "1883";
+            }
+            if ( host.size () > 1 && host.front () == '[' && host.back () == ']' )
+            {
+                host = host.substr ( 1, host.size () - 2 );
+            }
+
+            static_assert ( dabOutboundTransport<dabMQTTBrokerInterface> );
+            this->startPublisher ();
+        }
+
+        ~dabMQTTBrokerInterface ()
+        {
+            this->shutdown ();
+            closeListener ();
+        }
+
+        // return the adapter's request statistics, along with the broker's clients and message counts
+        jsonElement getStatistics ()
+        {
+            auto stats = base::getStatistics ();
+            stats["broker"] = {{"clients",         (int64_t) clients.load ()},
+                               {"accepted",        accepted.load ()},
+                               {"received",        received.load ()},
+                               {"dispatched",      dispatched.load ()},
+                               {"delivered",       delivered.load ()},
+                               {"dropped",         dropped.load ()},
+                               {"slowDisconnects", slowDisconnects.load ()}};
+            return stats;
+        }
+
+        // start accepting clients.   There is nothing to subscribe to, requests on the adapter's topics are dispatched as soon as we're listening
+        auto connect ()
+        {
+            auto connectStart = std::chrono::steady_clock::now ();
+
+            topics = this->requestTopics ();
+            adapterTopics.assign ( topics.begin (), topics.end () );
+
+            openListener ();
+            epollFd = epoll_create1 ( EPOLL_CLOEXEC );
+            wakeFd = eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = listenFd;
+            epoll_ctl ( epollFd, EPOLL_CTL_ADD, listenFd, &ev );
+            ev.data.fd = wakeFd;
+            epoll_ctl ( epollFd, EPOLL_CTL_ADD, wakeFd, &ev );
+
+            dispatching = true;
+            listening = true;
+            reactorThread = std::thread ( &dabMQTTBrokerInterface::reactorTask, this );
+
+            this->markReady ( connectStart, std::chrono::steady_clock::now (), topics.size (), 0 );
+            return 0;
+        }
+
+        // stops dispatching requests, drains the adapter exactly as dabMQTTInterface::disconnect() does, gives clients until the deadline to
+        // read the last responses, then disconnects them and stops listening
+        auto disconnect ( std::chrono::milliseconds deadline = std::chrono::milliseconds ( 10000 ) )
+        {
+            auto until = std::chrono::steady_clock::now () + deadline;
+
+            dispatching = false;
+            this->drain ( until );
+
+            auto flushed = [this] ()
+            {
+                std::lock_guard l1 ( brokerMutex );
+                return std::all_of ( sessions.begin (), sessions.end (), [] ( auto const &s ) { return s.second->pendingOut.empty () || s.second->closing; } );
+            };
+            while ( listening && !flushed () && std::chrono::steady_clock::now () < until )
+            {
+                std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+            }
+
+            {
+                std::lock_guard l1 ( brokerMutex );
+                for ( auto &[fd, s] : sessions )
+                {
+                    if ( s->connected && !s->closing )
+                    {
+                        std::string packet;
+                        encodeDisconnect ( packet, RC_SHUTTING_DOWN );
+                        iovec iov{ packet.data (), packet.size () };
+                        writeLocked ( *s, &iov, 1 );
+                    }
+                }
+            }
+            closeListener ();
+
+            std::lock_guard l1 ( runningMutex );
+            running.notify_all ();
+            return 0;
+        }
+
+        // this function will wait until the broker has been shut down
+        void wait ()
+        {
+            std::unique_lock l1 ( runningMutex );
+            running.wait ( l1 );
+        }
+    };
+}
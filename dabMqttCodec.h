@@ -0,0 +1,963 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "dabCompression.h"
+
+// MQTT 5 wire format.
+// decoding is zero-copy: packets are decoded in place and every string, binary property and payload is returned as a std::string_view into the
+// receive buffer.   Those views are only valid until the caller reuses that part of the buffer.
+// encoding appends to a std::string.   Publishes are encoded as a header only (fixed header, topic, packet id and properties) so that the payload
+// can be written straight from wherever it already lives with scatter/gather I/O.
+
+namespace DAB
+{
+    enum class mqttPacketType : uint8_t
+    {
+        connect = 1,
+        connack = 2,
+        publish = 3,
+        puback = 4,
+        pubrec = 5,
+        pubrel = 6,
+        pubcomp = 7,
+        subscribe = 8,
+        suback = 9,
+        unsubscribe = 10,
+        unsuback = 11,
+        pingreq = 12,
+        pingresp = 13,
+        disconnect = 14,
+        auth = 15
+    };
+
+    enum class mqttProperty : uint8_t
+    {
+        payloadFormat = 0x01,
+        messageExpiry = 0x02,
+        contentType = 0x03,
+        responseTopic = 0x08,
+        correlationData = 0x09,
+        subscriptionId = 0x0B,
+        sessionExpiry = 0x11,
+        assignedClientId = 0x12,
+        serverKeepAlive = 0x13,
+        authMethod = 0x15,
+        authData = 0x16,
+        requestProblemInfo = 0x17,
+        willDelay = 0x18,
+        requestResponseInfo = 0x19,
+        responseInfo = 0x1A,
+        serverReference = 0x1C,
+        reasonString = 0x1F,
+        receiveMaximum = 0x21,
+        topicAliasMaximum = 0x22,
+        topicAlias = 0x23,
+        maximumQos = 0x24,
+        retainAvailable = 0x25,
+        userProperty = 0x26,
+        maximumPacketSize = 0x27,
+        wildcardAvailable = 0x28,
+        subscriptionIdAvailable = 0x29,
+        sharedSubAvailable = 0x2A
+    };
+
+    // bounds checked reader over a packet.   Any attempt to read past the end marks the reader bad and returns zero/empty values, so decoders
+    // can read a whole packet and check good() once at the end
+    class mqttReader
+    {
+        std::string_view buf;
+        size_t pos = 0;
+        bool ok = true;
+
+    public:
+        explicit mqttReader ( std::string_view buf ) : buf ( buf )
+        {
+        }
+
+        bool good () const
+        {
+            return ok;
+        }
+
+        size_t remaining () const
+        {
+            return buf.size () - pos;
+        }
+
+        uint8_t byte ()
+        {
+            if ( remaining () < 1 )
+            {
+                ok = false;
+                return 0;
+            }
+            return (uint8_t) buf[pos++];
+        }
+
+        uint16_t u16 ()
+        {
+            if ( remaining () < 2 )
+            {
+                ok = false;
+                return 0;
+            }
+            auto v = (uint16_t) (((uint8_t) buf[pos] << 8) | (uint8_t) buf[pos + 1]);
+            pos += 2;
+            return v;
+        }
+
+        uint32_t u32 ()
+        {
+            auto hi = u16 ();
+            return ((uint32_t) hi << 16) | u16 ();
+        }
+
+        // variable byte integer, at most four bytes
+        uint32_t varint ()
+        {
+            uint32_t value = 0;
+            for ( int shift = 0; shift < 28; shift += 7 )
+            {
+                auto b = byte ();
+                value |= (uint32_t) (b & 0x7F) << shift;
+                if ( !(b & 0x80) )
+                {
+                    return value;
+                }
+            }
+            ok = false;
+            return 0;
+        }
+
+        std::string_view bytes ( size_t len )
+        {
+            if ( remaining () < len )
+            {
+                ok = false;
+                return {};
+            }
+            auto v = buf.substr ( pos, len );
+            pos += len;
+            return v;
+        }
+
+        // two byte length prefixed string or binary data
+        std::string_view string ()
+        {
+            return bytes ( u16 () );
+        }
+
+        std::string_view rest ()
+        {
+            return bytes ( remaining () );
+        }
+    };
+
+    // the properties of a packet that the adapter uses.   String and binary values are views into the packet.   raw holds the complete
+    // property block so that anything else (user properties for instance) can be found with forEachProperty
+    struct mqttProperties
+    {
+        std::string_view raw;
+
+        std::string_view responseTopic;
+        std::string_view correlationData;
+        std::string_view contentType;
+        std::string_view reasonString;
+        std::string_view assignedClientId;
+        std::string_view acceptEncoding;                                // value of an "accept-encoding" user property
+        std::string_view contentEncoding;                               // value of a "content-encoding" user property
+
+        uint32_t sessionExpiry = 0;
+        uint32_t maximumPacketSize = 0;
+        uint32_t subscriptionId = 0;
+        uint16_t receiveMaximum = 65535;
+        uint16_t topicAliasMaximum = 0;
+        uint16_t topicAlias = 0;
+        uint16_t serverKeepAlive = 0;
+        uint8_t maximumQos = 2;
+        uint8_t payloadFormat = 0;
+    };
+
+    // calls func ( mqttProperty id, mqttReader &value ) for each property in a property block.  func must consume the value with the reader.
+    // returns false if the block is malformed
+    template< typename F >
+    bool forEachProperty ( std::string_view raw, F &&func )
+    {
+        mqttReader r ( raw );
+        while ( r.good () && r.remaining () )
+        {
+            auto id = (mqttProperty) r.varint ();
+            func ( id, r );
+        }
+        return r.good ();
+    }
+
+    // decodes the length prefixed property block at the reader's position
+    inline bool decodeProperties ( mqttReader &r, mqttProperties &props )
+    {
+        props.raw = r.bytes ( r.varint () );
+        if ( !r.good () )
+        {
+            return false;
+        }
+        return forEachProperty ( props.raw, [&props] ( mqttProperty id, mqttReader &v )
+        {
+            switch ( id )
+            {
+                case mqttProperty::payloadFormat:
+                    props.payloadFormat = v.byte ();
+                    break;
+                case mqttProperty::maximumQos:
+                    props.maximumQos = v.byte ();
+                    break;
+                case mqttProperty::requestProblemInfo:
+                case mqttProperty::requestResponseInfo:
+                case mqttProperty::retainAvailable:
+                case mqttProperty::wildcardAvailable:
+                case mqttProperty::subscriptionIdAvailable:
+                case mqttProperty::sharedSubAvailable:
+                    v.byte ();
+                    break;
+                case mqttProperty::messageExpiry:
+                case mqttProperty::willDelay:
+                    v.u32 ();
+                    break;
+                case mqttProperty::sessionExpiry:
+                    props.sessionExpiry = v.u32 ();
+                    break;
+                case mqttProperty::maximumPacketSize:
+                    props.maximumPacketSize = v.u32 ();
+                    break;
+                case mqttProperty::subscriptionId:
+                    props.subscriptionId = v.varint ();
+                    break;
+                case mqttProperty::serverKeepAlive:
+                    props.serverKeepAlive = v.u16 ();
+                    break;
+                case mqttProperty::receiveMaximum:
+                    props.receiveMaximum = v.u16 ();
+                    break;
+                case mqttProperty::topicAliasMaximum:
+                    props.topicAliasMaximum = v.u16 ();
+                    break;
+                case mqttProperty::topicAlias:
+                    props.topicAlias = v.u16 ();
+                    break;
+                case mqttProperty::contentType:
+                    props.contentType = v.string ();
+                    break;
+                case mqttProperty::responseTopic:
+                    props.responseTopic = v.string ();
+                    break;
+                case mqttProperty::correlationData:
+                    props.correlationData = v.string ();
+                    break;
+                case mqttProperty::reasonString:
+                    props.reasonString = v.string ();
+                    break;
+                case mqttProperty::assignedClientId:
+                    props.assignedClientId = v.string ();
+                    break;
+                case mqttProperty::authMethod:
+                case mqttProperty::authData:
+                case mqttProperty::responseInfo:
+                case mqttProperty::serverReference:
+                    v.string ();
+                    break;
+                case mqttProperty::userProperty:
+                {
+                    // the only user properties looked at are a request's accept-encoding and a response's content-encoding (see dabCompression.h)
+                    auto name = v.string ();
+                    auto value = v.string ();
+                    if ( name == acceptEncodingProperty )
+                    {
+                        props.acceptEncoding = value;
+                    } else if ( name == contentEncodingProperty )
+                    {
+                        props.contentEncoding = value;
+                    }
+                    break;
+                }
+                default:
+                    // unknown property, we can't know its length so the rest of the block can't be decoded
+                    v.bytes ( v.remaining () + 1 );
+                    break;
+            }
+        } );
+    }
+
+    // returns the total length announced by the fixed header at the start of buf, whether or not the rest of the packet has arrived, 0 if
+    // buf doesn't yet hold the whole fixed header, or SIZE_MAX if the length encoding is invalid.   headerLen is set to the length of the
+    // fixed header
+    inline size_t mqttPacketLength ( std::string_view buf, size_t &headerLen )
+    {
+        uint32_t remainingLength = 0;
+        for ( size_t loop = 1; loop < 5; loop++ )
+        {
+            if ( loop >= buf.size () )
+            {
+                return 0;
+            }
+            auto b = (uint8_t) buf[loop];
+            remainingLength |= (uint32_t) (b & 0x7F) << (7 * (loop - 1));
+            if ( !(b & 0x80) )
+            {
+                headerLen = loop + 1;
+                return headerLen + remainingLength;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    // returns the total length of the packet at the start of buf, 0 if buf doesn't yet hold a complete packet, or SIZE_MAX if the length
+    // encoding is invalid.   headerLen is set to the length of the fixed header
+    inline size_t mqttFrameLength ( std::string_view buf, size_t &headerLen )
+    {
+        auto total = mqttPacketLength ( buf, headerLen );
+        return total == SIZE_MAX || buf.size () >= total ? total : 0;
+    }
+
+    // the parts of a CONNECT a broker needs.   A will, user name and password are decoded past but not kept
+    struct mqttConnect
+    {
+        uint8_t version = 0;
+        bool cleanStart = false;
+        uint16_t keepAlive = 0;
+        std::string_view clientId;
+        mqttProperties props;
+    };
+
+    struct mqttConnack
+    {
+        bool sessionPresent = false;
+        uint8_t reasonCode = 0;
+        mqttProperties props;
+    };
+
+    struct mqttPublish
+    {
+        uint8_t qos = 0;
+        bool retain = false;
+        bool dup = false;
+        std::string_view topic;
+        uint16_t packetId = 0;
+        mqttProperties props;
+        std::string_view payload;
+    };
+
+    // acknowledgements (puback, suback, unsuback) and disconnect
+    struct mqttAck
+    {
+        uint16_t packetId = 0;
+        uint8_t reasonCode = 0;
+        std::string_view reasonCodes;       // suback/unsuback, one reason code per topic filter
+        mqttProperties props;
+    };
+
+    // returns false if the packet is malformed.   The protocol version isn't checked, the caller refuses anything other than 5
+    inline bool decodeConnect ( std::string_view body, mqttConnect &pkt )
+    {
+        mqttReader r ( body );
+        if ( r.string () != "MQTT" )
+        {
+            return false;
+        }
+        pkt.version = r.byte ();
+        auto flags = r.byte ();
+        pkt.cleanStart = flags & 0x02;
+        pkt.keepAlive = r.u16 ();
+        if ( pkt.version != 5 )
+        {
+            return r.good ();
+        }
+        if ( !decodeProperties ( r, pkt.props ) )
+        {
+            return false;
+        }
+        pkt.clientId = r.string ();
+        if ( flags & 0x04 )
+        {
+            // will properties, topic and payload
+            mqttProperties willProps;
+            if ( !decodeProperties ( r, willProps ) )
+            {
+                return false;
+            }
+            r.string ();
+            r.string ();
+        }
+        if ( flags & 0x80 )
+        {
+            r.string ();
+        }
+        if ( flags & 0x40 )
+        {
+            r.string ();
+        }
+        return r.good () && !r.remaining ();
+    }
+
+    // calls func ( filter, options ) for each topic filter of a SUBSCRIBE.   Returns false if the packet is malformed
+    template< typename F >
+    bool decodeSubscribe ( std::string_view body, uint16_t &packetId, mqttProperties &props, F &&func )
+    {
+        mqttReader r ( body );
+        packetId = r.u16 ();
+        if ( !decodeProperties ( r, props ) )
+        {
+            return false;
+        }
+        while ( r.good () && r.remaining () )
+        {
+            auto filter = r.string ();
+            auto options = r.byte ();
+            if ( r.good () )
+            {
+                func ( filter, options );
+            }
+        }
+        return r.good ();
+    }
+
+    // calls func ( filter ) for each topic filter of an UNSUBSCRIBE.   Returns false if the packet is malformed
+    template< typename F >
+    bool decodeUnsubscribe ( std::string_view body, uint16_t &packetId, mqttProperties &props, F &&func )
+    {
+        mqttReader r ( body );
+        packetId = r.u16 ();
+        if ( !decodeProperties ( r, props ) )
+        {
+            return false;
+        }
+        while ( r.good () && r.remaining () )
+        {
+            auto filter = r.string ();
+            if ( r.good () )
+            {
+                func ( filter );
+            }
+        }
+        return r.good ();
+    }
+
+    inline bool decodeConnack ( std::string_view body, mqttConnack &pkt )
+    {
+        mqttReader r ( body );
+        pkt.sessionPresent = r.byte () & 1;
+        pkt.reasonCode = r.byte ();
+        if ( r.remaining () )
+        {
+            if ( !decodeProperties ( r, pkt.props ) )
+            {
+                return false;
+            }
+        }
+        return r.good ();
+    }
+
+    inline bool decodePublish ( uint8_t flags, std::string_view body, mqttPublish &pkt )
+    {
+        mqttReader r ( body );
+        pkt.dup = flags & 0x08;
+        pkt.qos = (flags >> 1) & 0x03;
+        pkt.retain = flags & 0x01;
+        pkt.topic = r.string ();
+        if ( pkt.qos )
+        {
+            pkt.packetId = r.u16 ();
+        }
+        if ( !decodeProperties ( r, pkt.props ) )
+        {
+            return false;
+        }
+        pkt.payload = r.rest ();
+        return r.good () && pkt.qos < 3;
+    }
+
+    // puback, pubrec, pubrel, pubcomp: packet id then optional reason code and properties
+    inline bool decodeAck ( std::string_view body, mqttAck &pkt )
+    {
+        mqttReader r ( body );
+        pkt.packetId = r.u16 ();
+        if ( r.remaining () )
+        {
+            pkt.reasonCode = r.byte ();
+        }
+        if ( r.remaining () )
+        {
+            if ( !decodeProperties ( r, pkt.props ) )
+            {
+                return false;
+            }
+        }
+        return r.good ();
+    }
+
+    // suback and unsuback: packet id, properties, then a reason code per topic filter.   reasonCode is set to the first failing code
+    inline bool decodeSubAck ( std::string_view body, mqttAck &pkt )
+    {
+        mqttReader r ( body );
+        pkt.packetId = r.u16 ();
+        if ( !decodeProperties ( r, pkt.props ) )
+        {
+            return false;
+        }
+        pkt.reasonCodes = r.rest ();
+        for ( auto code : pkt.reasonCodes )
+        {
+            // for suback codes 0-2 are the granted qos, anything 0x80 and above is a failure
+            if ( (uint8_t) code >= 0x80 )
+            {
+                pkt.reasonCode = (uint8_t) code;
+                break;
+            }
+        }
+        return r.good ();
+    }
+
+    inline bool decodeDisconnect ( std::string_view body, mqttAck &pkt )
+    {
+        mqttReader r ( body );
+        if ( r.remaining () )
+        {
+            pkt.reasonCode = r.byte ();
+        }
+        if ( r.remaining () )
+        {
+            if ( !decodeProperties ( r, pkt.props ) )
+            {
+                return false;
+            }
+        }
+        return r.good ();
+    }
+
+    // appends MQTT encoded values to a string
+    class mqttWriter
+    {
+        std::string &out;
+
+    public:
+        explicit mqttWriter ( std::string &out ) : out ( out )
+        {
+        }
+
+        void byte ( uint8_t v )
+        {
+            out.push_back ( (char) v );
+        }
+
+        void u16 ( uint16_t v )
+        {
+            out.push_back ( (char) (v >> 8) );
+            out.push_back ( (char) (v & 0xFF) );
+        }
+
+        void u32 ( uint32_t v )
+        {
+            u16 ( (uint16_t) (v >> 16) );
+            u16 ( (uint16_t) (v & 0xFFFF) );
+        }
+
+        void varint ( uint32_t v )
+        {
+            do
+            {
+                auto b = (uint8_t) (v & 0x7F);
+                v >>= 7;
+                byte ( v ? (uint8_t) (b | 0x80) : b );
+            } while ( v );
+        }
+
+        void string ( std::string_view v )
+        {
+            u16 ( (uint16_t) v.size () );
+            out.append ( v );
+        }
+
+        void bytes ( std::string_view v )
+        {
+            out.append ( v );
+        }
+
+        static size_t varintLength ( uint32_t v )
+        {
+            return v < 128 ? 1 : v < 16384 ? 2 : v < 2097152 ? 3 : 4;
+        }
+    };
+
+    // property block builder.   Properties are written to a scratch string, then the block is emitted with its length prefix
+    class mqttPropertyWriter
+    {
+        std::string block;
+        mqttWriter w{ block };
+
+    public:
+        mqttPropertyWriter &byte ( mqttProperty id, uint8_t v )
+        {
+            w.varint ( (uint32_t) id );
+            w.byte ( v );
+            return *this;
+        }
+
+        mqttPropertyWriter &u16 ( mqttProperty id, uint16_t v )
+        {
+            w.varint ( (uint32_t) id );
+            w.u16 ( v );
+            return *this;
+        }
+
+        mqttPropertyWriter &u32 ( mqttProperty id, uint32_t v )
+        {
+            w.varint ( (uint32_t) id );
+            w.u32 ( v );
+            return *this;
+        }
+
+        mqttPropertyWriter &string ( mqttProperty id, std::string_view v )
+        {
+            w.varint ( (uint32_t) id );
+            w.string ( v );
+            return *this;
+        }
+
+        // append properties that are already encoded, the contents of another packet's property block
+        mqttPropertyWriter &raw ( std::string_view properties )
+        {
+            w.bytes ( properties );
+            return *this;
+        }
+
+        mqttPropertyWriter &userProperty ( std::string_view name, std::string_view value )
+        {
+            w.varint ( (uint32_t) mqttProperty::userProperty );
+            w.string ( name );
+            w.string ( value );
+            return *this;
+        }
+
+        size_t encodedLength () const
+        {
+            return mqttWriter::varintLength ( (uint32_t) block.size () ) + block.size ();
+        }
+
+        void write ( mqttWriter &out ) const
+        {
+            out.varint ( (uint32_t) block.size () );
+            out.bytes ( block );
+        }
+
+        void clear ()
+        {
+            block.clear ();
+        }
+    };
+
+    // outbound topic aliases for one connection.   An alias replaces the topic of a publish once the broker has seen it sent alongside the
+    // topic, saving the topic's bytes on every later publish.   Telemetry repeats the same long topics every tick, and requesters typically
+    // use one response topic for all their requests, so most of the adapter's publishes can go out without a topic.
+    // aliases are assigned to a topic the second time it is published, so that one-off topics don't use up the broker's limited number of
+    // aliases.   Once every alias is in use, further topics are sent in full
+    class mqttTopicAliases
+    {
+        uint16_t maximum = 0;
+        std::map<std::string, uint16_t, std::less<>> aliases;
+        std::set<std::string, std::less<>> seenOnce;
+        constexpr static size_t maxSeenOnce = 1024;
+
+    public:
+        // counters may be read while another thread publishes
+        std::atomic<uint64_t> assigned = 0;
+        std::atomic<uint64_t> hits = 0;
+        std::atomic<uint64_t> bytesSaved = 0;
+
+        // forget every alias, they only last for the connection.   maximumAliases is the broker's topic alias maximum from the CONNACK
+        void reset ( uint16_t maximumAliases )
+        {
+            maximum = maximumAliases;
+            aliases.clear ();
+            seenOnce.clear ();
+            assigned = 0;
+        }
+
+        struct result
+        {
+            uint16_t alias = 0;         // 0 if no alias is to be sent
+            bool sendTopic = true;      // false once the broker knows the alias, the publish carries an empty topic
+        };
+
+        result lookup ( std::string_view topic )
+        {
+            if ( !maximum )
+            {
+                return {};
+            }
+            if ( auto it = aliases.find ( topic ); it != aliases.end () )
+            {
+                hits++;
+                bytesSaved += topic.size ();
+                return {it->second, false};
+            }
+            if ( aliases.size () >= maximum )
+            {
+                return {};
+            }
+            if ( auto it = seenOnce.find ( topic ); it == seenOnce.end () )
+            {
+                if ( seenOnce.size () >= maxSeenOnce )
+                {
+                    seenOnce.clear ();
+                }
+                seenOnce.emplace ( topic );
+                return {};
+            } else
+            {
+                seenOnce.erase ( it );
+            }
+            // establish the alias, this publish carries both
+            auto alias = (uint16_t) (aliases.size () + 1);
+            aliases.emplace ( std::string ( topic ), alias );
+            assigned++;
+            return {alias, true};
+        }
+    };
+
+    // does topic match a subscription filter.   + matches exactly one level, a trailing # matches any number of levels (including none, so
+    // "a/#" matches "a").   Per the spec, wildcards at the start of a filter don't match topics starting with $
+    inline bool mqttTopicMatches ( std::string_view filter, std::string_view topic )
+    {
+        if ( !topic.empty () && topic.front () == '$' && !filter.empty () && (filter.front () == '+' || filter.front () == '#') )
+        {
+            return false;
+        }
+        for ( ;; )
+        {
+            auto filterEnd = filter.find ( '/' );
+            auto level = filter.substr ( 0, filterEnd );
+            if ( level == "#" )
+            {
+                return true;
+            }
+            auto topicEnd = topic.find ( '/' );
+            if ( level != "+" && level != topic.substr ( 0, topicEnd ) )
+            {
+                return false;
+            }
+            if ( filterEnd == std::string_view::npos || topicEnd == std::string_view::npos )
+            {
+                // both must end here, unless the filter continues with a final /#
+                return (filterEnd == std::string_view::npos && topicEnd == std::string_view::npos) || (topicEnd == std::string_view::npos && filter.substr ( filterEnd ) == "/#");
+            }
+            filter.remove_prefix ( filterEnd + 1 );
+            topic.remove_prefix ( topicEnd + 1 );
+        }
+    }
+
+    // a set of topic filters, for matching topics against a subscription list.   Filters without wildcards are found with a hash lookup,
+    // only the wildcard filters are matched one by one
+    class mqttTopicFilterSet
+    {
+        struct topicHash
+        {
+            using is_transparent = void;
+
+            size_t operator() ( std::string_view topic ) const
+            {
+                return std::hash<std::string_view>{} ( topic );
+            }
+        };
+
+        std::unordered_set<std::string, topicHash, std::equal_to<>> exact;
+        std::vector<std::string> wildcards;
+
+    public:
+        void insert ( std::string_view filter )
+        {
+            if ( filter.find_first_of ( "+#" ) == std::string_view::npos )
+            {
+                exact.emplace ( filter );
+            } else
+            {
+                wildcards.emplace_back ( filter );
+            }
+        }
+
+        template< typename IT >
+        void assign ( IT first, IT last )
+        {
+            exact.clear ();
+            wildcards.clear ();
+            for ( ; first != last; first++ )
+            {
+                insert ( *first );
+            }
+        }
+
+        bool matches ( std::string_view topic ) const
+        {
+            if ( exact.contains ( topic ) )
+            {
+                return true;
+            }
+            return std::any_of ( wildcards.begin (), wildcards.end (), [topic] ( auto const &filter ) { return mqttTopicMatches ( filter, topic ); } );
+        }
+    };
+
+    // writes the fixed header of a packet whose variable header and payload total remainingLength bytes
+    inline void encodeFixedHeader ( std::string &out, mqttPacketType type, uint8_t flags, size_t remainingLength )
+    {
+        mqttWriter w ( out );
+        w.byte ( (uint8_t) (((uint8_t) type << 4) | (flags & 0x0F)) );
+        w.varint ( (uint32_t) remainingLength );
+    }
+
+    inline void encodeConnect ( std::string &out, std::string_view clientId, uint16_t keepAlive, bool cleanStart, mqttPropertyWriter const &props, std::string_view userName = {}, std::string_view password = {} )
+    {
+        std::string body;
+        mqttWriter w ( body );
+        w.string ( "MQTT" );
+        w.byte ( 5 );
+        w.byte ( (uint8_t) ((cleanStart ? 0x02 : 0) | (userName.empty () ? 0 : 0x80) | (password.empty () ? 0 : 0x40)) );
+        w.u16 ( keepAlive );
+        props.write ( w );
+        w.string ( clientId );
+        if ( !userName.empty () )
+        {
+            w.string ( userName );
+        }
+        if ( !password.empty () )
+        {
+            w.string ( password );
+        }
+        encodeFixedHeader ( out, mqttPacketType::connect, 0, body.size () );
+        out.append ( body );
+    }
+
+    inline void encodeConnack ( std::string &out, bool sessionPresent, uint8_t reasonCode, mqttPropertyWriter const &props )
+    {
+        encodeFixedHeader ( out, mqttPacketType::connack, 0, 2 + props.encodedLength () );
+        mqttWriter w ( out );
+        w.byte ( sessionPresent ? 1 : 0 );
+        w.byte ( reasonCode );
+        props.write ( w );
+    }
+
+    // suback or unsuback, with one reason code per topic filter of the request
+    inline void encodeSubAck ( std::string &out, mqttPacketType type, uint16_t packetId, std::string_view reasonCodes )
+    {
+        encodeFixedHeader ( out, type, 0, 2 + 1 + reasonCodes.size () );
+        mqttWriter w ( out );
+        w.u16 ( packetId );
+        w.varint ( 0 );
+        w.bytes ( reasonCodes );
+    }
+
+    // encodes everything up to the payload.   The caller sends payloadLength bytes of payload immediately after.
+    // topic may be empty if a topic alias is being used
+    inline void encodePublishHeader ( std::string &out, std::string_view topic, uint8_t qos, bool retain, uint16_t packetId, mqttPropertyWriter const &props, size_t payloadLength )
+    {
+        auto remaining = 2 + topic.size () + (qos ? 2 : 0) + props.encodedLength () + payloadLength;
+        encodeFixedHeader ( out, mqttPacketType::publish, (uint8_t) ((qos << 1) | (retain ? 1 : 0)), remaining );
+        mqttWriter w ( out );
+        w.string ( topic );
+        if ( qos )
+        {
+            w.u16 ( packetId );
+        }
+        props.write ( w );
+    }
+
+    // puback (and pubrec/pubrel/pubcomp).   A success with no properties uses the short form
+    inline void encodeAck ( std::string &out, mqttPacketType type, uint16_t packetId, uint8_t reasonCode = 0 )
+    {
+        encodeFixedHeader ( out, type, type == mqttPacketType::pubrel ? 0x02 : 0, reasonCode ? 3 : 2 );
+        mqttWriter w ( out );
+        w.u16 ( packetId );
+        if ( reasonCode )
+        {
+            w.byte ( reasonCode );
+        }
+    }
+
+    // subscription options: bits 0-1 maximum qos, bit 2 no local, bit 3 retain as published, bits 4-5 retain handling
+    // the topic filters are [first, last)
+    template< typename IT >
+    void encodeSubscribe ( std::string &out, uint16_t packetId, IT first, IT last, uint8_t options )
+    {
+        std::string body;
+        mqttWriter w ( body );
+        w.u16 ( packetId );
+        w.varint ( 0 );
+        for ( ; first != last; first++ )
+        {
+            w.string ( *first );
+            w.byte ( options );
+        }
+        encodeFixedHeader ( out, mqttPacketType::subscribe, 0x02, body.size () );
+        out.append ( body );
+    }
+
+    inline void encodeSubscribe ( std::string &out, uint16_t packetId, std::vector<std::string> const &filters, uint8_t options )
+    {
+        encodeSubscribe ( out, packetId, filters.begin (), filters.end (), options );
+    }
+
+    template< typename IT >
+    void encodeUnsubscribe ( std::string &out, uint16_t packetId, IT first, IT last )
+    {
+        std::string body;
+        mqttWriter w ( body );
+        w.u16 ( packetId );
+        w.varint ( 0 );
+        for ( ; first != last; first++ )
+        {
+            w.string ( *first );
+        }
+        encodeFixedHeader ( out, mqttPacketType::unsubscribe, 0x02, body.size () );
+        out.append ( body );
+    }
+
+    inline void encodeUnsubscribe ( std::string &out, uint16_t packetId, std::vector<std::string> const &filters )
+    {
+        encodeUnsubscribe ( out, packetId, filters.begin (), filters.end () );
+    }
+
+    inline void encodePing ( std::string &out, mqttPacketType type = mqttPacketType::pingreq )
+    {
+        encodeFixedHeader ( out, type, 0, 0 );
+    }
+
+    inline void encodeDisconnect ( std::string &out, uint8_t reasonCode = 0 )
+    {
+        encodeFixedHeader ( out, mqttPacketType::disconnect, 0, reasonCode ? 1 : 0 );
+        if ( reasonCode )
+        {
+            out.push_back ( (char) reasonCode );
+        }
+    }
+}
@@ -17,12 +17,17 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <exception>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <atomic>
+#include <random>
 
-#include "dabBridge.h"
+#include "dabMqttCodec.h"
+#include "dabMqttInterfaceBase.h"
 #include "MQTTClient.h"
 #include "MQTTExportDeclarations.h"
 #include "MQTTProperties.h"
@@ -34,183 +39,610 @@
 // thi is the main mqtt interface.   We utilize the paho-mqtt library for mqtt support.
 // the template takes a dabBridge object as a parameter which is inferred from the first parameter of the constructor.
 // the constructor takes the dabBridge and the ipAddress of the mqtt bridge.
+// the connection uses MQTT 5, the response topic, correlation data and user properties the adapter relies on are MQTT 5 properties.
 
 namespace DAB
 {
+    // TLS settings for the broker connection.   Files are PEM.   Empty strings leave paho's (and so OpenSSL's) defaults in place
+    struct dabTlsOptions
+    {
+        std::string caFile;                 // certificates to verify the broker against
+        std::string caPath;                 // directory of certificates to verify the broker against
+        std::string certFile;               // our certificate chain, for brokers that authenticate clients
+        std::string keyFile;                // our private key, if it isn't in certFile
+        std::string keyPassword;
+        std::string cipherSuites;
+        bool verifyServer = true;           // check the broker's certificate and that it is for the host we connected to
+    };
+
     template< typename BRIDGE >
-    class dabMQTTInterface
+    class dabMQTTInterface : public dabMQTTInterfaceBase<dabMQTTInterface<BRIDGE>, BRIDGE>
     {
+        using base = dabMQTTInterfaceBase<dabMQTTInterface<BRIDGE>, BRIDGE>;
+        friend base;
+
+        using typename base::threadingPolicy;
+        using typename base::outboundMessage;
+        using base::bridge;
+        using base::running;
+        using base::runningMutex;
+        using base::stopped;
+        using base::topics;
+
         const std::string CLIENT_ID;
 
         constexpr static auto PERIOD = std::chrono::seconds ( 5 );
 
-        MQTTClient client{};
+        // seconds the broker keeps our session after a connection drops.   Unlike MQTT 3.1.1, an MQTT 5 session ends with its connection
+        // unless it is given an expiry interval
+        constexpr static uint32_t SESSION_EXPIRY = 300;
 
-        BRIDGE &bridge;
+        // a broker connection.   Devices are sharded across the connections, each is subscribed only to the topics of the devices assigned
+        // to it and those devices' responses and telemetry are published on it by its own publisher lane
+        struct connection
+        {
+            dabMQTTInterface *owner = nullptr;
+            MQTTClient client{};
+            std::string clientId;
+
+            // reused for every publish, only touched by the connection's publisher
+            MQTTClient_message clientMessage = MQTTClient_message_initializer;
 
-        std::condition_variable running;
-        std::mutex runningMutex;
+            std::vector<std::string> topics;
+
+            // reconnection state.   While a connection is down its lane stops publishing, responses and telemetry wait in the lane's
+            // fair queue (where telemetry is bounded) and go out once the connection is back
+            typename threadingPolicy::template atomic<bool> up = false;
+            typename threadingPolicy::template atomic<uint64_t> reconnects = 0;
+            size_t attempt = 0;
+            std::chrono::time_point<std::chrono::steady_clock> nextAttempt;
+
+            // connection setup time of the first connection and of the latest one, in microseconds.   This is the whole of MQTTClient_connect:
+            // the tcp connect, any tls handshake and the CONNECT/CONNACK round trip.   paho doesn't say whether a tls session was resumed, a
+            // faster reconnect is the only sign of it
+            typename threadingPolicy::template atomic<int64_t> initialConnectUs = -1;
+            typename threadingPolicy::template atomic<int64_t> lastConnectUs = -1;
+            typename threadingPolicy::template atomic<uint64_t> connectFailures = 0;
+
+            // topic aliases for the connection's publishes, only touched by its publisher.   Aliases last only as long as a connection,
+            // each connect publishes the broker's maximum and bumps the generation, and the publisher starts over when it sees a new one
+            mqttTopicAliases topicAliases;
+            typename threadingPolicy::template atomic<uint16_t> topicAliasMaximum = 0;
+            typename threadingPolicy::template atomic<uint64_t> aliasGeneration = 0;
+            uint64_t aliasGenerationSeen = 0;
+        };
+
+        std::vector<connection> connections;
+        std::string brokerAddress;
+
+        // set by setTls().   sslOptions points into tls
+        bool useTls = false;
+        dabTlsOptions tls;
+        MQTTClient_SSLOptions sslOptions = MQTTClient_SSLOptions_initializer;
+
+        // reconnect backoff: attempt n waits a random time up to min ( maxBackoff, minBackoff * 2^n ).   The jitter stops a fleet of adapters
+        // reconnecting to a restarted broker in lock step
+        std::chrono::milliseconds minBackoff{ 50 };
+        std::chrono::milliseconds maxBackoff{ 30000 };
+        std::minstd_rand jitter{ std::random_device{} () };
+
+        // upper bound on the topic aliases used per connection, see setTopicAliasLimit()
+        uint16_t topicAliasLimit = UINT16_MAX;
+
+        // guards the reconnection state of the connections
+        typename threadingPolicy::mutex reconnectMutex;
+        typename threadingPolicy::condition_variable reconnectCondition;
+        typename threadingPolicy::template atomic<bool> closing = false;
+        std::thread reconnectThread;
+
+        // lanes of connections that are down don't publish until they are reconnected, unless we're closing and there is no point waiting
+        size_t sendWindow ( size_t lane )
+        {
+            return closing || connections[lane].up ? SIZE_MAX : 0;
+        }
 
-        static std::string getResponseTopic ( MQTTClient_message *message )
+        // publish a single message on the connection owning its device.   Called by that connection's publisher
+        bool send ( outboundMessage &msg )
         {
-            if ( MQTTProperties_hasProperty ( &message->properties, MQTTPROPERTY_CODE_RESPONSE_TOPIC ) )
+            auto &conn = connections[msg.lane];
+            conn.clientMessage.payload = msg.payload.data ();
+            conn.clientMessage.payloadlen = (int) msg.payload.size ();
+            conn.clientMessage.qos = 0;
+            conn.clientMessage.retained = 0;
+
+            if ( auto generation = conn.aliasGeneration.load (); generation != conn.aliasGenerationSeen )
             {
-                auto *property = MQTTProperties_getProperty ( &message->properties, MQTTPROPERTY_CODE_RESPONSE_TOPIC );
+                conn.topicAliases.reset ( conn.topicAliasMaximum );
+                conn.aliasGenerationSeen = generation;
+            }
+            auto [alias, sendTopic] = conn.topicAliases.lookup ( msg.topic );
+            if ( alias )
+            {
+                MQTTProperty alias_prop;
+                alias_prop.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+                alias_prop.value.integer2 = alias;
 
-                auto res = std::string ( property->value.data.data, property->value.data.len );
-                return res;
+                MQTTProperties_add ( &conn.clientMessage.properties, &alias_prop );
+            }
+            if ( !msg.correlationData.empty () )
+            {
+                MQTTProperty corr_data_resp_prop;
+                corr_data_resp_prop.identifier = MQTTPROPERTY_CODE_CORRELATION_DATA;
+                corr_data_resp_prop.value.data.data = msg.correlationData.data ();
+                corr_data_resp_prop.value.data.len = (int) msg.correlationData.size ();
+
+                MQTTProperties_add ( &conn.clientMessage.properties, &corr_data_resp_prop );
+            }
+            if ( msg.deflated )
+            {
+                MQTTProperty encoding_prop;
+                encoding_prop.identifier = MQTTPROPERTY_CODE_USER_PROPERTY;
+                encoding_prop.value.data.data = const_cast<char *> ( contentEncodingProperty.data () );
+                encoding_prop.value.data.len = (int) contentEncodingProperty.size ();
+                encoding_prop.value.value.data = const_cast<char *> ( deflateEncoding.data () );
+                encoding_prop.value.value.len = (int) deflateEncoding.size ();
+
+                MQTTProperties_add ( &conn.clientMessage.properties, &encoding_prop );
             }
-            return "";
+
+            // once the broker knows the alias the topic is left empty
+            auto response = MQTTClient_publishMessage5 ( conn.client, sendTopic ? msg.topic.c_str () : "", &conn.clientMessage, nullptr );
+            MQTTProperties_free ( &conn.clientMessage.properties );
+            auto rc = (int) response.reasonCode;
+            MQTTResponse_free ( response );
+            return rc == MQTTCLIENT_SUCCESS;
         }
 
-        static bool hasCorrelationData ( MQTTClient_message *message )
+        // returns the value of a binary or string property of a paho message, or an empty view if it isn't present
+        static std::string_view getProperty ( MQTTProperties *properties, MQTTPropertyCodes code )
         {
-            return  MQTTProperties_hasProperty ( &message->properties, MQTTPROPERTY_CODE_CORRELATION_DATA );
+            if ( MQTTProperties_hasProperty ( properties, code ) )
+            {
+                auto *property = MQTTProperties_getProperty ( properties, code );
+                return {property->value.data.data, (size_t) property->value.data.len};
+            }
+            return {};
         }
 
-        static auto *getCorrelationData ( MQTTClient_message *message )
+        // returns the value of the user property named name, or an empty view if the message doesn't have one
+        static std::string_view getUserProperty ( MQTTProperties *properties, std::string_view name )
         {
-            return MQTTProperties_getProperty ( &message->properties, MQTTPROPERTY_CODE_CORRELATION_DATA );
+            for ( int i = 0; i < properties->count; i++ )
+            {
+                auto const &property = properties->array[i];
+                if ( property.identifier == MQTTPROPERTY_CODE_USER_PROPERTY && std::string_view ( property.value.data.data, (size_t) property.value.data.len ) == name )
+                {
+                    return {property.value.value.data, (size_t) property.value.value.len};
+                }
+            }
+            return {};
         }
 
         // this is the message arrived callback.   paho-mqtt uses a void parameter (thin wrapper around a C library).
         // it would have been nice if it was a template that took the calling object as a parameter so that we could maintain type safety.
         // the method takes the context and reinterprets it to the dabMQTTInterface object.
+        // we only decode the request here.   Execution is handed off to the scheduler so that the mqtt callback thread is never blocked by
+        // a long-running handler and so that requests are executed in priority order
         static int messageArrived ( void *context, char *topic, int, MQTTClient_message *message )
         {
-            auto *mqttInterface = reinterpret_cast<dabMQTTInterface *>(context);
+            auto *mqttInterface = reinterpret_cast<connection *>(context)->owner;
+
+            mqttInterface->handleRequest ( topic, {(char const *) message->payload, (size_t) message->payloadlen}, getProperty ( &message->properties, MQTTPROPERTY_CODE_RESPONSE_TOPIC ), getProperty ( &message->properties, MQTTPROPERTY_CODE_CORRELATION_DATA ), getUserProperty ( &message->properties, acceptEncodingProperty ) );
+
+            MQTTClient_freeMessage ( &message );
+            MQTTClient_free ( topic );
+            return 1;
+        }
 
-            auto &bridge = mqttInterface->bridge;
-            try
+        // paho calls this on its own thread when a connection drops.   Rather than ending wait() we hand the connection to the reconnect
+        // thread, the bridge (and any telemetry it's running) carries on untouched
+        static void connectionLost ( void *context, char * )
+        {
+            auto *conn = reinterpret_cast<connection *>(context);
+            auto *mqttInterface = conn->owner;
             {
-                std::string reqStr ((char const *) message->payload, message->payloadlen );
-                jsonElement req = jsonParser ( reqStr.c_str ());
+                std::lock_guard l1 ( mqttInterface->reconnectMutex );
+                conn->up = false;
+                conn->attempt = 0;
+                conn->nextAttempt = std::chrono::steady_clock::now () + mqttInterface->backoff ( 0 );
+            }
+            mqttInterface->reconnectCondition.notify_all ();
+        }
 
-                // the dispatcher requires the topic to be part of the DAB request.  Add it in.
-                req["topic"] = topic;
-                // we put the payload in its own "payload" value in the json object
-                req["payload"] = jsonParser ( reqStr.c_str ());
-                // this leaves us the capability of adding other properties into the top level
-                // that might be needed by a potential handler. for instance topic is currently sent
-                // but a handler might want responseTopic for logging purposes or correlation data
-                // we currently don't send those, but you can do so by commenting out the below lines
-                // req["responseTopic"] = getResponseTopic ( message );
-                // req["correlationData"] = hasCorrelationData ( message ) ? getCorrelationData ( message ) : "";
-                // dispatch to the bridge and start get the response
-                jsonElement rsp = bridge.dispatch ( req );
+        // a random delay for the given attempt.   Called with reconnectMutex held
+        std::chrono::milliseconds backoff ( size_t attempt )
+        {
+            auto limit = minBackoff * (int64_t) (1ull << std::min ( attempt, (size_t) 20 ));
+            limit = std::min ( limit, maxBackoff );
+            return std::chrono::milliseconds ( std::uniform_int_distribution<int64_t> ( 0, limit.count () ) ( jitter ) );
+        }
 
-                MQTTClient_message clientMessage = MQTTClient_message_initializer;
+        MQTTClient_connectOptions connectOptions ()
+        {
+            MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer5;
 
-                std::string payload;
+            conn_opts.keepAliveInterval = 20;
+            // keep our session on the broker (see SESSION_EXPIRY), after a reconnect our subscriptions are already in place and we needn't resubscribe.
+            // with tls this also has paho keep the tls session of the first connection and offer it on every reconnect, so reconnects
+            // can make an abbreviated handshake if the broker accepts the session
+            conn_opts.cleanstart = 0;
+            if ( useTls )
+            {
+                conn_opts.ssl = &sslOptions;
+            }
+            return conn_opts;
+        }
 
-                // serialize the json response (convert from our internal jsonElement to a string)
-                rsp.serialize ( payload, true );
-                clientMessage.payload = const_cast<char *>(payload.c_str ());
-                clientMessage.payloadlen = (int) payload.size ();
-                clientMessage.qos = 0;
-                clientMessage.retained = 0;
+        // connect a client, timing the connection setup
+        int connectClient ( connection &conn, MQTTClient_connectOptions &conn_opts )
+        {
+            MQTTProperties props = MQTTProperties_initializer;
+            MQTTProperty expiry;
+            expiry.identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+            expiry.value.integer4 = SESSION_EXPIRY;
+            MQTTProperties_add ( &props, &expiry );
+
+            auto start = std::chrono::steady_clock::now ();
+            auto response = MQTTClient_connect5 ( conn.client, &conn_opts, &props, nullptr );
+            MQTTProperties_free ( &props );
+            auto rc = (int) response.reasonCode;
+            uint16_t aliasMaximum = 0;
+            if ( rc == MQTTCLIENT_SUCCESS && response.properties && MQTTProperties_hasProperty ( response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM ) )
+            {
+                aliasMaximum = (uint16_t) MQTTProperties_getNumericValue ( response.properties, MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM );
+            }
+            MQTTResponse_free ( response );
+            if ( rc != MQTTCLIENT_SUCCESS )
+            {
+                conn.connectFailures++;
+                return rc;
+            }
+            // the broker's topic alias maximum from the CONNACK, 0 (the default) if it doesn't accept aliases
+            conn.topicAliasMaximum = std::min ( aliasMaximum, topicAliasLimit );
+            conn.aliasGeneration++;
+            auto us = std::chrono::duration_cast<std::chrono::microseconds> ( std::chrono::steady_clock::now () - start ).count ();
+            if ( conn.initialConnectUs < 0 )
+            {
+                conn.initialConnectUs = us;
+            }
+            conn.lastConnectUs = us;
+            return rc;
+        }
 
-                if ( hasCorrelationData ( message ) )
+        // subscribe to all of a connection's topics, a chunk of topics per request.   Returns the first failure, and the number of requests made
+        int subscribeAll ( connection &conn, size_t *requests = nullptr )
+        {
+            int rc = MQTTCLIENT_SUCCESS;
+            std::vector<char *> topicPtrs;
+            std::vector<int> qos;
+            auto chunks = this->forEachSubscribeChunk ( conn.topics, [&] ( auto first, auto last )
+            {
+                if ( rc != MQTTCLIENT_SUCCESS )
                 {
-                    auto corr_data_req_prop = getCorrelationData ( message );
-                    MQTTProperty corr_data_resp_prop;
-                    corr_data_resp_prop.identifier = MQTTPROPERTY_CODE_CORRELATION_DATA;
-                    corr_data_resp_prop.value.data.data = corr_data_req_prop->value.data.data;
-                    corr_data_resp_prop.value.data.len = corr_data_req_prop->value.data.len;
-
-                    int rc = MQTTProperties_add(&clientMessage.properties, &corr_data_resp_prop);
+                    return;
                 }
-
-                // get the mutex to serialize calls to the mqtt library
-                std::lock_guard l1 ( mqttInterface->runningMutex );
-                if ( auto rc = MQTTClient_publishMessage ( mqttInterface->client, getResponseTopic ( message ).c_str (), &clientMessage, nullptr ))
+                topicPtrs.clear ();
+                for ( auto it = first; it != last; it++ )
                 {
-                    throw DAB::dabException ( rc, "error publishing message" );
+                    topicPtrs.push_back ( it->data () );
                 }
-            } catch ( DAB::dabException &e )
-            {
-                std::cout << "error (" << e.errorCode << "): " << e.errorText << std::endl;
-            } catch ( ... )
+                qos.assign ( topicPtrs.size (), 1 );
+                auto response = MQTTClient_subscribeMany5 ( conn.client, (int) topicPtrs.size (), topicPtrs.data (), qos.data (), nullptr, nullptr );
+                // paho's result, or with a single topic the broker's reason code for it.   With several topics each has its own reason code
+                rc = (int) response.reasonCode;
+                for ( int loop = 0; rc >= 0 && loop < response.reasonCodeCount; loop++ )
+                {
+                    rc = std::max ( rc, (int) response.reasonCodes[loop] );
+                }
+                // reason codes below 0x80 are the qos the broker granted
+                if ( rc >= 0 && rc < MQTTREASONCODE_UNSPECIFIED_ERROR )
+                {
+                    rc = MQTTCLIENT_SUCCESS;
+                }
+                MQTTResponse_free ( response );
+            } );
+            if ( requests )
             {
+                *requests += chunks;
             }
-            return 1;
+            return rc;
         }
 
-        // this is the publishing call-back that we pass to the bridge object (and subsequently to the dabClient).  It's used for notifications where we send telemetry responses without a request
-        void publishCB ( jsonElement const &elem )
+        void unsubscribeAll ( connection &conn )
         {
-            MQTTClient_message clientMessage = MQTTClient_message_initializer;
-
-            std::string payload;
-
-            elem["payload"].serialize ( payload, true );
+            std::vector<char *> topicPtrs;
+            this->forEachSubscribeChunk ( conn.topics, [&] ( auto first, auto last )
+            {
+                topicPtrs.clear ();
+                for ( auto it = first; it != last; it++ )
+                {
+                    topicPtrs.push_back ( it->data () );
+                }
+                MQTTResponse_free ( MQTTClient_unsubscribeMany5 ( conn.client, (int) topicPtrs.size (), topicPtrs.data (), nullptr ) );
+            } );
+        }
 
-            clientMessage.payload = const_cast<char *>(payload.c_str ());
-            clientMessage.payloadlen = (int) payload.size ();
-            clientMessage.qos = 0;
-            clientMessage.retained = 0;
+        // a single attempt to reestablish a connection.   If the broker no longer has our session (it was restarted without persistence, or
+        // the session expired) the subscriptions are recreated
+        bool reconnect ( connection &conn )
+        {
+            auto conn_opts = connectOptions ();
+            if ( connectClient ( conn, conn_opts ) != MQTTCLIENT_SUCCESS )
+            {
+                return false;
+            }
+            if ( !conn_opts.returned.sessionPresent && subscribeAll ( conn ) != MQTTCLIENT_SUCCESS )
+            {
+                MQTTClient_disconnect5 ( conn.client, 0, MQTTREASONCODE_NORMAL_DISCONNECTION, nullptr );
+                return false;
+            }
+            conn.reconnects++;
+            conn.up = true;
+            std::cout << "reconnected " << conn.clientId << (conn_opts.returned.sessionPresent ? " (session resumed)" : " (resubscribed)") << std::endl;
+            // anything that queued up while we were disconnected can go now
+            this->wakePublisher ();
+            return true;
+        }
 
-            std::lock_guard l1 ( runningMutex );
-            if ( auto rc = MQTTClient_publishMessage ( client, elem["topic"].operator const std::string & ().c_str (), &clientMessage, nullptr ))
+        // reconnects connections that have dropped, each on its own backoff schedule
+        void reconnectTask ()
+        {
+            std::unique_lock l1 ( reconnectMutex );
+            while ( !closing )
             {
-                throw DAB::dabException ( rc, "error publishing message" );
+                auto next = std::chrono::time_point<std::chrono::steady_clock>::max ();
+                for ( auto &conn : connections )
+                {
+                    if ( !conn.up )
+                    {
+                        next = std::min ( next, conn.nextAttempt );
+                    }
+                }
+                if ( next > std::chrono::steady_clock::now () )
+                {
+                    if ( next == std::chrono::time_point<std::chrono::steady_clock>::max () )
+                    {
+                        reconnectCondition.wait ( l1 );
+                    } else
+                    {
+                        reconnectCondition.wait_until ( l1, next );
+                    }
+                    continue;
+                }
+
+                for ( auto &conn : connections )
+                {
+                    if ( conn.up || conn.nextAttempt > std::chrono::steady_clock::now () )
+                    {
+                        continue;
+                    }
+                    // connecting blocks, don't hold up connectionLost callbacks while it does
+                    l1.unlock ();
+                    auto ok = reconnect ( conn );
+                    l1.lock ();
+                    if ( !ok && !conn.up )
+                    {
+                        conn.attempt++;
+                        conn.nextAttempt = std::chrono::steady_clock::now () + backoff ( conn.attempt );
+                    }
+                    if ( closing )
+                    {
+                        break;
+                    }
+                }
             }
         }
 
-        static void connectionLost ( void *context, char * )
+        // stop reconnecting, from here on lanes of connections that are down throw their messages away rather than waiting
+        void stopReconnecting ()
         {
-            auto *mqttInterface = reinterpret_cast<dabMQTTInterface *>(context);
-            std::lock_guard l1 ( mqttInterface->runningMutex );
-            mqttInterface->running.notify_all ();
+            {
+                std::lock_guard l1 ( reconnectMutex );
+                closing = true;
+            }
+            reconnectCondition.notify_all ();
+            if ( reconnectThread.joinable () )
+            {
+                reconnectThread.join ();
+            }
+            this->wakePublisher ();
         }
 
     public:
 
-        dabMQTTInterface ( BRIDGE &bridge, std::string const &brokerAddress ) : bridge ( bridge )
+        // nConnections is the number of connections to open to the broker.   With more than one, devices are sharded across them and
+        // the connections use client ids "dab-0", "dab-1", ...   A single connection keeps the client id "dab".   See setClientId()
+        dabMQTTInterface ( BRIDGE &bridge, std::string const &brokerAddress, size_t nConnections = 1 ) : base ( bridge, nConnections ), brokerAddress ( brokerAddress )
         {
-            if ( auto rc = MQTTClient_create(&client, brokerAddress.c_str(), "dab", MQTTCLIENT_PERSISTENCE_NONE, nullptr) )
+            if constexpr ( !threadingPolicy::concurrent )
             {
-                throw DAB::dabException ( rc, std::string ( "Failed to create client" ) );
+                if ( nConnections > 1 )
+                {
+                    throw DAB::dabException ( 400, std::string ( "single threaded builds support only one connection" ) );
+                }
             }
 
-            if ( auto rc = MQTTClient_setCallbacks(client, this, connectionLost, messageArrived, nullptr) )
+            connections = std::vector<connection> ( this->lanes.size () );
+            for ( auto &conn : connections )
             {
-                throw DAB::dabException ( rc, std::string ( "Failed to set callbacks" ) );
+                conn.owner = this;
             }
-            bridge.setPublishCallback ( std::function ( [this](jsonElement const &elem){ return publishCB ( elem );} ) );
+            static_assert ( dabOutboundTransport<dabMQTTInterface> );
+            this->startPublisher ();
         }
 
         ~dabMQTTInterface ()
         {
-            MQTTClient_destroy ( &client );
+            stopReconnecting ();
+            this->shutdown ();
+            for ( auto &conn : connections )
+            {
+                if ( conn.client )
+                {
+                    MQTTClient_destroy ( &conn.client );
+                }
+            }
+        }
+
+        // set the range of the delay between reconnection attempts.   The first attempt after a connection drops is made within min, each
+        // failure doubles the delay up to max
+        void setReconnectBackoff ( std::chrono::milliseconds min, std::chrono::milliseconds max )
+        {
+            std::lock_guard l1 ( reconnectMutex );
+            minBackoff = std::max ( min, std::chrono::milliseconds ( 1 ) );
+            maxBackoff = std::max ( max, minBackoff );
+        }
+
+        // connect to the broker over TLS.   The broker address must use the ssl://, mqtts:// or wss:// scheme.   Must be called before connect()
+        void setTls ( dabTlsOptions const &options )
+        {
+            std::string_view address ( brokerAddress );
+            if ( !address.starts_with ( "ssl://" ) && !address.starts_with ( "mqtts://" ) && !address.starts_with ( "wss://" ) )
+            {
+                throw DAB::dabException ( 400, std::string ( "TLS requires an ssl://, mqtts:// or wss:// broker address" ) );
+            }
+            tls = options;
+            auto str = [] ( std::string const &value ) { return value.empty () ? nullptr : value.c_str (); };
+            sslOptions = MQTTClient_SSLOptions_initializer;
+            sslOptions.trustStore = str ( tls.caFile );
+            sslOptions.CApath = str ( tls.caPath );
+            sslOptions.keyStore = str ( tls.certFile );
+            sslOptions.privateKey = str ( tls.keyFile );
+            sslOptions.privateKeyPassword = str ( tls.keyPassword );
+            sslOptions.enabledCipherSuites = str ( tls.cipherSuites );
+            sslOptions.enableServerCertAuth = tls.verifyServer;
+            sslOptions.verify = tls.verifyServer;
+            useTls = true;
+        }
+
+        // limit the number of topic aliases used for publishes on each connection, 0 disables them.   By default as many as the broker allows are used
+        void setTopicAliasLimit ( uint16_t limit )
+        {
+            topicAliasLimit = limit;
+        }
+
+        // return the adapter's request statistics, along with the state of each broker connection
+        jsonElement getStatistics ()
+        {
+            auto stats = base::getStatistics ();
+            for ( auto &conn : connections )
+            {
+                stats["connections"].push_back ( {{"clientId",         conn.clientId},
+                                                   {"connected",        (bool) conn.up},
+                                                   {"tls",              useTls},
+                                                   {"reconnects",       (uint64_t) conn.reconnects},
+                                                   {"connectFailures",  (uint64_t) conn.connectFailures},
+                                                   {"initialConnectUs", (int64_t) conn.initialConnectUs},
+                                                   {"lastConnectUs",    (int64_t) conn.lastConnectUs},
+                                                   {"topicAliases",     {{"assigned",   conn.topicAliases.assigned.load ()},
+                                                                         {"hits",       conn.topicAliases.hits.load ()},
+                                                                         {"bytesSaved", conn.topicAliases.bytesSaved.load ()}}}} );
+            }
+            return stats;
         }
 
         // this is the method to actually establish a connection with the mqtt broker.  At this point any initialization that needs to be done should have finished
+        // once connected, dropped connections are reestablished automatically until disconnect() is called
         auto connect() {
-            MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-
-            conn_opts.keepAliveInterval = 20;
+            auto connectStart = std::chrono::steady_clock::now ();
+            // the clients are created here rather than by the constructor as their ids may be set up to now
+            for ( size_t loop = 0; loop < connections.size (); loop++ )
+            {
+                auto &conn = connections[loop];
+                conn.clientId = this->clientIdOf ( loop );
+                MQTTClient_createOptions createOpts = MQTTClient_createOptions_initializer5;
+                if ( auto rc = MQTTClient_createWithOptions ( &conn.client, brokerAddress.c_str (), conn.clientId.c_str (), MQTTCLIENT_PERSISTENCE_NONE, nullptr, &createOpts ) )
+                {
+                    throw DAB::dabException ( rc, std::string ( "Failed to create client" ) );
+                }
 
-            if ( auto rc = MQTTClient_connect(client, &conn_opts) )
+                // single threaded builds don't set callbacks.   This leaves paho in synchronous mode where messages are pulled by MQTTClient_receive
+                // from wait() rather than being delivered on paho's own thread
+                if constexpr ( threadingPolicy::concurrent )
+                {
+                    if ( auto rc = MQTTClient_setCallbacks(conn.client, &conn, connectionLost, messageArrived, nullptr) )
+                    {
+                        throw DAB::dabException ( rc, std::string ( "Failed to set callbacks" ) );
+                    }
+                }
+            }
+            for ( auto &conn : connections )
             {
-                throw DAB::dabException ( rc, std::string ( "Failed to set connect" ) );
+                auto conn_opts = connectOptions ();
+                if ( auto rc = connectClient ( conn, conn_opts ) )
+                {
+                    throw DAB::dabException ( rc, std::string ( "Failed to set connect" ) );
+                }
             }
 
-            auto topics = bridge.getTopics ();
+            // each connection subscribes to the topics of the devices it owns, requests then arrive on the connection their responses leave on
+            topics.clear ();
+            for ( auto const &topic : this->requestTopics () )
+            {
+                if ( auto filter = this->subscriptionFilter ( topic ); !filter.empty () )
+                {
+                    connections[this->laneOf ( bridge.getDeviceId ( topic ) )].topics.push_back ( filter );
+                    topics.push_back ( std::move ( filter ) );
+                }
+            }
 
-            for ( auto const &topic : topics )
+            // subscribeMany blocks until the broker acknowledges, so each chunk costs one round trip rather than each topic
+            auto subscribeStart = std::chrono::steady_clock::now ();
+            size_t requests = 0;
+            for ( auto &conn : connections )
             {
-                if ( auto rc = MQTTClient_subscribe(client, topic.c_str(), 1) )
+                if ( auto rc = subscribeAll ( conn, &requests ) )
                 {
                     throw DAB::dabException ( rc, std::string ( "Failed to subscribe" ) );
                 }
+                conn.up = true;
+            }
+            this->markReady ( connectStart, subscribeStart, topics.size (), requests );
+            this->wakePublisher ();
+
+            if constexpr ( threadingPolicy::concurrent )
+            {
+                reconnectThread = std::thread ( &dabMQTTInterface::reconnectTask, this );
             }
             return 0;
         }
         // this function should be called when the client wish's to cleanly end the mqtt interface in preparation for exiting.
-        auto disconnect ()
+        // it drains the adapter before disconnecting:
+        //     we unsubscribe so the broker stops sending us requests, any request that still arrives is answered with a 503
+        //     requests that have already been accepted are given until deadline to complete and have their responses published
+        //     telemetry is stopped
+        //     the connection is then closed, giving the client library whatever time remains to flush outstanding messages
+        auto disconnect ( std::chrono::milliseconds deadline = std::chrono::milliseconds ( 10000 ) )
         {
-            if ( auto rc = MQTTClient_disconnect ( client, 10000 ))
+            auto until = std::chrono::steady_clock::now () + deadline;
+
+            // a connection that is down now stays down, we're going anyway
+            stopReconnecting ();
+
+            for ( auto &conn : connections )
+            {
+                if ( conn.up )
+                {
+                    unsubscribeAll ( conn );
+                }
+            }
+
+            this->drain ( until );
+
+            int rc = MQTTCLIENT_SUCCESS;
+            for ( auto &conn : connections )
+            {
+                if ( !conn.up )
+                {
+                    continue;
+                }
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds> ( until - std::chrono::steady_clock::now () );
+                if ( auto connRc = MQTTClient_disconnect5 ( conn.client, (int) std::max ( remaining.count (), (int64_t) 0 ), MQTTREASONCODE_NORMAL_DISCONNECTION, nullptr ) )
+                {
+                    rc = connRc;
+                }
+            }
+            if ( rc )
             {
                 throw DAB::dabException ( rc, std::string ( "Failed to disconnect" ));
             }
@@ -219,12 +651,53 @@ namespace DAB
             return 0;
         }
 
-        // this function will wait until the mqtt interface has been properly shut down, or errors due to connectivity loss.
+        // this function will wait until the mqtt interface has been properly shut down.   Lost connections are reestablished in the background.
+        // in single threaded builds this is the event loop: requests are received and executed inline and telemetry is published as it falls due
         void wait ()
         {
-            std::unique_lock l1 ( runningMutex );
-            running.wait ( l1 );
-            return;
+            if constexpr ( threadingPolicy::concurrent )
+            {
+                std::unique_lock l1 ( runningMutex );
+                running.wait ( l1 );
+            } else
+            {
+                while ( !stopped )
+                {
+                    std::chrono::time_point<std::chrono::steady_clock> next;
+                    try
+                    {
+                        next = bridge.serviceTelemetry ();
+                    } catch ( DAB::dabException &e )
+                    {
+                        std::cout << "error (" << e.errorCode << "): " << e.errorText << std::endl;
+                        next = std::chrono::steady_clock::now () + PERIOD;
+                    }
+
+                    // block for a message only until the next telemetry is due
+                    auto now = std::chrono::steady_clock::now ();
+                    auto timeout = next <= now ? std::chrono::milliseconds ( 0 ) : std::min ( std::chrono::duration_cast<std::chrono::milliseconds> ( next - now ) + std::chrono::milliseconds ( 1 ), std::chrono::duration_cast<std::chrono::milliseconds> ( PERIOD ) );
+
+                    char *topic = nullptr;
+                    int topicLen = 0;
+                    MQTTClient_message *message = nullptr;
+                    auto &conn = connections.front ();
+                    auto rc = MQTTClient_receive ( conn.client, &topic, &topicLen, &message, (unsigned long) timeout.count () );
+                    if ( rc != MQTTCLIENT_SUCCESS && rc != MQTTCLIENT_TOPICNAME_TRUNCATED )
+                    {
+                        // connection lost, reconnect inline.   Nothing else can happen until we're connected again
+                        conn.up = false;
+                        for ( size_t attempt = 0; !stopped && !reconnect ( conn ); attempt++ )
+                        {
+                            std::this_thread::sleep_for ( backoff ( attempt ) );
+                        }
+                        continue;
+                    }
+                    if ( message )
+                    {
+                        messageArrived ( &conn, topic, topicLen, message );
+                    }
+                }
+            }
         }
     };
 };
\ No newline at end of file
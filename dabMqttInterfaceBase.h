@@ -0,0 +1,769 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "dabBridge.h"
+#include "dabCompression.h"
+#include "dabFairQueue.h"
+#include "dabQueue.h"
+#include "dabScheduler.h"
+
+// the parts of the mqtt interface that don't depend on which mqtt client is used: request decoding and scheduling, and the outbound queues
+// and publisher.   It's a CRTP base, DERIVED supplies the client:
+//     bool send ( outboundMessage &msg )       publish msg.   Called from msg.lane's publisher thread only (or the event loop in single threaded
+//                                              builds).   Returns false if the message could not be sent
+//     size_t sendWindow ()                     the number of messages that may be sent right now (optional, unlimited if not implemented)
+//     size_t sendWindow ( size_t lane )        as above, for derived classes whose lanes (connections) open and close independently
+// and hands every request it receives to handleRequest ().   Everything else, decoding, scheduling, dispatch to the bridge, serializing and
+// queueing responses, is shared, so an interface is just the transport that carries requests in and responses out.
+
+namespace DAB
+{
+    // what every interface offers its owner, whatever transport it uses, so that code driving an adapter (a load generator, a test harness)
+    // can be written once for all of them
+    template< typename T >
+    concept dabTransport = requires ( T &t )
+    {
+        t.connect ();
+        t.disconnect ();
+        t.wait ();
+        { t.getStatistics () } -> std::convertible_to<jsonElement>;
+    };
+
+    // an interface built on dabMQTTInterfaceBase: a dabTransport that also supplies the base with send() and, optionally, sendWindow(), and
+    // leaves handleRequest() callable, as described above.   Those members are private to the interface so they're checked by the base, its
+    // friend.   Every interface asserts this of itself
+    template< typename T >
+    concept dabOutboundTransport = dabTransport<T> && T::implementsOutbound ();
+
+    template< typename DERIVED, typename BRIDGE >
+    class dabMQTTInterfaceBase
+    {
+    protected:
+        using threadingPolicy = typename BRIDGE::threadingPolicy;
+
+        BRIDGE &bridge;
+
+        typename threadingPolicy::condition_variable running;
+        typename threadingPolicy::mutex runningMutex;
+
+        // set by stop() or disconnect() to end the single threaded event loop in wait()
+        typename threadingPolicy::template atomic<bool> stopped = false;
+
+        // worker pool that executes requests in priority order
+        dabScheduler<threadingPolicy> scheduler;
+
+        // the topics we've subscribed to, so that we can unsubscribe when draining
+        std::vector<std::string> topics;
+
+        // subscribe and unsubscribe requests are split into chunks of at most this many topic filters (and, where the client knows the
+        // broker's maximum packet size, bytes) rather than making a round trip per topic or a single request the broker might refuse
+        size_t maxSubscribeTopics = 256;
+
+        // startup instrumentation, see markReady()
+        inline static const std::chrono::time_point<std::chrono::steady_clock> processStart = std::chrono::steady_clock::now ();
+        std::atomic<int64_t> timeToReadyMs = -1;
+        std::atomic<int64_t> subscribeMs = -1;
+        std::atomic<size_t> subscribedTopics = 0;
+        std::atomic<size_t> subscribeRequests = 0;
+
+        // subscribe to dab/+/<operation> wildcards rather than a topic per device, see setWildcardSubscriptions()
+        bool wildcardSubscriptions = false;
+
+        // shared subscriptions, see setSharedSubscription().   An empty group subscribes to every topic directly
+        std::string shareGroup;
+        std::vector<std::string> fleetMembers;
+        std::string fleetSelf;
+
+        // see setClientId().   Empty uses the default
+        std::string clientId;
+
+        // responses of at least this many bytes are deflated for requesters that accept it, 0 disables compression.   See setCompression()
+        size_t compressionThreshold = 0;
+        std::atomic<uint64_t> compressedResponses = 0;
+        std::atomic<uint64_t> compressionBytesIn = 0;
+        std::atomic<uint64_t> compressionBytesOut = 0;
+
+        // outbound publishes (responses and telemetry).   Producers push onto the queue and return immediately, a single publisher thread
+        // drains it and is the only thread that sends.   Cells keep their strings between uses so, once warmed up, queueing a message
+        // copies into existing buffers rather than allocating.
+        // the publisher moves messages from the queue into a per device fair queue and sends from there, so that one device's telemetry
+        // can't crowd out other devices, and responses go ahead of telemetry
+        struct outboundMessage
+        {
+            std::string deviceId;
+            size_t lane = 0;                                            // the lane (and so the connection) the device is assigned to
+            dabTrafficClass trafficClass = dabTrafficClass::response;
+            std::chrono::time_point<std::chrono::steady_clock> queued;
+            std::string topic;
+            std::string correlationData;
+            std::string payload;
+            bool deflated = false;                                      // payload is deflated, sent with a content-encoding user property
+        };
+
+        constexpr static size_t maxBurst = 64;                          // messages sent per acquisition of the lane's sendMutex
+        constexpr static size_t maxRetainedPayload = 64 * 1024;         // larger buffers (screen captures) are released once sent
+
+        // a lane is an outbound queue with its own publisher thread.   There is normally one, a derived class with several broker connections
+        // asks for one per connection and devices are assigned to a lane (and that lane's connection) by a hash of their id
+        struct outboundLane
+        {
+            dabQueue<outboundMessage> outbound{ 4096 };
+            dabFairQueue<outboundMessage, threadingPolicy> fairQueue;
+            typename threadingPolicy::mutex sendMutex;
+            std::atomic<uint32_t> signal = 0;                           // bumped on every push (and by the derived class when window opens up)
+            std::thread thread;
+            size_t index = 0;
+        };
+
+        std::vector<std::unique_ptr<outboundLane>> lanes;
+        std::atomic<bool> publisherExiting = false;
+
+        // response sent when a request is shed by the scheduler.   It's serialized once up front, when we're overloaded is the worst time to be building json
+        inline static const std::string overloadedResponse = [] () {
+            std::string payload;
+            jsonElement ( {{"status", 503}, {"error", "adapter overloaded"}} ).serialize ( payload, true );
+            return payload;
+        } ();
+
+        // response sent when a device's concurrency limit refuses a request (see dabBridge::admit)
+        inline static const std::string inFlightLimitResponse = [] () {
+            std::string payload;
+            jsonElement ( {{"status", 503}, {"error", "too many requests in flight"}} ).serialize ( payload, true );
+            return payload;
+        } ();
+
+        // response sent to requests for a device the bridge doesn't have.   With wildcard subscriptions the broker delivers requests for any
+        // device id, these are answered without parsing or scheduling them
+        inline static const std::string unknownDeviceResponse = [] () {
+            std::string payload;
+            jsonElement ( {{"status", 400}, {"error", "deviceId does not exist"}} ).serialize ( payload, true );
+            return payload;
+        } ();
+
+        // response sent to requests arriving after disconnect() has started draining
+        inline static const std::string shuttingDownResponse = [] () {
+            std::string payload;
+            jsonElement ( {{"status", 503}, {"error", "adapter shutting down"}} ).serialize ( payload, true );
+            return payload;
+        } ();
+
+        DERIVED &derived ()
+        {
+            return static_cast<DERIVED &> ( *this );
+        }
+
+        // publish the response to a request for deviceId on the request's response topic, echoing back any correlation data.   If the requester
+        // accepts deflate, large responses are compressed here, on the worker thread, rather than by the publisher
+        void publishResponse ( std::string_view const &deviceId, std::string const &responseTopic, std::string const &correlationData, jsonElement const &rsp, bool deflate = false )
+        {
+            // serialize the json response (convert from our internal jsonElement to a string).  The scratch buffer is per thread and keeps its
+            // capacity so steady state serialization doesn't allocate
+            thread_local std::string payload;
+            payload.clear ();
+            rsp.serialize ( payload, true );
+            if ( deflate && payload.size () >= compressionThreshold )
+            {
+                thread_local dabDeflater deflater;
+                thread_local std::string compressed;
+                if ( deflater.deflate ( payload, compressed ) )
+                {
+                    compressedResponses++;
+                    compressionBytesIn += payload.size ();
+                    compressionBytesOut += compressed.size ();
+                    enqueue ( deviceId, dabTrafficClass::response, responseTopic, correlationData, compressed, true );
+                    return;
+                }
+            }
+            enqueue ( deviceId, dabTrafficClass::response, responseTopic, correlationData, payload );
+        }
+
+        // publish an already serialized response
+        void publishResponse ( std::string_view const &deviceId, std::string const &responseTopic, std::string const &correlationData, std::string const &payload )
+        {
+            enqueue ( deviceId, dabTrafficClass::response, responseTopic, correlationData, payload );
+        }
+
+        // decode a request and hand it to the scheduler.   The message is owned by the client library and may be freed once we return, so
+        // anything needed to send the response is copied.   acceptEncoding is the request's accept-encoding user property, if it had one
+        void handleRequest ( std::string_view const &topic, std::string_view const &payload, std::string_view const &responseTopicView, std::string_view const &correlationDataView, std::string_view const &acceptEncoding = {} )
+        {
+            try
+            {
+                auto deviceIdView = bridge.getDeviceId ( topic );
+                if ( !deviceIdView.empty () && !bridge.hasDevice ( deviceIdView ) )
+                {
+                    if ( !responseTopicView.empty () )
+                    {
+                        // queued under the shared key used for discovery.   The fair queue never forgets a device so keying by a deviceId taken
+                        // from the topic would let anyone grow it without bound
+                        publishResponse ( {}, std::string ( responseTopicView ), std::string ( correlationDataView ), unknownDeviceResponse );
+                    }
+                    return;
+                }
+
+                std::string reqStr ( payload );
+                jsonElement req = jsonParser ( reqStr.c_str ());
+
+                // the dispatcher requires the topic to be part of the DAB request.  Add it in.
+                req["topic"] = std::string ( topic );
+                // we put the payload in its own "payload" value in the json object
+                req["payload"] = jsonParser ( reqStr.c_str ());
+                // this leaves us the capability of adding other properties into the top level
+                // that might be needed by a potential handler. for instance topic is currently sent
+                // but a handler might want responseTopic for logging purposes or correlation data
+                // we currently don't send those, but you can do so by commenting out the below lines
+                // req["responseTopic"] = std::string ( responseTopicView );
+                // req["correlationData"] = std::string ( correlationDataView );
+
+                auto responseTopic = std::string ( responseTopicView );
+                auto correlationData = std::string ( correlationDataView );
+                auto deflate = compressionThreshold && dabAcceptsDeflate ( acceptEncoding );
+
+                auto priority = bridge.getPriority ( topic );
+                auto deviceId = std::string ( deviceIdView );
+
+                // the request counts against its device's concurrency limit, if there is one, until the job holding the permit is destroyed
+                typename BRIDGE::admission permit;
+                if ( !bridge.admit ( topic, permit ) )
+                {
+                    publishResponse ( deviceId, responseTopic, correlationData, inFlightLimitResponse );
+                    return;
+                }
+
+                auto admitted = scheduler.schedule ( priority, deviceId, [this, req = std::move ( req ), deviceId, responseTopic, correlationData, deflate, permit = std::move ( permit )] ()
+                {
+                    try
+                    {
+                        // dispatch to the bridge and start get the response
+                        jsonElement rsp;
+                        try
+                        {
+                            rsp = bridge.dispatch ( req );
+                        } catch ( DAB::dabException &e )
+                        {
+                            // the bridge rejected the request (unknown device, overloaded, ...), let the requester know
+                            rsp = {{"status", e.errorCode}, {"error", e.errorText}};
+                        }
+                        publishResponse ( deviceId, responseTopic, correlationData, rsp, deflate );
+                    } catch ( DAB::dabException &e )
+                    {
+                        std::cout << "error (" << e.errorCode << "): " << e.errorText << std::endl;
+                    } catch ( ... )
+                    {
+                    }
+                } );
+                if ( !admitted )
+                {
+                    // we're either shutting down or over our queue limits, reject the request immediately rather than buffering it
+                    publishResponse ( deviceId, responseTopic, correlationData, scheduler.isDraining () ? shuttingDownResponse : overloadedResponse );
+                }
+            } catch ( DAB::dabException &e )
+            {
+                std::cout << "error (" << e.errorCode << "): " << e.errorText << std::endl;
+            } catch ( ... )
+            {
+            }
+        }
+
+        // this is the publishing call-back that we pass to the bridge object (and subsequently to the dabClient).  It's used for notifications where we send telemetry responses without a request
+        void publishCB ( jsonElement const &elem )
+        {
+            thread_local std::string payload;
+            payload.clear ();
+
+            elem["payload"].serialize ( payload, true );
+
+            auto const &topic = elem["topic"].operator const std::string & ();
+            enqueue ( bridge.getDeviceId ( topic ), dabTrafficClass::telemetry, topic, std::string (), payload );
+        }
+
+        // send a message through the derived class, then trim its buffers if they've grown too large to be worth keeping
+        void transmit ( outboundMessage &msg )
+        {
+            static_assert ( requires ( DERIVED &d ) { { d.send ( msg ) } -> std::convertible_to<bool>; }, "the interface must implement bool send ( outboundMessage &msg )" );
+            if ( !derived ().send ( msg ) )
+            {
+                // the producer has long since moved on so there is nobody to throw to
+                std::cout << "error: error publishing message to " << msg.topic << std::endl;
+            }
+            if ( msg.payload.capacity () > maxRetainedPayload )
+            {
+                msg.payload = std::string ();
+            }
+        }
+
+        // how many messages the derived class will accept on lane right now
+        size_t availableWindow ( size_t lane )
+        {
+            if constexpr ( requires ( DERIVED &d ) { d.sendWindow ( lane ); } )
+            {
+                return derived ().sendWindow ( lane );
+            } else if constexpr ( requires ( DERIVED &d ) { d.sendWindow (); } )
+            {
+                return derived ().sendWindow ();
+            } else
+            {
+                return SIZE_MAX;
+            }
+        }
+
+        // the lane a device's messages are sent on.   The hash must be stable for the life of the process, the derived class subscribes each
+        // connection to the topics of the devices assigned to it
+        size_t laneOf ( std::string_view const &deviceId ) const
+        {
+            if ( lanes.size () == 1 )
+            {
+                return 0;
+            }
+            return (size_t) (hashOf ( deviceId ) % lanes.size ());
+        }
+
+        // FNV-1a, continuing from hash so that several strings can be hashed together
+        static uint64_t hashOf ( std::string_view const &value, uint64_t hash = 14695981039346656037ull )
+        {
+            for ( auto c : value )
+            {
+                hash = (hash ^ (uint8_t) c) * 1099511628211ull;
+            }
+            return hash;
+        }
+
+        // the fleet member that owns deviceId, by rendezvous (highest random weight) hashing.   Every member computes the same owner from the
+        // same member list, and adding or removing a member only moves the devices that member gains or loses
+        std::string_view ownerOf ( std::string_view const &deviceId ) const
+        {
+            std::string_view owner;
+            uint64_t best = 0;
+            for ( auto const &member : fleetMembers )
+            {
+                auto weight = hashOf ( member, hashOf ( "/", hashOf ( deviceId ) ) );
+                // FNV's last bytes barely reach the high bits, finish with a full avalanche (splitmix64) so that members whose names differ only
+                // at the end still get an even share
+                weight = (weight ^ (weight >> 30)) * 0xBF58476D1CE4E5B9ull;
+                weight = (weight ^ (weight >> 27)) * 0x94D049BB133111EBull;
+                weight ^= weight >> 31;
+                if ( owner.empty () || weight > best )
+                {
+                    owner = member;
+                    best = weight;
+                }
+            }
+            return owner;
+        }
+
+        // the filter to subscribe to for a request topic, or an empty string if this process shouldn't subscribe to it.
+        // stateless operations are shared by the whole group, the broker delivers each request to just one member.   Operations that keep
+        // per device state (telemetry) must always reach the same process, so they're subscribed to directly, and only by the device's owner
+        std::string subscriptionFilter ( std::string const &topic ) const
+        {
+            if ( shareGroup.empty () )
+            {
+                return topic;
+            }
+            if ( BRIDGE::isDeviceAffine ( topic ) )
+            {
+                return ownerOf ( BRIDGE::getDeviceId ( topic ) ) == fleetSelf ? topic : std::string ();
+            }
+            return "$share/" + shareGroup + "/" + topic;
+        }
+
+        // calls func ( first, last ) for consecutive ranges of topics, each small enough to go in a single subscribe or unsubscribe request.
+        // maxBytes bounds the encoded size of the filters in a range (2 byte length, filter and an options byte).   Returns the number of ranges
+        template< typename F >
+        size_t forEachSubscribeChunk ( std::vector<std::string> &filters, F &&func, size_t maxBytes = SIZE_MAX )
+        {
+            size_t chunks = 0;
+            auto first = filters.begin ();
+            while ( first != filters.end () )
+            {
+                auto last = first;
+                size_t bytes = 0;
+                while ( last != filters.end () && (size_t) (last - first) < maxSubscribeTopics && (last == first || bytes + last->size () + 3 <= maxBytes) )
+                {
+                    bytes += last->size () + 3;
+                    last++;
+                }
+                func ( first, last );
+                chunks++;
+                first = last;
+            }
+            return chunks;
+        }
+
+        // called by the derived class once every subscription has been acknowledged.   connectStart is when connect() was called
+        void markReady ( std::chrono::time_point<std::chrono::steady_clock> connectStart, std::chrono::time_point<std::chrono::steady_clock> subscribeStart, size_t nTopics, size_t nRequests )
+        {
+            auto now = std::chrono::steady_clock::now ();
+            timeToReadyMs = std::chrono::duration_cast<std::chrono::milliseconds> ( now - processStart ).count ();
+            subscribeMs = std::chrono::duration_cast<std::chrono::milliseconds> ( now - subscribeStart ).count ();
+            subscribedTopics = nTopics;
+            subscribeRequests = nRequests;
+            std::cout << "ready: " << nTopics << " topics subscribed with " << nRequests << " requests in " << subscribeMs << "ms (connect " << std::chrono::duration_cast<std::chrono::milliseconds> ( subscribeStart - connectStart ).count () << "ms), " << timeToReadyMs << "ms after start" << std::endl;
+        }
+
+        // the request topics to subscribe to, before subscriptionFilter() is applied.   With wildcard subscriptions each operation is
+        // subscribed to once for all devices, except that operations with per device state stay per device when sharing with other processes,
+        // they have to be routed to their owner by the broker
+        std::vector<std::string> requestTopics ()
+        {
+            if ( !wildcardSubscriptions )
+            {
+                return bridge.getTopics ();
+            }
+            auto topics = bridge.getWildcardTopics ();
+            if ( !shareGroup.empty () )
+            {
+                std::erase_if ( topics, [] ( std::string const &topic ) { return BRIDGE::isDeviceAffine ( topic ); } );
+                for ( auto const &topic : bridge.getTopics () )
+                {
+                    if ( BRIDGE::isDeviceAffine ( topic ) )
+                    {
+                        topics.push_back ( topic );
+                    }
+                }
+            }
+            return topics;
+        }
+
+        // the filters to subscribe to for all of the bridge's topics
+        std::vector<std::string> subscriptionTopics ()
+        {
+            std::vector<std::string> filters;
+            for ( auto const &topic : requestTopics () )
+            {
+                if ( auto filter = subscriptionFilter ( topic ); !filter.empty () )
+                {
+                    filters.push_back ( std::move ( filter ) );
+                }
+            }
+            return filters;
+        }
+
+        // queue a message for publication
+        void enqueue ( std::string_view const &deviceId, dabTrafficClass trafficClass, std::string const &topic, std::string const &correlationData, std::string const &payload, bool deflated = false )
+        {
+            auto laneIndex = laneOf ( deviceId );
+            auto &lane = *lanes[laneIndex];
+            auto fill = [&] ( outboundMessage &m )
+            {
+                m.deviceId.assign ( deviceId );
+                m.lane = laneIndex;
+                m.trafficClass = trafficClass;
+                m.queued = std::chrono::steady_clock::now ();
+                m.topic.assign ( topic );
+                m.correlationData.assign ( correlationData );
+                m.payload.assign ( payload );
+                m.deflated = deflated;
+            };
+
+            if constexpr ( threadingPolicy::concurrent )
+            {
+                while ( !lane.outbound.tryEmplace ( fill ) )
+                {
+                    if ( publisherExiting )
+                    {
+                        // nobody left to make room
+                        return;
+                    }
+                    // the queue is full.   The publisher is already awake and sending so give it a chance to make room
+                    std::this_thread::yield ();
+                }
+                wakePublisher ( lane );
+            } else
+            {
+                // single threaded builds have no publisher, send immediately
+                while ( !lane.outbound.tryEmplace ( fill ) )
+                {
+                    sendQueued ( lane );
+                }
+                sendQueued ( lane );
+            }
+        }
+
+        // single threaded builds only, send everything queued
+        void sendQueued ( outboundLane &lane )
+        {
+            std::lock_guard l1 ( lane.sendMutex );
+            lane.outbound.popBatch ( [this] ( outboundMessage &m ) { transmit ( m ); } );
+        }
+
+        void wakePublisher ( outboundLane &lane )
+        {
+            lane.signal.fetch_add ( 1, std::memory_order_release );
+            lane.signal.notify_one ();
+        }
+
+        // wake every publisher, used by the derived class when its send window opens up
+        void wakePublisher ()
+        {
+            for ( auto &lane : lanes )
+            {
+                wakePublisher ( *lane );
+            }
+        }
+
+        // a lane's publisher thread.   Sends bursts of queued messages back to back and sleeps when there is nothing to send.
+        // everything waiting in the lock-free queue is moved into the fair queue before each burst so that the fair queue sees every device
+        // with traffic and a response that has just arrived is sent ahead of any telemetry.
+        // on exit it keeps going until both queues are empty so that every response produced before stopPublisher() is sent
+        void publisherTask ( outboundLane &lane )
+        {
+            for ( ;; )
+            {
+                // read the signal before looking at the queue, a push after we find it empty changes the signal and the wait returns at once
+                auto seen = lane.signal.load ( std::memory_order_acquire );
+
+                lane.outbound.popBatch ( [&lane] ( outboundMessage &m )
+                                         {
+                                             lane.fairQueue.push ( m.deviceId, m.trafficClass, m.queued, m.topic.size () + m.payload.size (), m );
+                                         } );
+
+                size_t sent = 0;
+                auto window = std::min ( maxBurst, availableWindow ( lane.index ) );
+                {
+                    std::lock_guard l1 ( lane.sendMutex );
+                    while ( sent < window && lane.fairQueue.pop ( [this] ( outboundMessage &m ) { transmit ( m ); } ) )
+                    {
+                        sent++;
+                    }
+                }
+
+                if ( !sent )
+                {
+                    if ( publisherExiting && lane.fairQueue.empty () )
+                    {
+                        return;
+                    }
+                    lane.signal.wait ( seen, std::memory_order_acquire );
+                }
+            }
+        }
+
+        void startPublisher ()
+        {
+            if constexpr ( threadingPolicy::concurrent )
+            {
+                for ( auto &lane : lanes )
+                {
+                    lane->thread = std::thread ( &dabMQTTInterfaceBase::publisherTask, this, std::ref ( *lane ) );
+                }
+            }
+        }
+
+        // send everything still queued and stop the publisher threads
+        void stopPublisher ()
+        {
+            publisherExiting = true;
+            for ( auto &lane : lanes )
+            {
+                if ( lane->thread.joinable () )
+                {
+                    wakePublisher ( *lane );
+                    lane->thread.join ();
+                }
+            }
+        }
+
+        // stop accepting requests and wait, until deadline, for those already accepted to complete and their responses to be queued.
+        // then let the publisher send everything queued
+        void drain ( std::chrono::time_point<std::chrono::steady_clock> deadline )
+        {
+            stopped = true;
+            scheduler.drain ( deadline );
+            bridge.drain ( deadline );
+            // nothing is producing any more, let the publisher send whatever is still queued
+            stopPublisher ();
+        }
+
+        // shut everything down without waiting, for use by the derived class's destructor before it destroys the client.
+        // workers may still be publishing responses, they must be finished before the client goes away
+        void shutdown ()
+        {
+            scheduler.stop ();
+            bridge.drain ( std::chrono::steady_clock::now () );
+            stopPublisher ();
+        }
+
+        // nLanes is the number of outbound lanes, one per broker connection
+        explicit dabMQTTInterfaceBase ( BRIDGE &bridge, size_t nLanes = 1 ) : bridge ( bridge )
+        {
+            for ( size_t loop = 0; loop < std::max ( nLanes, (size_t) 1 ); loop++ )
+            {
+                lanes.push_back ( std::make_unique<outboundLane> () );
+                lanes.back ()->index = loop;
+            }
+            bridge.setPublishCallback ( std::function ( [this](jsonElement const &elem){ return publishCB ( elem );} ) );
+        }
+
+    public:
+        dabMQTTInterfaceBase ( dabMQTTInterfaceBase const & ) = delete;
+        dabMQTTInterfaceBase &operator= ( dabMQTTInterfaceBase const & ) = delete;
+
+        // true if DERIVED supplies the members described at the top of this file, see dabOutboundTransport
+        constexpr static bool implementsOutbound ()
+        {
+            constexpr bool sends = requires ( DERIVED &d, outboundMessage &msg, std::string_view view )
+            {
+                { d.send ( msg ) } -> std::same_as<bool>;
+                d.handleRequest ( view, view, view, view, view );
+            };
+            constexpr bool window = !requires ( DERIVED &d ) { d.sendWindow (); } || requires ( DERIVED &d ) { { d.sendWindow () } -> std::same_as<size_t>; };
+            constexpr bool laneWindow = !requires ( DERIVED &d, size_t lane ) { d.sendWindow ( lane ); } || requires ( DERIVED &d, size_t lane ) { { d.sendWindow ( lane ) } -> std::same_as<size_t>; };
+            return sends && window && laneWindow;
+        }
+
+        // set the maximum number of requests that may be waiting for execution in total and for any single device.
+        // requests arriving when either limit has been reached are rejected with a 503 response
+        void setQueueLimits ( size_t globalLimit, size_t perDeviceLimit )
+        {
+            scheduler.setQueueLimits ( globalLimit, perDeviceLimit );
+        }
+
+        // return the adapter's request statistics (queue depths, shed counts, concurrency and rate limits, outbound queueing, startup time, compression)
+        jsonElement getStatistics ()
+        {
+            auto stats = scheduler.getStatistics ();
+            stats["concurrency"] = bridge.getConcurrencyStatistics ();
+            stats["rateLimits"] = bridge.getRateLimitStatistics ();
+            if ( lanes.size () == 1 )
+            {
+                stats["outbound"] = lanes.front ()->fairQueue.getStatistics ();
+            } else
+            {
+                // every device is in exactly one lane
+                int64_t queued = 0;
+                jsonElement devices;
+                devices.makeObject ();
+                for ( auto &lane : lanes )
+                {
+                    auto laneStats = lane->fairQueue.getStatistics ();
+                    queued += (int64_t) laneStats["queued"];
+                    for ( auto it = laneStats["devices"].cbeginObject (); it != laneStats["devices"].cendObject (); it++ )
+                    {
+                        devices[it->first.c_str ()] = it->second;
+                    }
+                }
+                stats["outbound"] = {{"queued",  queued},
+                                     {"devices", devices}};
+            }
+            stats["startup"] = {{"timeToReadyMs",     (int64_t) timeToReadyMs},
+                                {"subscribeMs",       (int64_t) subscribeMs},
+                                {"topics",            (int64_t) subscribedTopics},
+                                {"subscribeRequests", (int64_t) subscribeRequests}};
+            stats["compression"] = {{"threshold", (int64_t) compressionThreshold},
+                                    {"responses", (int64_t) compressedResponses},
+                                    {"bytesIn",   (int64_t) compressionBytesIn},
+                                    {"bytesOut",  (int64_t) compressionBytesOut}};
+            return stats;
+        }
+
+        // set the maximum number of topic filters sent in a single subscribe or unsubscribe request.   Brokers differ, some (AWS IoT for
+        // instance) accept only 8
+        void setSubscribeBatch ( size_t topicsPerRequest )
+        {
+            maxSubscribeTopics = std::max ( topicsPerRequest, (size_t) 1 );
+        }
+
+        // deflate responses of at least threshold bytes for requesters that send an "accept-encoding: deflate" user property.   0 (the default)
+        // disables compression.   Throws if the adapter was built without compression support
+        void setCompression ( size_t threshold )
+        {
+            if ( threshold && !dabCompressionAvailable )
+            {
+                throw DAB::dabException ( 400, std::string ( "compression is not built in" ) );
+            }
+            compressionThreshold = threshold;
+        }
+
+        // give deviceId weight times the share of the broker connection of other devices when publishes are backed up
+        void setOutboundWeight ( std::string_view const &deviceId, uint32_t weight )
+        {
+            lanes[laneOf ( deviceId )]->fairQueue.setWeight ( deviceId, weight );
+        }
+
+        // subscribe to a dab/+/<operation> wildcard per operation instead of a topic per device and operation, and route requests to devices
+        // locally.   This keeps the broker's subscription state small and independent of the number of devices.   Requests for devices the
+        // bridge doesn't have are answered immediately with a 400.   Must be called before connect()
+        void setWildcardSubscriptions ( bool enable )
+        {
+            wildcardSubscriptions = enable;
+        }
+
+        // the client id of the broker connection carrying lane
+        std::string clientIdOf ( size_t lane ) const
+        {
+            auto id = !clientId.empty () ? clientId : fleetSelf.empty () ? std::string ( "dab" ) : "dab-" + fleetSelf;
+            return lanes.size () == 1 ? id : id + "-" + std::to_string ( lane );
+        }
+
+        // split requests with other adapter processes through MQTT 5 shared subscriptions ($share/<group>/<topic>).   Each request for a stateless
+        // operation is delivered to one member of the group.   Telemetry start/stop requests for a device are handled by the device's owner,
+        // chosen from members by rendezvous hashing, so that a device's telemetry jobs always live in the same process.   members lists every
+        // process in the group (including this one, named self) and must be the same in each.   Must be called before connect()
+        void setSharedSubscription ( std::string const &group, std::vector<std::string> const &members, std::string const &self )
+        {
+            if ( group.empty () || group.find_first_of ( "/+#" ) != std::string::npos )
+            {
+                throw DAB::dabException ( 400, std::string ( "invalid shared subscription group" ) );
+            }
+            if ( std::find ( members.begin (), members.end (), self ) == members.end () )
+            {
+                throw DAB::dabException ( 400, std::string ( "this process must be a member of the group" ) );
+            }
+            if ( clientId == "dab" )
+            {
+                // the broker would hand the session of one member to the next as each connected
+                throw DAB::dabException ( 400, std::string ( "members of a group require their own client id" ) );
+            }
+            shareGroup = group;
+            fleetMembers = members;
+            fleetSelf = self;
+            // a batch can be delivered to any member, the bridge must refuse the telemetry operations in it unless we own the device
+            bridge.setDeviceOwner ( [this] ( std::string_view const &deviceId ) { return ownerOf ( deviceId ) == fleetSelf; } );
+        }
+
+        // set the client id used to connect to the broker.   With several connections it is the prefix of their ids, "<id>-0", "<id>-1", ...
+        // a broker allows one session per client id, connecting with an id already in use takes that session over.   So every process sharing a
+        // broker must have its own.   The default is "dab", or "dab-<self>" for a member of a shared subscription group.   Must be called before connect()
+        void setClientId ( std::string const &id )
+        {
+            if ( id.empty () || (id == "dab" && !fleetSelf.empty ()) )
+            {
+                throw DAB::dabException ( 400, std::string ( "invalid client id" ) );
+            }
+            clientId = id;
+        }
+
+        // ends wait() in single threaded builds, typically called from a handler.   disconnect() should then be called once wait() has returned.
+        void stop ()
+        {
+            stopped = true;
+        }
+    };
+}
@@ -0,0 +1,847 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#if !defined ( __linux__ )
+#error dabMQTTNativeInterface requires epoll and is only available on linux
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dabMqttCodec.h"
+#include "dabMqttInterfaceBase.h"
+
+// mqtt interface with a built in MQTT 5 client, a drop in replacement for dabMQTTInterface that needs no client library.
+// a single reactor thread owns the socket's read side.   It reads into one buffer, decodes packets in place and hands the topic, response
+// topic, correlation data and payload to the request decoder as views into that buffer, so nothing is copied until the request is parsed.
+// publishes are written by the publisher thread with a single gathered write of the encoded header and the message's payload, straight from
+// the buffers the message was queued in.   Nothing waits for a round trip: qos 0 publishes complete when written, qos 1 publishes are
+// pipelined up to the broker's receive maximum and acknowledged by the reactor.
+// if the socket can't take everything the remainder is buffered and written by the reactor when the socket becomes writable, and the
+// publisher stops sending until the backlog has drained.
+
+namespace DAB
+{
+    template< typename BRIDGE >
+    class dabMQTTNativeInterface : public dabMQTTInterfaceBase<dabMQTTNativeInterface<BRIDGE>, BRIDGE>
+    {
+        using base = dabMQTTInterfaceBase<dabMQTTNativeInterface<BRIDGE>, BRIDGE>;
+        friend base;
+
+        using typename base::threadingPolicy;
+        using typename base::outboundMessage;
+        using base::bridge;
+        using base::running;
+        using base::runningMutex;
+        using base::topics;
+
+        static_assert ( threadingPolicy::concurrent, "the native client runs its own reactor thread and can not be used with dabSingleThreaded" );
+
+        constexpr static auto CONNECT_TIMEOUT = std::chrono::seconds ( 30 );
+        constexpr static uint16_t KEEP_ALIVE = 20;                      // seconds
+        constexpr static size_t READ_SIZE = 64 * 1024;                  // minimum free space in the receive buffer for each read
+        constexpr static size_t WRITE_HIGH_WATER = 1024 * 1024;         // stop publishing while more than this is waiting for the socket
+        constexpr static uint32_t MAX_PACKET_SIZE = 1024 * 1024;        // largest packet accepted from the broker, advertised in the CONNECT
+
+        constexpr static uint8_t RC_PACKET_TOO_LARGE = 0x95;
+
+        std::string host;
+        std::string port;
+
+        int fd = -1;
+        int wakeFd = -1;                                                // eventfd, used to stop the reactor
+        int epollFd = -1;
+        std::thread reactorThread;
+        std::atomic<bool> connected = false;
+
+        // receive buffer.   Only the reactor touches it once connected
+        std::string rx;
+        size_t rxUsed = 0;
+
+        // everything that writes to the socket holds writeMutex.   pendingOut holds bytes the socket wouldn't take, they must go out before
+        // anything else is written
+        std::mutex writeMutex;
+        std::string pendingOut;
+        std::atomic<size_t> pendingBytes = 0;
+        bool writeArmed = false;
+        std::chrono::time_point<std::chrono::steady_clock> lastWrite;
+
+        // when we last heard from the broker, only touched by the reactor
+        std::chrono::time_point<std::chrono::steady_clock> lastRead;
+
+        // reused by the publisher for every publish
+        std::string publishHeader;
+        mqttPropertyWriter publishProps;
+
+        // outbound topic aliases, up to the broker's topic alias maximum (or our own limit if lower).   Only touched by the publisher
+        mqttTopicAliases topicAliases;
+        uint16_t topicAliasLimit = UINT16_MAX;
+
+        // qos 1 publish pipelining.   The broker allows at most receiveMaximum unacknowledged qos 1 publishes
+        uint8_t publishQos = 0;
+        uint16_t receiveMaximum = 65535;
+        uint32_t maximumPacketSize = 0;                                 // the largest packet the broker accepts, 0 if it didn't say
+        std::atomic<size_t> unacked = 0;
+        std::atomic<uint16_t> nextPacketId = 0;
+        std::atomic<uint64_t> published = 0;
+        std::atomic<uint64_t> publishFailures = 0;
+
+        // subscribe/unsubscribe acknowledgements, keyed by packet id, waited for by connect() and disconnect()
+        std::mutex ackMutex;
+        std::condition_variable ackCondition;
+        std::map<uint16_t, uint8_t> acks;
+
+        uint16_t allocatePacketId ()
+        {
+            uint16_t id;
+            do
+            {
+                id = ++nextPacketId;
+            } while ( !id );
+            return id;
+        }
+
+        // write iov to the socket, buffering whatever it won't take.   Called with writeMutex held
+        bool writeLocked ( iovec *iov, size_t iovCount )
+        {
+            if ( fd < 0 )
+            {
+                return false;
+            }
+            lastWrite = std::chrono::steady_clock::now ();
+
+            size_t total = 0;
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                total += iov[loop].iov_len;
+            }
+
+            ssize_t written = 0;
+            if ( pendingOut.empty () )
+            {
+                // sendmsg rather than writev so that a dropped connection is reported as EPIPE rather than raising SIGPIPE
+                msghdr msg{};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovCount;
+                written = ::sendmsg ( fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+                if ( written < 0 )
+                {
+                    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                    {
+                        return false;
+                    }
+                    written = 0;
+                }
+                if ( (size_t) written == total )
+                {
+                    return true;
+                }
+            }
+
+            // keep the unwritten remainder for the reactor
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                auto len = iov[loop].iov_len;
+                if ( (size_t) written >= len )
+                {
+                    written -= (ssize_t) len;
+                    continue;
+                }
+                pendingOut.append ( (char const *) iov[loop].iov_base + written, len - (size_t) written );
+                written = 0;
+            }
+            pendingBytes = pendingOut.size ();
+            armWrite ( true );
+            return true;
+        }
+
+        bool writePacket ( std::string_view packet )
+        {
+            iovec iov{ (void *) packet.data (), packet.size () };
+            std::lock_guard l1 ( writeMutex );
+            return writeLocked ( &iov, 1 );
+        }
+
+        // ask the reactor to tell us when the socket is writable.   Called with writeMutex held
+        void armWrite ( bool arm )
+        {
+            if ( arm != writeArmed )
+            {
+                writeArmed = arm;
+                epoll_event ev{};
+                ev.events = EPOLLIN | (arm ? (uint32_t) EPOLLOUT : 0);
+                ev.data.fd = fd;
+                epoll_ctl ( epollFd, EPOLL_CTL_MOD, fd, &ev );
+            }
+        }
+
+        // the socket has become writable, send what we buffered
+        void flushPending ()
+        {
+            bool failed = false;
+            {
+                std::lock_guard l1 ( writeMutex );
+                while ( !pendingOut.empty () )
+                {
+                    auto written = ::send ( fd, pendingOut.data (), pendingOut.size (), MSG_NOSIGNAL | MSG_DONTWAIT );
+                    if ( written < 0 )
+                    {
+                        if ( errno == EINTR )
+                        {
+                            continue;
+                        }
+                        failed = errno != EAGAIN && errno != EWOULDBLOCK;
+                        break;
+                    }
+                    pendingOut.erase ( 0, (size_t) written );
+                }
+                pendingBytes = pendingOut.size ();
+                if ( pendingOut.empty () )
+                {
+                    armWrite ( false );
+                }
+            }
+            if ( failed )
+            {
+                // not under writeMutex, connectionLost takes the other locks
+                connectionLost ();
+            }
+            // the publisher may have stopped because of the backlog
+            this->wakePublisher ();
+        }
+
+        // number of messages the publisher may send now
+        size_t sendWindow ()
+        {
+            if ( pendingBytes > WRITE_HIGH_WATER )
+            {
+                return 0;
+            }
+            if ( publishQos )
+            {
+                auto current = unacked.load ();
+                return current >= receiveMaximum ? 0 : receiveMaximum - current;
+            }
+            return SIZE_MAX;
+        }
+
+        // publish a single message.   Called by the publisher
+        bool send ( outboundMessage &msg )
+        {
+            if ( !connected )
+            {
+                publishFailures++;
+                return false;
+            }
+
+            publishProps.clear ();
+            auto [alias, sendTopic] = topicAliases.lookup ( msg.topic );
+            if ( alias )
+            {
+                publishProps.u16 ( mqttProperty::topicAlias, alias );
+            }
+            if ( !msg.correlationData.empty () )
+            {
+                publishProps.string ( mqttProperty::correlationData, msg.correlationData );
+            }
+            if ( msg.deflated )
+            {
+                publishProps.userProperty ( contentEncodingProperty, deflateEncoding );
+            }
+
+            uint16_t packetId = 0;
+            if ( publishQos )
+            {
+                packetId = allocatePacketId ();
+                unacked++;
+            }
+
+            publishHeader.clear ();
+            encodePublishHeader ( publishHeader, sendTopic ? std::string_view ( msg.topic ) : std::string_view (), publishQos, false, packetId, publishProps, msg.payload.size () );
+
+            iovec iov[2] = {{publishHeader.data (), publishHeader.size ()},
+                            {msg.payload.data (),   msg.payload.size ()}};
+
+            std::lock_guard l1 ( writeMutex );
+            if ( !writeLocked ( iov, msg.payload.empty () ? 1 : 2 ) )
+            {
+                if ( publishQos )
+                {
+                    unacked--;
+                }
+                publishFailures++;
+                return false;
+            }
+            if ( !publishQos )
+            {
+                published++;
+            }
+            return true;
+        }
+
+        void connectionLost ()
+        {
+            if ( connected.exchange ( false ) )
+            {
+                {
+                    std::lock_guard l1 ( ackMutex );
+                }
+                ackCondition.notify_all ();
+                std::lock_guard l1 ( runningMutex );
+                running.notify_all ();
+            }
+        }
+
+        // decode and act on a single packet.   Runs on the reactor
+        void handlePacket ( uint8_t first, std::string_view body )
+        {
+            switch ( (mqttPacketType) (first >> 4) )
+            {
+                case mqttPacketType::publish:
+                {
+                    mqttPublish pkt;
+                    if ( !decodePublish ( first & 0x0F, body, pkt ) )
+                    {
+                        connectionLost ();
+                        return;
+                    }
+                    if ( pkt.qos == 1 )
+                    {
+                        // acknowledge before handling, the request has been accepted (or will be answered with a 503)
+                        char ack[4];
+                        ack[0] = (char) ((uint8_t) mqttPacketType::puback << 4);
+                        ack[1] = 2;
+                        ack[2] = (char) (pkt.packetId >> 8);
+                        ack[3] = (char) (pkt.packetId & 0xFF);
+                        writePacket ( {ack, sizeof ( ack )} );
+                    }
+                    this->handleRequest ( pkt.topic, pkt.payload, pkt.props.responseTopic, pkt.props.correlationData, pkt.props.acceptEncoding );
+                    break;
+                }
+                case mqttPacketType::puback:
+                {
+                    mqttAck pkt;
+                    decodeAck ( body, pkt );
+                    if ( pkt.reasonCode >= 0x80 )
+                    {
+                        publishFailures++;
+                    } else
+                    {
+                        published++;
+                    }
+                    if ( unacked )
+                    {
+                        unacked--;
+                    }
+                    // the window has opened up
+                    this->wakePublisher ();
+                    break;
+                }
+                case mqttPacketType::suback:
+                case mqttPacketType::unsuback:
+                {
+                    mqttAck pkt;
+                    decodeSubAck ( body, pkt );
+                    {
+                        std::lock_guard l1 ( ackMutex );
+                        acks[pkt.packetId] = pkt.reasonCode;
+                    }
+                    ackCondition.notify_all ();
+                    break;
+                }
+                case mqttPacketType::disconnect:
+                {
+                    mqttAck pkt;
+                    decodeDisconnect ( body, pkt );
+                    std::cout << "error (" << (int) pkt.reasonCode << "): broker disconnected " << pkt.props.reasonString << std::endl;
+                    connectionLost ();
+                    break;
+                }
+                case mqttPacketType::pingresp:
+                default:
+                    break;
+            }
+        }
+
+        // decode every complete packet in the receive buffer and move any partial packet to the front
+        void processReceived ()
+        {
+            size_t pos = 0;
+            while ( pos < rxUsed )
+            {
+                std::string_view view ( rx.data () + pos, rxUsed - pos );
+                size_t headerLen = 0;
+                auto len = mqttPacketLength ( view, headerLen );
+                if ( len == SIZE_MAX )
+                {
+                    connectionLost ();
+                    rxUsed = 0;
+                    return;
+                }
+                // the broker may not send us more than we advertised.   Rather than buffer whatever length it announces we drop the connection
+                // as soon as the fixed header is in, before the rest of the packet is read
+                if ( len > MAX_PACKET_SIZE )
+                {
+                    std::cout << "error: packet from broker exceeds the maximum packet size of " << MAX_PACKET_SIZE << " bytes" << std::endl;
+                    std::string packet;
+                    encodeDisconnect ( packet, RC_PACKET_TOO_LARGE );
+                    writePacket ( packet );
+                    ::shutdown ( fd, SHUT_RDWR );
+                    connectionLost ();
+                    rxUsed = 0;
+                    return;
+                }
+                if ( !len || len > view.size () )
+                {
+                    break;
+                }
+                handlePacket ( (uint8_t) view[0], view.substr ( headerLen, len - headerLen ) );
+                pos += len;
+            }
+            if ( pos )
+            {
+                std::memmove ( rx.data (), rx.data () + pos, rxUsed - pos );
+                rxUsed -= pos;
+            }
+        }
+
+        // read whatever is available.   Returns false once the connection has gone
+        bool readSocket ()
+        {
+            for ( ;; )
+            {
+                if ( rx.size () - rxUsed < READ_SIZE )
+                {
+                    rx.resize ( rxUsed + READ_SIZE );
+                }
+                auto len = ::recv ( fd, rx.data () + rxUsed, rx.size () - rxUsed, MSG_DONTWAIT );
+                if ( len > 0 )
+                {
+                    lastRead = std::chrono::steady_clock::now ();
+                    rxUsed += (size_t) len;
+                    processReceived ();
+                    if ( !connected )
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                if ( len < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                if ( len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+                {
+                    return true;
+                }
+                // orderly shutdown by the broker or a socket error
+                connectionLost ();
+                return false;
+            }
+        }
+
+        // the reactor.   Reads and dispatches incoming packets, flushes buffered output and keeps the connection alive
+        void reactorTask ()
+        {
+            auto pingInterval = std::chrono::seconds ( KEEP_ALIVE / 2 );
+            epoll_event events[4];
+
+            // anything that arrived along with the CONNACK
+            lastRead = std::chrono::steady_clock::now ();
+            processReceived ();
+
+            while ( connected )
+            {
+                auto n = epoll_wait ( epollFd, events, 4, (int) std::chrono::duration_cast<std::chrono::milliseconds> ( pingInterval ).count () );
+                for ( int loop = 0; loop < n; loop++ )
+                {
+                    if ( events[loop].data.fd == wakeFd )
+                    {
+                        return;
+                    }
+                    if ( events[loop].events & (EPOLLIN | EPOLLHUP | EPOLLERR) )
+                    {
+                        if ( !readSocket () )
+                        {
+                            return;
+                        }
+                    }
+                    if ( events[loop].events & EPOLLOUT )
+                    {
+                        flushPending ();
+                    }
+                }
+
+                // the broker answers our pings, so silence for 1.5 times the keep alive means the connection is dead even though the socket
+                // hasn't noticed (the broker would disconnect us for the same silence)
+                if ( std::chrono::steady_clock::now () - lastRead > std::chrono::seconds ( KEEP_ALIVE ) * 3 / 2 )
+                {
+                    std::cout << "error: no response from broker within the keep alive interval" << std::endl;
+                    connectionLost ();
+                    return;
+                }
+
+                // the broker disconnects us if it hears nothing for 1.5 times the keep alive
+                std::lock_guard l1 ( writeMutex );
+                if ( std::chrono::steady_clock::now () - lastWrite >= pingInterval )
+                {
+                    std::string ping;
+                    encodePing ( ping );
+                    iovec iov{ ping.data (), ping.size () };
+                    writeLocked ( &iov, 1 );
+                }
+            }
+        }
+
+        // waits for the acknowledgement of packetId, returns its reason code or -1 if it didn't arrive by deadline
+        int waitAck ( uint16_t packetId, std::chrono::time_point<std::chrono::steady_clock> deadline )
+        {
+            std::unique_lock l1 ( ackMutex );
+            if ( !ackCondition.wait_until ( l1, deadline, [this, packetId] () { return acks.contains ( packetId ) || !connected; } ) || !acks.contains ( packetId ) )
+            {
+                return -1;
+            }
+            auto rc = acks[packetId];
+            acks.erase ( packetId );
+            return rc;
+        }
+
+        // write a subscribe or unsubscribe packet, encoded by encode ( packet, packetId, first, last ), for each chunk of topics that fits in
+        // the broker's maximum packet size.   They're all written before waiting for any acknowledgement so the whole subscription costs a
+        // single round trip.   Returns the first failing reason code, or -1 if not everything was acknowledged by deadline
+        template< typename F >
+        int requestChunked ( F &&encode, std::chrono::time_point<std::chrono::steady_clock> deadline, size_t *requests = nullptr )
+        {
+            // fixed header, packet id and an empty property block
+            constexpr size_t overhead = 5 + 2 + 1;
+            auto maxBytes = maximumPacketSize > overhead ? maximumPacketSize - overhead : SIZE_MAX;
+
+            std::vector<uint16_t> packetIds;
+            std::string packet;
+            bool written = true;
+            auto chunks = this->forEachSubscribeChunk ( topics, [&] ( auto first, auto last )
+            {
+                packet.clear ();
+                auto packetId = allocatePacketId ();
+                encode ( packet, packetId, first, last );
+                if ( written && writePacket ( packet ) )
+                {
+                    packetIds.push_back ( packetId );
+                } else
+                {
+                    written = false;
+                }
+            }, maxBytes );
+
+            int rc = written ? 0 : -1;
+            for ( auto packetId : packetIds )
+            {
+                if ( auto ackRc = waitAck ( packetId, deadline ); ackRc && !rc )
+                {
+                    rc = ackRc;
+                }
+            }
+            if ( requests )
+            {
+                *requests = chunks;
+            }
+            return rc;
+        }
+
+        // blocking read of the CONNACK, the reactor isn't running yet.   Anything following it stays in rx for the reactor
+        void readConnack ()
+        {
+            timeval tv{ (time_t) CONNECT_TIMEOUT.count (), 0 };
+            setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof ( tv ) );
+
+            for ( ;; )
+            {
+                size_t headerLen = 0;
+                auto len = mqttPacketLength ( {rx.data (), rxUsed}, headerLen );
+                if ( len == SIZE_MAX || len > MAX_PACKET_SIZE )
+                {
+                    throw DAB::dabException ( 500, std::string ( "Failed to set connect" ) );
+                }
+                if ( len && len <= rxUsed )
+                {
+                    if ( ((uint8_t) rx[0] >> 4) != (uint8_t) mqttPacketType::connack )
+                    {
+                        throw DAB::dabException ( 500, std::string ( "Failed to set connect" ) );
+                    }
+                    mqttConnack pkt;
+                    if ( !decodeConnack ( {rx.data () + headerLen, len - headerLen}, pkt ) )
+                    {
+                        throw DAB::dabException ( 500, std::string ( "Failed to set connect" ) );
+                    }
+                    if ( pkt.reasonCode )
+                    {
+                        throw DAB::dabException ( pkt.reasonCode, std::string ( "Failed to set connect" ) );
+                    }
+                    receiveMaximum = pkt.props.receiveMaximum ? pkt.props.receiveMaximum : 65535;
+                    maximumPacketSize = pkt.props.maximumPacketSize;
+                    topicAliases.reset ( std::min ( pkt.props.topicAliasMaximum, topicAliasLimit ) );
+
+                    std::memmove ( rx.data (), rx.data () + len, rxUsed - len );
+                    rxUsed -= len;
+                    break;
+                }
+
+                if ( rx.size () - rxUsed < READ_SIZE )
+                {
+                    rx.resize ( rxUsed + READ_SIZE );
+                }
+                auto read = ::recv ( fd, rx.data () + rxUsed, rx.size () - rxUsed, 0 );
+                if ( read <= 0 )
+                {
+                    throw DAB::dabException ( 500, std::string ( "Failed to set connect" ) );
+                }
+                rxUsed += (size_t) read;
+            }
+
+            tv = { 0, 0 };
+            setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof ( tv ) );
+        }
+
+        void openSocket ()
+        {
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *result = nullptr;
+            if ( auto rc = getaddrinfo ( host.c_str (), port.c_str (), &hints, &result ) )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to resolve " ) + host );
+            }
+            for ( auto *ai = result; ai; ai = ai->ai_next )
+            {
+                fd = ::socket ( ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol );
+                if ( fd < 0 )
+                {
+                    continue;
+                }
+                if ( !::connect ( fd, ai->ai_addr, ai->ai_addrlen ) )
+                {
+                    break;
+                }
+                ::close ( fd );
+                fd = -1;
+            }
+            freeaddrinfo ( result );
+            if ( fd < 0 )
+            {
+                throw DAB::dabException ( errno, std::string ( "Failed to set connect" ) );
+            }
+
+            // requests and responses are small, don't let them wait for the next segment
+            int one = 1;
+            setsockopt ( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof ( one ) );
+        }
+
+        // stop the reactor and close the socket
+        void closeSocket ()
+        {
+            connected = false;
+            if ( reactorThread.joinable () )
+            {
+                uint64_t one = 1;
+                [[maybe_unused]] auto rc = ::write ( wakeFd, &one, sizeof ( one ) );
+                reactorThread.join ();
+            }
+            std::lock_guard l1 ( writeMutex );
+            for ( auto *f : {&fd, &epollFd, &wakeFd} )
+            {
+                if ( *f >= 0 )
+                {
+                    ::close ( *f );
+                    *f = -1;
+                }
+            }
+            pendingOut.clear ();
+            pendingBytes = 0;
+            writeArmed = false;
+        }
+
+    public:
+
+        // brokerAddress is host, host:port, tcp://host:port or mqtt://host:port.   The default port is 1883
+        dabMQTTNativeInterface ( BRIDGE &bridge, std::string const &brokerAddress ) : base ( bridge )
+        {
+            std::string_view address ( brokerAddress );
+            for ( auto scheme : {"tcp://", "mqtt://"} )
+            {
+                if ( address.starts_with ( scheme ) )
+                {
+                    address.remove_prefix ( std::strlen ( scheme ) );
+                }
+            }
+            auto colon = address.rfind ( ':' );
+            if ( colon != std::string_view::npos && address.find ( ']' , colon ) == std::string_view::npos )
+            {
+                host = std::string ( address.substr ( 0, colon ) );
+                port = std::string ( address.substr ( colon + 1 ) );
+            } else
+            {
+                host = std::string ( address );
+                port = "1883";
+            }
+            if ( host.size () > 1 && host.front () == '[' && host.back () == ']' )
+            {
+                host = host.substr ( 1, host.size () - 2 );
+            }
+
+            static_assert ( dabOutboundTransport<dabMQTTNativeInterface> );
+            this->startPublisher ();
+        }
+
+        ~dabMQTTNativeInterface ()
+        {
+            this->shutdown ();
+            closeSocket ();
+        }
+
+        // publishes are sent qos 0 by default.   With qos 1 they are pipelined, up to the broker's receive maximum may be awaiting acknowledgement
+        void setPublishQos ( uint8_t qos )
+        {
+            publishQos = qos ? 1 : 0;
+        }
+
+        // limit the number of topic aliases used for publishes, 0 disables them.   By default as many as the broker allows are used
+        void setTopicAliasLimit ( uint16_t limit )
+        {
+            topicAliasLimit = limit;
+        }
+
+        // return the adapter's request statistics, along with the state of the connection's output
+        jsonElement getStatistics ()
+        {
+            auto stats = base::getStatistics ();
+            stats["publish"] = {{"qos",          (int64_t) publishQos},
+                                {"unacked",      unacked.load ()},
+                                {"window",       (int64_t) receiveMaximum},
+                                {"pendingBytes", pendingBytes.load ()},
+                                {"published",    published.load ()},
+                                {"failed",       publishFailures.load ()},
+                                {"topicAliases", {{"assigned",   topicAliases.assigned.load ()},
+                                                  {"hits",       topicAliases.hits.load ()},
+                                                  {"bytesSaved", topicAliases.bytesSaved.load ()}}}};
+            return stats;
+        }
+
+        // this is the method to actually establish a connection with the mqtt broker.  At this point any initialization that needs to be done should have finished
+        // it returns once the connection has been established and all request topics subscribed
+        auto connect ()
+        {
+            auto connectStart = std::chrono::steady_clock::now ();
+            openSocket ();
+
+            {
+                std::string packet;
+                mqttPropertyWriter props;
+                // we don't accept topic aliases from the broker, every request then carries its full topic and can be handed on as a view.
+                // the broker must not send us packets larger than our maximum, it drops them instead
+                props.u16 ( mqttProperty::receiveMaximum, 65535 ).u16 ( mqttProperty::topicAliasMaximum, 0 ).u32 ( mqttProperty::maximumPacketSize, MAX_PACKET_SIZE );
+                encodeConnect ( packet, this->clientIdOf ( 0 ), KEEP_ALIVE, true, props );
+                if ( ::send ( fd, packet.data (), packet.size (), MSG_NOSIGNAL ) != (ssize_t) packet.size () )
+                {
+                    throw DAB::dabException ( errno, std::string ( "Failed to set connect" ) );
+                }
+            }
+            readConnack ();
+
+            epollFd = epoll_create1 ( EPOLL_CLOEXEC );
+            wakeFd = eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl ( epollFd, EPOLL_CTL_ADD, fd, &ev );
+            ev.data.fd = wakeFd;
+            epoll_ctl ( epollFd, EPOLL_CTL_ADD, wakeFd, &ev );
+
+            lastWrite = std::chrono::steady_clock::now ();
+            connected = true;
+            reactorThread = std::thread ( &dabMQTTNativeInterface::reactorTask, this );
+
+            topics = this->subscriptionTopics ();
+
+            auto subscribeStart = std::chrono::steady_clock::now ();
+            size_t requests = 0;
+            if ( auto rc = requestChunked ( [] ( std::string &packet, uint16_t packetId, auto first, auto last ) { encodeSubscribe ( packet, packetId, first, last, 1 ); }, subscribeStart + CONNECT_TIMEOUT, &requests ) )
+            {
+                throw DAB::dabException ( rc, std::string ( "Failed to subscribe" ) );
+            }
+            this->markReady ( connectStart, subscribeStart, topics.size (), requests );
+            return 0;
+        }
+
+        // drains the adapter before disconnecting, exactly as dabMQTTInterface::disconnect() does.   In addition, once everything has been
+        // written we wait (until the deadline) for outstanding qos 1 publishes to be acknowledged
+        auto disconnect ( std::chrono::milliseconds deadline = std::chrono::milliseconds ( 10000 ) )
+        {
+            auto until = std::chrono::steady_clock::now () + deadline;
+
+            if ( connected )
+            {
+                requestChunked ( [] ( std::string &packet, uint16_t packetId, auto first, auto last ) { encodeUnsubscribe ( packet, packetId, first, last ); }, until );
+            }
+
+            this->drain ( until );
+
+            while ( connected && (unacked || pendingBytes) && std::chrono::steady_clock::now () < until )
+            {
+                std::this_thread::sleep_for ( std::chrono::milliseconds ( 1 ) );
+            }
+
+            if ( connected )
+            {
+                std::string packet;
+                encodeDisconnect ( packet );
+                writePacket ( packet );
+            }
+            closeSocket ();
+
+            std::lock_guard l1 ( runningMutex );
+            running.notify_all ();
+            return 0;
+        }
+
+        // this function will wait until the mqtt interface has been properly shut down, or errors due to connectivity loss.
+        void wait ()
+        {
+            std::unique_lock l1 ( runningMutex );
+            running.wait ( l1 );
+        }
+    };
+}
@@ -0,0 +1,137 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <concepts>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "Json.h"
+#include "dabPolicy.h"
+
+namespace DAB
+{
+    // interceptors are plain classes implementing any subset of the following stages:
+    //
+    //     void rewrite ( jsonElement &req )                             modify the request before it is dispatched
+    //     bool before ( jsonElement const &req, jsonElement &rsp )      called before dispatch.  Return false to skip the handler and respond with rsp (auth, caching)
+    //     void after ( jsonElement const &req, jsonElement &rsp )       called with the response once the handler completes (metrics, caching, tracing)
+    //
+    // the stages are detected at compile time.  A stage an interceptor doesn't implement generates no code at all, and an empty pipeline reduces to
+    // a direct call of the handler.  rewrite requires a copy of the request, that copy is only made if an interceptor implements rewrite.
+    // stages may be called concurrently from several worker threads so any state an interceptor keeps must be thread safe.
+    template< typename I >
+    concept hasRewriteStage = requires ( I &i, jsonElement &req ) { i.rewrite ( req ); };
+
+    template< typename I >
+    concept hasBeforeStage = requires ( I &i, jsonElement const &req, jsonElement &rsp ) { { i.before ( req, rsp ) } -> std::convertible_to<bool>; };
+
+    template< typename I >
+    concept hasAfterStage = requires ( I &i, jsonElement const &req, jsonElement &rsp ) { i.after ( req, rsp ); };
+
+    // the pipeline holds an instance of each interceptor.   before and rewrite stages are executed in the order the interceptors are listed,
+    // after stages in the reverse order so that each interceptor wraps the ones that follow it
+    template< typename ... I >
+    class dabPipeline : public dabPolicy
+    {
+        [[no_unique_address]] std::tuple<I...> interceptors;
+
+        template< size_t index >
+        void rewrite ( jsonElement &req )
+        {
+            if constexpr ( index < sizeof... ( I ) )
+            {
+                if constexpr ( hasRewriteStage<std::tuple_element_t<index, std::tuple<I...>>> )
+                {
+                    std::get<index> ( interceptors ).rewrite ( req );
+                }
+                rewrite<index + 1> ( req );
+            }
+        }
+
+        // runs the before stages from index onward, then the handler, then the after stages in reverse.   If a before stage short-circuits,
+        // only the after stages of the interceptors that have already run are executed
+        template< size_t index, typename F >
+        jsonElement run ( jsonElement const &req, F &next )
+        {
+            if constexpr ( index < sizeof... ( I ) )
+            {
+                using interceptor = std::tuple_element_t<index, std::tuple<I...>>;
+                jsonElement rsp;
+                if constexpr ( hasBeforeStage<interceptor> )
+                {
+                    if ( !std::get<index> ( interceptors ).before ( req, rsp ) )
+                    {
+                        if constexpr ( hasAfterStage<interceptor> )
+                        {
+                            std::get<index> ( interceptors ).after ( req, rsp );
+                        }
+                        return rsp;
+                    }
+                }
+                rsp = run<index + 1> ( req, next );
+                if constexpr ( hasAfterStage<interceptor> )
+                {
+                    std::get<index> ( interceptors ).after ( req, rsp );
+                }
+                return rsp;
+            } else
+            {
+                return next ( req );
+            }
+        }
+
+    public:
+        constexpr static bool empty = sizeof... ( I ) == 0;
+        constexpr static bool rewrites = (hasRewriteStage<I> || ...);
+
+        // returns a reference to the interceptor of type INTERCEPTOR so that it may be configured
+        template< typename INTERCEPTOR >
+        INTERCEPTOR &get ()
+        {
+            return std::get<INTERCEPTOR> ( interceptors );
+        }
+
+        // execute the request through the interceptors, calling next ( jsonElement const &req ) to actually handle the request
+        template< typename F >
+        jsonElement invoke ( jsonElement const &req, F &&next )
+        {
+            if constexpr ( empty )
+            {
+                return next ( req );
+            } else if constexpr ( rewrites )
+            {
+                jsonElement rewritten = req;
+                rewrite<0> ( rewritten );
+                return run<0> ( rewritten, next );
+            } else
+            {
+                return run<0> ( req, next );
+            }
+        }
+    };
+
+    template< typename T >
+    struct isDabPipeline : std::false_type
+    {
+    };
+
+    template< typename ... I >
+    struct isDabPipeline<dabPipeline<I...>> : std::true_type
+    {
+    };
+}
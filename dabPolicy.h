@@ -0,0 +1,48 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <type_traits>
+
+namespace DAB
+{
+    // compile-time policies (interceptor pipelines, threading models) are passed to dabClient and dabBridge as extra template parameters.
+    //     class dab_panel : public DAB::dabClient<dab_panel, DAB::dabPipeline<auth>>
+    //     DAB::dabBridge<dab_panel, DAB::dabPipeline<metrics>> bridge;
+    // every policy type inherits from dabPolicy so that it can be told apart from the device classes in dabBridge's type list.
+    struct dabPolicy
+    {
+    };
+
+    template< typename T >
+    constexpr bool isDabPolicy = std::is_base_of_v<dabPolicy, T>;
+
+    // selects the first type in TS... for which PRED<T>::value is true, or DEFAULT if there is none
+    template< template< typename > class PRED, typename DEFAULT, typename ... TS >
+    struct selectPolicy
+    {
+        using type = DEFAULT;
+    };
+
+    template< template< typename > class PRED, typename DEFAULT, typename HEAD, typename ... TAIL >
+    struct selectPolicy<PRED, DEFAULT, HEAD, TAIL...>
+    {
+        using type = std::conditional_t<PRED<HEAD>::value, HEAD, typename selectPolicy<PRED, DEFAULT, TAIL...>::type>;
+    };
+
+    template< template< typename > class PRED, typename DEFAULT, typename ... TS >
+    using selectPolicy_t = typename selectPolicy<PRED, DEFAULT, TS...>::type;
+}
@@ -0,0 +1,161 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace DAB
+{
+    // bounded lock-free multi-producer single-consumer queue
+    // each cell carries a sequence number which tells producers and the consumer whether the cell is free for writing or holds a value for reading.
+    // producers claim a cell with a single compare-exchange on the enqueue position and then publish it by storing the cell's sequence, so
+    // producers never wait on one another beyond that CAS and never wait on the consumer.   The consumer position is only touched by the consumer.
+    //
+    // only one thread may consume at a time.   Consumers must be serialized externally (a dedicated thread, or the holder of a lock).
+    // T must be default constructible and move assignable
+    template< typename T >
+    class dabQueue
+    {
+        // keep the producer and consumer positions on separate cache lines, otherwise every push invalidates the consumer's line and vice versa
+        constexpr static size_t cacheLine = 64;
+
+        struct cell
+        {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+        std::unique_ptr<cell[]> cells;
+        size_t mask;
+
+        alignas( cacheLine ) std::atomic<size_t> enqueuePos = 0;
+        alignas( cacheLine ) std::atomic<size_t> dequeuePos = 0;      // only written by the consumer, atomic so that empty() may be called from anywhere
+
+    public:
+        // capacity is rounded up to a power of two
+        explicit dabQueue ( size_t capacity = 4096 ) : cells ( std::make_unique<cell[]> ( std::bit_ceil ( std::max ( capacity, (size_t) 2 ) ) ) ), mask ( std::bit_ceil ( std::max ( capacity, (size_t) 2 ) ) - 1 )
+        {
+            for ( size_t loop = 0; loop <= mask; loop++ )
+            {
+                cells[loop].sequence.store ( loop, std::memory_order_relaxed );
+            }
+        }
+
+        dabQueue ( dabQueue const & ) = delete;
+        dabQueue &operator= ( dabQueue const & ) = delete;
+
+        size_t capacity () const
+        {
+            return mask + 1;
+        }
+
+        // returns false, leaving value untouched, if the queue is full
+        bool tryPush ( T &&value )
+        {
+            return tryEmplace ( [&value] ( T &data ) { data = std::move ( value ); } );
+        }
+
+        // claims a cell and calls fill ( T & ) to write the value in place.   The cell still holds whatever value last passed through it, so
+        // fill can assign into existing buffers (std::string::assign etc.) rather than allocating new ones.   fill should be quick, the consumer
+        // can't get past this cell until it returns.   Returns false, without calling fill, if the queue is full
+        template< typename F >
+        bool tryEmplace ( F &&fill )
+        {
+            auto pos = enqueuePos.load ( std::memory_order_relaxed );
+            cell *c;
+            for ( ;; )
+            {
+                c = &cells[pos & mask];
+                auto seq = c->sequence.load ( std::memory_order_acquire );
+                auto dif = (intptr_t) seq - (intptr_t) pos;
+                if ( dif == 0 )
+                {
+                    // the cell is free, try to claim it
+                    if ( enqueuePos.compare_exchange_weak ( pos, pos + 1, std::memory_order_relaxed ) )
+                    {
+                        break;
+                    }
+                } else if ( dif < 0 )
+                {
+                    // the cell still holds a value from the previous lap, we're full
+                    return false;
+                } else
+                {
+                    // another producer claimed the cell first
+                    pos = enqueuePos.load ( std::memory_order_relaxed );
+                }
+            }
+            fill ( c->data );
+            c->sequence.store ( pos + 1, std::memory_order_seq_cst );
+            return true;
+        }
+
+        // consumer only.   Returns false if the queue is empty
+        bool tryPop ( T &value )
+        {
+            auto pos = dequeuePos.load ( std::memory_order_relaxed );
+            auto &c = cells[pos & mask];
+            if ( c.sequence.load ( std::memory_order_acquire ) != pos + 1 )
+            {
+                return false;
+            }
+            value = std::move ( c.data );
+            // mark the cell free for the producer one lap ahead
+            c.sequence.store ( pos + mask + 1, std::memory_order_release );
+            dequeuePos.store ( pos + 1, std::memory_order_release );
+            return true;
+        }
+
+        // consumer only.   Removes up to max values, calling func ( T & ) on each in place before the cell is released.
+        // returns the number of values consumed.   Consuming in place avoids a move per value and lets the caller process a burst without
+        // going back to the queue for each one.   The value is left in the cell for reuse by tryEmplace, func may move from it or release any
+        // resources it doesn't want kept.   func must not throw
+        template< typename F >
+        size_t popBatch ( F &&func, size_t max = SIZE_MAX )
+        {
+            auto pos = dequeuePos.load ( std::memory_order_relaxed );
+            size_t count = 0;
+            while ( count < max )
+            {
+                auto &c = cells[pos & mask];
+                if ( c.sequence.load ( std::memory_order_acquire ) != pos + 1 )
+                {
+                    break;
+                }
+                func ( c.data );
+                c.sequence.store ( pos + mask + 1, std::memory_order_release );
+                dequeuePos.store ( ++pos, std::memory_order_release );
+                count++;
+            }
+            return count;
+        }
+
+        // true if there is no value ready at the head of the queue (a push may be in progress).   May be called from any thread, although
+        // the answer is only a snapshot unless the caller is the consumer
+        bool empty () const
+        {
+            auto pos = dequeuePos.load ( std::memory_order_seq_cst );
+            return cells[pos & mask].sequence.load ( std::memory_order_seq_cst ) != pos + 1;
+        }
+    };
+}
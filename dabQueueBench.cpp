@@ -0,0 +1,148 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+// contention benchmark for dabQueue.
+// N producer threads push messages as fast as they can while a single consumer drains them in batches, mimicking device telemetry threads
+// and workers feeding the outbound publisher.   The same workload is run against a mutex protected std::deque for comparison.
+//     dabQueueBench [messagesPerProducer]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dabQueue.h"
+
+// lock-free queue under test
+struct lockFreeQueue
+{
+    DAB::dabQueue<uint64_t> queue{ 4096 };
+
+    bool push ( uint64_t value )
+    {
+        return queue.tryPush ( std::move ( value ) );
+    }
+
+    size_t drain ( uint64_t &sum )
+    {
+        return queue.popBatch ( [&sum] ( uint64_t &value ) { sum += value; }, 256 );
+    }
+};
+
+// baseline: what we had before, every producer serialized on one mutex
+struct mutexQueue
+{
+    std::mutex access;
+    std::deque<uint64_t> queue;
+
+    bool push ( uint64_t value )
+    {
+        std::lock_guard l1 ( access );
+        if ( queue.size () >= 4096 )
+        {
+            return false;
+        }
+        queue.push_back ( value );
+        return true;
+    }
+
+    size_t drain ( uint64_t &sum )
+    {
+        std::lock_guard l1 ( access );
+        size_t count = 0;
+        while ( !queue.empty () && count < 256 )
+        {
+            sum += queue.front ();
+            queue.pop_front ();
+            count++;
+        }
+        return count;
+    }
+};
+
+// returns millions of messages per second
+template< typename Q >
+double run ( size_t nProducers, size_t messagesPerProducer )
+{
+    Q q;
+    auto total = nProducers * messagesPerProducer;
+    uint64_t sum = 0;
+
+    auto start = std::chrono::steady_clock::now ();
+
+    std::thread consumer ( [&] ()
+                           {
+                               size_t received = 0;
+                               while ( received < total )
+                               {
+                                   auto count = q.drain ( sum );
+                                   if ( !count )
+                                   {
+                                       std::this_thread::yield ();
+                                   }
+                                   received += count;
+                               }
+                           } );
+
+    std::vector<std::thread> producers;
+    producers.reserve ( nProducers );
+    for ( size_t loop = 0; loop < nProducers; loop++ )
+    {
+        producers.emplace_back ( [&q, messagesPerProducer] ()
+                                 {
+                                     for ( uint64_t msg = 1; msg <= messagesPerProducer; msg++ )
+                                     {
+                                         while ( !q.push ( msg ) )
+                                         {
+                                             std::this_thread::yield ();
+                                         }
+                                     }
+                                 } );
+    }
+    for ( auto &producer : producers )
+    {
+        producer.join ();
+    }
+    consumer.join ();
+
+    auto elapsed = std::chrono::duration<double> ( std::chrono::steady_clock::now () - start ).count ();
+
+    // make sure nothing was lost or duplicated
+    if ( sum != nProducers * (messagesPerProducer * (messagesPerProducer + 1) / 2) )
+    {
+        std::cout << "checksum mismatch" << std::endl;
+        std::exit ( 1 );
+    }
+    return (double) total / elapsed / 1e6;
+}
+
+int main ( int argc, char *argv[] )
+{
+    size_t messagesPerProducer = argc > 1 ? std::strtoull ( argv[1], nullptr, 10 ) : 200000;
+
+    std::cout << "producers    dabQueue (M/s)    mutex (M/s)" << std::endl;
+    for ( size_t nProducers = 1; nProducers <= 64; nProducers *= 2 )
+    {
+        auto lockFree = run<lockFreeQueue> ( nProducers, messagesPerProducer );
+        auto locked = run<mutexQueue> ( nProducers, messagesPerProducer );
+        std::cout << std::setw ( 9 ) << nProducers << std::fixed << std::setprecision ( 2 ) << std::setw ( 18 ) << lockFree << std::setw ( 15 ) << locked << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,321 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dabClient.h"
+
+namespace DAB
+{
+    // the dabScheduler takes requests off of the mqtt callback thread and executes them on a pool of worker threads.
+    // requests are executed in priority order (see the priority column of the METHODS table in dabClient.h).   Each priority has its own
+    // FIFO queue.   To ensure that low priority requests can not be starved by a continuous stream of higher priority requests we age
+    // requests while they are queued;  every agingInterval a request waits it is treated as being one priority level higher.
+    //
+    // the first worker is reserved for control-plane requests (health-check, telemetry stop, etc.).   This guarantees that a control request
+    // never has to wait for a long-running bulk handler (output/image, voice/send-audio) to finish even when every other worker is busy.
+    //
+    // requests for one device are executed one at a time and in the order they arrived, so that a sequence of key presses can't be run in
+    // parallel or reordered by aging.   Only a device's oldest request is ever in the priority queues, the rest are parked behind it in the
+    // device's own queue until it completes.   Control-plane requests are exempt, they don't change device state and must not wait behind a
+    // long-running handler for the same device.
+    //
+    // admission is bounded.   There is a limit on the number of queued requests for each device as well as a global limit.   A request that would
+    // exceed either limit is refused (shed) so that one misbehaving controller can not grow our memory or the latency seen by other devices.
+    //
+    // with the dabSingleThreaded policy there are no workers.   Admitted jobs are executed inline by schedule(), the admission limits and
+    // statistics still apply.
+    template< typename THREADING = dabMultiThreaded >
+    class dabScheduler
+    {
+        constexpr static size_t nPriorities = (size_t) dabPriority::bulk + 1;
+
+        struct deviceCounters;
+
+        struct job
+        {
+            std::chrono::time_point<std::chrono::steady_clock> queued;
+            deviceCounters *counters;           // entries in devices are never erased so this is stable
+            std::move_only_function<void ()> func;      // move only so that a job can own what its request holds (see dabBridge::admit)
+            dabPriority priority;
+        };
+
+        // per device admission accounting and ordering
+        struct deviceCounters
+        {
+            size_t queued = 0;
+            uint64_t shed = 0;
+            bool active = false;                // one of the device's ordered jobs is in the priority queues or executing
+            std::deque<job> parked;             // the device's ordered jobs waiting for the active one to complete
+        };
+
+        std::array<std::deque<job>, nPriorities> queues;
+
+        typename THREADING::mutex access;
+        typename THREADING::condition_variable condition;
+        typename THREADING::condition_variable idle;  // notified whenever a job completes while we're draining
+        std::vector<std::thread> workers;
+        bool exiting = false;
+        bool draining = false;
+        size_t running = 0;                           // jobs currently executing on a worker
+
+        std::chrono::milliseconds agingInterval;
+
+        // admission limits and counters
+        size_t maxQueued = 4096;
+        size_t maxQueuedPerDevice = 256;
+        size_t queued = 0;
+        uint64_t shed = 0;
+        std::map<std::string, deviceCounters, std::less<>> devices;
+
+        // returns the index of the queue to service next, or nPriorities if there is nothing this worker is allowed to run
+        // a request's effective priority is its native priority less one level for every agingInterval it has been queued.
+        // ties are resolved in favor of the higher native priority
+        size_t selectQueue ( bool controlOnly )
+        {
+            if ( controlOnly )
+            {
+                return queues[(size_t) dabPriority::control].empty () ? nPriorities : (size_t) dabPriority::control;
+            }
+
+            auto now = std::chrono::steady_clock::now ();
+            size_t selected = nPriorities;
+            int64_t selectedPriority = INT64_MAX;
+            for ( size_t priority = 0; priority < nPriorities; priority++ )
+            {
+                if ( !queues[priority].empty () )
+                {
+                    // the head of each queue is the oldest request at that priority
+                    auto waited = std::chrono::duration_cast<std::chrono::milliseconds> ( now - queues[priority].front ().queued );
+                    auto effective = (int64_t) priority - (agingInterval.count () ? waited.count () / agingInterval.count () : 0);
+                    if ( effective < selectedPriority )
+                    {
+                        selectedPriority = effective;
+                        selected = priority;
+                    }
+                }
+            }
+            return selected;
+        }
+
+        void workerTask ( bool controlOnly )
+        {
+            std::unique_lock l1 ( access );
+            for ( ;; )
+            {
+                size_t priority;
+                condition.wait ( l1, [&] () { return exiting || (priority = selectQueue ( controlOnly )) != nPriorities; } );
+                if ( exiting )
+                {
+                    return;
+                }
+
+                auto func = std::move ( queues[priority].front ().func );
+                auto *counters = queues[priority].front ().counters;
+                counters->queued--;
+                queued--;
+                queues[priority].pop_front ();
+                running++;
+
+                l1.unlock ();
+                try
+                {
+                    func ();
+                } catch ( ... )
+                {
+                    // jobs are expected to report their own errors, an escaping exception must not take down the worker
+                }
+                // release whatever the job holds now rather than with the lock held, when func goes out of scope
+                func = nullptr;
+                l1.lock ();
+
+                running--;
+                if ( priority != (size_t) dabPriority::control )
+                {
+                    // the device's next request, if any, may now run.   It keeps its original queue time so that it has aged while parked
+                    if ( counters->parked.empty () )
+                    {
+                        counters->active = false;
+                    } else
+                    {
+                        auto &next = counters->parked.front ();
+                        queues[(size_t) next.priority].push_back ( std::move ( next ) );
+                        counters->parked.pop_front ();
+                        condition.notify_all ();
+                    }
+                }
+                if ( draining )
+                {
+                    idle.notify_all ();
+                }
+            }
+        }
+
+    public:
+        // workers is the total number of worker threads, one of which is reserved for control-plane requests
+        explicit dabScheduler ( size_t nWorkers = std::max ( 2U, std::thread::hardware_concurrency () ), std::chrono::milliseconds agingInterval = std::chrono::milliseconds ( 100 ) ) : agingInterval ( agingInterval )
+        {
+            if constexpr ( THREADING::concurrent )
+            {
+                nWorkers = std::max ( nWorkers, (size_t) 2 );
+                workers.reserve ( nWorkers );
+                for ( size_t loop = 0; loop < nWorkers; loop++ )
+                {
+                    workers.emplace_back ( &dabScheduler::workerTask, this, loop == 0 );
+                }
+            }
+        }
+
+        dabScheduler ( dabScheduler const & ) = delete;
+        dabScheduler &operator= ( dabScheduler const & ) = delete;
+
+        ~dabScheduler ()
+        {
+            stop ();
+        }
+
+        // set the maximum number of requests that may be queued in total and for any single device
+        void setQueueLimits ( size_t globalLimit, size_t perDeviceLimit )
+        {
+            std::lock_guard l1 ( access );
+            maxQueued = globalLimit;
+            maxQueuedPerDevice = perDeviceLimit;
+        }
+
+        // queue a job for execution at the specified priority on behalf of deviceId.
+        // returns false if the job was not admitted, in which case the caller is responsible for rejecting the request
+        bool schedule ( dabPriority priority, std::string_view const &deviceId, std::move_only_function<void ()> func )
+        {
+            {
+                std::lock_guard l1 ( access );
+                if ( exiting || draining )
+                {
+                    return false;
+                }
+                auto it = devices.find ( deviceId );
+                if ( it == devices.end () )
+                {
+                    it = devices.emplace ( std::string ( deviceId ), deviceCounters{} ).first;
+                }
+                if ( queued >= maxQueued || it->second.queued >= maxQueuedPerDevice )
+                {
+                    it->second.shed++;
+                    shed++;
+                    return false;
+                }
+                if constexpr ( !THREADING::concurrent )
+                {
+                    running++;
+                    try
+                    {
+                        func ();
+                    } catch ( ... )
+                    {
+                    }
+                    running--;
+                    return true;
+                }
+                it->second.queued++;
+                queued++;
+                job j{ std::chrono::steady_clock::now (), &it->second, std::move ( func ), priority };
+                if ( priority != dabPriority::control && it->second.active )
+                {
+                    it->second.parked.push_back ( std::move ( j ) );
+                    return true;
+                }
+                if ( priority != dabPriority::control )
+                {
+                    it->second.active = true;
+                }
+                queues[(size_t) priority].push_back ( std::move ( j ) );
+            }
+            // the reserved control worker is waiting on the same condition, so we must wake everyone to ensure the right worker sees the job
+            condition.notify_all ();
+            return true;
+        }
+
+        // return the current queue depths and the number of requests that have been shed, in total and per device
+        jsonElement getStatistics ()
+        {
+            std::lock_guard l1 ( access );
+            jsonElement stats;
+            stats["queued"] = queued;
+            stats["running"] = running;
+            stats["shed"] = shed;
+            stats["devices"].makeObject ();
+            for ( auto const &[deviceId, counters] : devices )
+            {
+                stats["devices"][deviceId.c_str ()] = {{"queued", counters.queued}, {"shed", counters.shed}};
+            }
+            return stats;
+        }
+
+        // true once drain() has been called, no further jobs will be admitted
+        bool isDraining ()
+        {
+            std::lock_guard l1 ( access );
+            return draining || exiting;
+        }
+
+        // stop admitting new jobs and wait until every admitted job (queued or running) has completed or the deadline passes.
+        // the workers are then stopped.   Returns true if all admitted jobs were completed
+        bool drain ( std::chrono::time_point<std::chrono::steady_clock> deadline )
+        {
+            bool drained = true;
+            if constexpr ( THREADING::concurrent )
+            {
+                std::unique_lock l1 ( access );
+                draining = true;
+                drained = idle.wait_until ( l1, deadline, [this] () { return exiting || (!queued && !running); } );
+            } else
+            {
+                // jobs complete before schedule() returns so there is never anything outstanding
+                (void) deadline;
+                draining = true;
+            }
+            stop ();
+            return drained;
+        }
+
+        // stop all workers.  Any queued but not yet started jobs are discarded
+        void stop ()
+        {
+            {
+                std::lock_guard l1 ( access );
+                if ( exiting )
+                {
+                    return;
+                }
+                exiting = true;
+            }
+            condition.notify_all ();
+            for ( auto &worker : workers )
+            {
+                worker.join ();
+            }
+        }
+    };
+}
@@ -0,0 +1,520 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dabMqttCodec.h"
+#include "dabMqttInterfaceBase.h"
+#include "dabShmRing.h"
+
+// interface for controllers running on the same machine as the adapter, over shared memory rings instead of a broker (see dabShmRing.h).
+// a controller connects to the adapter's unix socket with dabShmClient and is given a channel of its own.   Requests it publishes on the
+// channel go through exactly the path of requests from a broker, and it receives the responses and telemetry on the topics it subscribed to.
+// a single reactor thread accepts controllers and reads every request ring, only the publisher writes to the response rings.   The publisher
+// never waits for a controller: one that lets its response ring fill is disconnected rather than holding up every other controller, just as
+// the embedded broker disconnects a client whose socket backs up.   A controller that corrupts its request ring is disconnected too.
+
+namespace DAB
+{
+    template< typename BRIDGE >
+    class dabShmInterface : public dabMQTTInterfaceBase<dabShmInterface<BRIDGE>, BRIDGE>
+    {
+        using base = dabMQTTInterfaceBase<dabShmInterface<BRIDGE>, BRIDGE>;
+        friend base;
+
+        using typename base::threadingPolicy;
+        using typename base::outboundMessage;
+        using base::running;
+        using base::runningMutex;
+        using base::topics;
+
+        static_assert ( threadingPolicy::concurrent, "the shared memory interface runs its own reactor thread and can not be used with dabSingleThreaded" );
+
+        constexpr static size_t MAX_CLIENTS = 64;
+
+        // the top bit of an epoll registration's data marks a request ring's eventfd, the rest is the session's socket
+        constexpr static uint64_t RING_EVENT = 1ull << 63;
+
+        struct session
+        {
+            int fd = -1;                                                // the unix socket, only used to notice the controller going away
+            dabShmChannel channel;
+            std::vector<std::string> filters;                           // guarded by sessionsMutex
+            std::atomic<bool> closing = false;
+        };
+
+        std::string socketPath;
+        uint64_t ringCapacity;
+
+        int listenFd = -1;
+        int wakeFd = -1;                                                // eventfd, used to stop the reactor and to have it close sessions
+        int epollFd = -1;
+        std::thread reactorThread;
+        std::atomic<bool> listening = false;
+        std::atomic<bool> dispatching = false;
+
+        // sessions are only created and destroyed by the reactor.   The publisher holds a reference to the sessions it's writing to, so a
+        // session's mapping outlives its removal from the table
+        std::mutex sessionsMutex;
+        std::map<int, std::shared_ptr<session>> sessions;
+        std::vector<std::shared_ptr<session>> targets;                  // only used by the publisher
+        std::string publishHeader;
+        mqttPropertyWriter publishProps;
+
+        // the adapter's own request topics (or wildcard filters), fixed once listening
+        mqttTopicFilterSet adapterTopics;
+
+        std::atomic<size_t> clients = 0;
+        std::atomic<uint64_t> accepted = 0;
+        std::atomic<uint64_t> received = 0;
+        std::atomic<uint64_t> dispatched = 0;
+        std::atomic<uint64_t> delivered = 0;
+        std::atomic<uint64_t> slowDisconnects = 0;
+        std::atomic<uint64_t> oversized = 0;
+
+        // sent in place of a response too large to ever fit in a response ring (see ringCapacity)
+        inline static const std::string oversizedResponse = [] () {
+            std::string payload;
+            jsonElement ( {{"status", 500}, {"error", "response too large for the shared memory channel"}} ).serialize ( payload, true );
+            return payload;
+        } ();
+
+        void kickReactor ()
+        {
+            uint64_t one = 1;
+            [[maybe_unused]] auto rc = ::write ( wakeFd, &one, sizeof ( one ) );
+        }
+
+        // encode the header of a PUBLISH of msg with payload (msg's own, or one sent in its place) into publishHeader
+        void encodeHeader ( outboundMessage const &msg, std::string_view payload, bool deflated )
+        {
+            publishProps.clear ();
+            if ( !msg.correlationData.empty () )
+            {
+                publishProps.string ( mqttProperty::correlationData, msg.correlationData );
+            }
+            if ( deflated )
+            {
+                publishProps.userProperty ( contentEncodingProperty, deflateEncoding );
+            }
+            publishHeader.clear ();
+            encodePublishHeader ( publishHeader, msg.topic, 0, false, 0, publishProps, payload.size () );
+        }
+
+        // write a message to every controller subscribed to its topic.   Called by the publisher.   Having no subscriber isn't a failure, the
+        // message is discarded just as a broker would.   A message that could never fit in a response ring isn't the controller's fault: a
+        // response is replaced with an error, telemetry is dropped
+        bool send ( outboundMessage &msg )
+        {
+            {
+                std::lock_guard l1 ( sessionsMutex );
+                targets.clear ();
+                for ( auto &[fd, s] : sessions )
+                {
+                    if ( !s->closing && std::any_of ( s->filters.begin (), s->filters.end (), [&] ( auto const &filter ) { return mqttTopicMatches ( filter, msg.topic ); } ) )
+                    {
+                        targets.push_back ( s );
+                    }
+                }
+            }
+            if ( targets.empty () )
+            {
+                return true;
+            }
+
+            std::string_view payload = msg.payload;
+            encodeHeader ( msg, payload, msg.deflated );
+            if ( publishHeader.size () + payload.size () > targets.front ()->channel.responses.maximumPacket () )
+            {
+                oversized++;
+                if ( msg.trafficClass != dabTrafficClass::response )
+                {
+                    targets.clear ();
+                    return true;
+                }
+                payload = oversizedResponse;
+                encodeHeader ( msg, payload, false );
+            }
+            iovec iov[2] = {{publishHeader.data (),     publishHeader.size ()},
+                            {(void *) payload.data (), payload.size ()}};
+
+            for ( auto &s : targets )
+            {
+                // every ring has the same capacity, so this can only fail because the controller isn't keeping up
+                if ( s->channel.responses.tryWrite ( iov, payload.empty () ? 1 : 2 ) )
+                {
+                    delivered++;
+                } else if ( !s->closing.exchange ( true ) )
+                {
+                    slowDisconnects++;
+                    kickReactor ();
+                }
+            }
+            targets.clear ();
+            return true;
+        }
+
+        // called by the reactor with the packets a controller has written to its request ring.   Returns false if the controller sent something
+        // it shouldn't have
+        bool handlePacket ( session &s, std::string_view packet )
+        {
+            size_t headerLen = 0;
+            mqttFrameLength ( packet, headerLen );
+            auto first = (uint8_t) packet[0];
+            auto body = packet.substr ( headerLen );
+            switch ( (mqttPacketType) (first >> 4) )
+            {
+                case mqttPacketType::publish:
+                {
+                    mqttPublish pkt;
+                    if ( !decodePublish ( first & 0x0F, body, pkt ) || pkt.qos )
+                    {
+                        return false;
+                    }
+                    received++;
+                    if ( dispatching && adapterTopics.matches ( pkt.topic ) )
+                    {
+                        dispatched++;
+                        this->handleRequest ( pkt.topic, pkt.payload, pkt.props.responseTopic, pkt.props.correlationData, pkt.props.acceptEncoding );
+                    }
+                    return true;
+                }
+                case mqttPacketType::subscribe:
+                {
+                    uint16_t packetId;
+                    mqttProperties props;
+                    std::lock_guard l1 ( sessionsMutex );
+                    return decodeSubscribe ( body, packetId, props, [&] ( std::string_view filter, uint8_t )
+                    {
+                        if ( !filter.empty () && std::find ( s.filters.begin (), s.filters.end (), filter ) == s.filters.end () )
+                        {
+                            s.filters.emplace_back ( filter );
+                        }
+                    } );
+                }
+                case mqttPacketType::unsubscribe:
+                {
+                    uint16_t packetId;
+                    mqttProperties props;
+                    std::lock_guard l1 ( sessionsMutex );
+                    return decodeUnsubscribe ( body, packetId, props, [&] ( std::string_view filter )
+                    {
+                        std::erase ( s.filters, filter );
+                    } );
+                }
+                default:
+                    return false;
+            }
+        }
+
+        // drain the controller's request ring, then arrange to be woken when more arrives
+        void readRequests ( session &s )
+        {
+            auto &ring = s.channel.requests;
+            ring.finishWait ();
+            try
+            {
+                do
+                {
+                    ring.consume ( [&] ( std::string_view packet )
+                    {
+                        if ( !s.closing && !handlePacket ( s, packet ) )
+                        {
+                            s.closing = true;
+                        }
+                    } );
+                } while ( !s.closing && !ring.prepareWait () );
+            } catch ( DAB::dabException & )
+            {
+                s.closing = true;
+            }
+        }
+
+        void closeSession ( int fd )
+        {
+            std::lock_guard l1 ( sessionsMutex );
+            auto it = sessions.find ( fd );
+            if ( it == sessions.end () )
+            {
+                return;
+            }
+            it->second->closing = true;
+            epoll_ctl ( epollFd, EPOLL_CTL_DEL, fd, nullptr );
+            epoll_ctl ( epollFd, EPOLL_CTL_DEL, it->second->channel.requests.dataEvent (), nullptr );
+            ::close ( fd );
+            sessions.erase ( it );
+            clients--;
+        }
+
+        void acceptClients ()
+        {
+            for ( ;; )
+            {
+                auto fd = ::accept4 ( listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC );
+                if ( fd < 0 )
+                {
+                    if ( errno == EINTR )
+                    {
+                        continue;
+                    }
+                    return;
+                }
+                if ( clients >= MAX_CLIENTS )
+                {
+                    ::close ( fd );
+                    continue;
+                }
+
+                auto s = std::make_shared<session> ();
+                s->fd = fd;
+                try
+                {
+                    s->channel.create ( ringCapacity );
+                } catch ( DAB::dabException & )
+                {
+                    ::close ( fd );
+                    continue;
+                }
+                // the controller may write requests as soon as it has the channel, so the ring is armed, while it's still empty, before the
+                // channel is handed over
+                s->channel.requests.prepareWait ();
+                if ( !s->channel.send ( fd ) )
+                {
+                    ::close ( fd );
+                    continue;
+                }
+
+                epoll_event ev{};
+                ev.events = EPOLLIN;
+                ev.data.u64 = (uint64_t) fd;
+                epoll_ctl ( epollFd, EPOLL_CTL_ADD, fd, &ev );
+                ev.data.u64 = (uint64_t) fd | RING_EVENT;
+                epoll_ctl ( epollFd, EPOLL_CTL_ADD, s->channel.requests.dataEvent (), &ev );
+
+                std::lock_guard l1 ( sessionsMutex );
+                sessions.emplace ( fd, std::move ( s ) );
+                clients++;
+                accepted++;
+            }
+        }
+
+        void reactorTask ()
+        {
+            epoll_event events[64];
+
+            while ( listening )
+            {
+                auto n = epoll_wait ( epollFd, events, 64, 1000 );
+                bool sweep = false;
+                for ( int loop = 0; loop < n; loop++ )
+                {
+                    auto data = events[loop].data.u64;
+                    if ( data == (uint64_t) wakeFd )
+                    {
+                        uint64_t value;
+                        [[maybe_unused]] auto rc = ::read ( wakeFd, &value, sizeof ( value ) );
+                        sweep = true;
+                        continue;
+                    }
+                    if ( data == (uint64_t) listenFd )
+                    {
+                        acceptClients ();
+                        continue;
+                    }
+                    auto fd = (int) (data & ~RING_EVENT);
+                    // sessions are only erased by this thread, the pointer stays valid until we close it
+                    auto it = sessions.find ( fd );
+                    if ( it == sessions.end () )
+                    {
+                        continue;
+                    }
+                    auto &s = *it->second;
+                    if ( data & RING_EVENT )
+                    {
+                        readRequests ( s );
+                    } else
+                    {
+                        // the controller never writes to its socket, anything readable means it has gone
+                        s.closing = true;
+                    }
+                    sweep |= s.closing;
+                }
+
+                if ( sweep )
+                {
+                    std::vector<int> closed;
+                    for ( auto &[fd, s] : sessions )
+                    {
+                        if ( s->closing )
+                        {
+                            closed.push_back ( fd );
+                        }
+                    }
+                    for ( auto fd : closed )
+                    {
+                        closeSession ( fd );
+                    }
+                }
+            }
+        }
+
+        void openListener ()
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if ( socketPath.empty () || socketPath.size () >= sizeof ( addr.sun_path ) )
+            {
+                throw DAB::dabException ( 400, std::string ( "invalid socket path: " ) + socketPath );
+            }
+            std::memcpy ( addr.sun_path, socketPath.data (), socketPath.size () );
+            // a socket left behind by a previous run would make bind fail
+            ::unlink ( socketPath.c_str () );
+            listenFd = ::socket ( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+            if ( listenFd < 0 || ::bind ( listenFd, (sockaddr *) &addr, sizeof ( addr ) ) || ::listen ( listenFd, SOMAXCONN ) )
+            {
+                auto err = errno;
+                if ( listenFd >= 0 )
+                {
+                    ::close ( listenFd );
+                    listenFd = -1;
+                }
+                throw DAB::dabException ( err, std::string ( "Failed to listen on " ) + socketPath );
+            }
+        }
+
+        // stop the reactor and close every channel
+        void closeListener ()
+        {
+            listening = false;
+            if ( reactorThread.joinable () )
+            {
+                kickReactor ();
+                reactorThread.join ();
+            }
+            while ( !sessions.empty () )
+            {
+                closeSession ( sessions.begin ()->first );
+            }
+            if ( listenFd >= 0 )
+            {
+                ::unlink ( socketPath.c_str () );
+            }
+            for ( auto *f : {&listenFd, &epollFd, &wakeFd} )
+            {
+                if ( *f >= 0 )
+                {
+                    ::close ( *f );
+                    *f = -1;
+                }
+            }
+        }
+
+    public:
+        // socketPath is the unix socket controllers connect to.   Who may connect is governed by the permissions of its directory.
+        // ringCapacity is the size in bytes of each direction of a controller's channel, the largest message is half of it.   It should be sized
+        // for the largest response expected (a screen capture from output/image, say), larger ones are answered with a 500
+        dabShmInterface ( BRIDGE &bridge, std::string socketPath, uint64_t ringCapacity = 1024 * 1024 ) : base ( bridge ), socketPath ( std::move ( socketPath ) ), ringCapacity ( ringCapacity )
+        {
+            static_assert ( dabOutboundTransport<dabShmInterface> );
+            this->startPublisher ();
+        }
+
+        ~dabShmInterface ()
+        {
+            this->shutdown ();
+            closeListener ();
+        }
+
+        // return the adapter's request statistics, along with the controllers connected and message counts
+        jsonElement getStatistics ()
+        {
+            auto stats = base::getStatistics ();
+            stats["sharedMemory"] = {{"clients",         (int64_t) clients.load ()},
+                                     {"accepted",        accepted.load ()},
+                                     {"received",        received.load ()},
+                                     {"dispatched",      dispatched.load ()},
+                                     {"delivered",       delivered.load ()},
+                                     {"slowDisconnects", slowDisconnects.load ()},
+                                     {"oversized",       oversized.load ()}};
+            return stats;
+        }
+
+        // start accepting controllers, requests on the adapter's topics are dispatched as soon as we're listening
+        auto connect ()
+        {
+            auto connectStart = std::chrono::steady_clock::now ();
+
+            topics = this->requestTopics ();
+            adapterTopics.assign ( topics.begin (), topics.end () );
+
+            openListener ();
+            epollFd = epoll_create1 ( EPOLL_CLOEXEC );
+            wakeFd = eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = (uint64_t) listenFd;
+            epoll_ctl ( epollFd, EPOLL_CTL_ADD, listenFd, &ev );
+            ev.data.u64 = (uint64_t) wakeFd;
+            epoll_ctl ( epollFd, EPOLL_CTL_ADD, wakeFd, &ev );
+
+            dispatching = true;
+            listening = true;
+            reactorThread = std::thread ( &dabShmInterface::reactorTask, this );
+
+            this->markReady ( connectStart, std::chrono::steady_clock::now (), topics.size (), 0 );
+            return 0;
+        }
+
+        // stops dispatching requests, drains the adapter exactly as dabMQTTInterface::disconnect() does, then closes every channel.   Responses
+        // already in a response ring can still be read by the controller, its mapping stays valid until it disconnects
+        auto disconnect ( std::chrono::milliseconds deadline = std::chrono::milliseconds ( 10000 ) )
+        {
+            dispatching = false;
+            this->drain ( std::chrono::steady_clock::now () + deadline );
+            closeListener ();
+
+            std::lock_guard l1 ( runningMutex );
+            running.notify_all ();
+            return 0;
+        }
+
+        // this function will wait until disconnect() is called
+        void wait ()
+        {
+            std::unique_lock l1 ( runningMutex );
+            running.wait ( l1 );
+        }
+    };
+}
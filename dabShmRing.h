@@ -0,0 +1,564 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#if !defined ( __linux__ )
+#error dabShmRing requires memfd and eventfd and is only available on linux
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Json.h"
+#include "dabCompression.h"
+#include "dabMqttCodec.h"
+
+// shared memory transport between the adapter and a controller on the same machine.
+// a channel is a pair of single producer, single consumer rings in one shared memory mapping, requests flow from the controller to the adapter
+// on one and responses and telemetry flow back on the other.   Each ring record is an MQTT 5 packet (a PUBLISH, or a SUBSCRIBE/UNSUBSCRIBE from
+// the controller), so the envelope, topic, response topic, correlation data and payload, is exactly what the adapter receives from a broker,
+// and the adapter decodes requests in place in the shared mapping.
+// a consumer that finds its ring empty sets a flag and sleeps on an eventfd.   The producer writes to the eventfd only when that flag is set,
+// so while both sides are busy no system calls are made at all.   The same is done, in the other direction, when a producer finds a ring full.
+// the adapter listens on a unix socket.   A controller connects to it and receives the mapping's memfd and the four eventfds; the socket then
+// stays open only to tell each side when the other has gone.
+
+namespace DAB
+{
+    // the control block at the start of each ring.   head and tail only ever increase, the position in the ring is their value modulo capacity.
+    // they're on separate cache lines so that the producer and consumer don't contend
+    struct dabShmRingHeader
+    {
+        alignas ( 64 ) std::atomic<uint64_t> head;                     // written by the producer
+        alignas ( 64 ) std::atomic<uint64_t> tail;                     // written by the consumer
+        alignas ( 64 ) std::atomic<uint32_t> consumerWaiting;          // the consumer is, or is about to be, asleep on the data eventfd
+        std::atomic<uint32_t> producerWaiting;                         // the producer is waiting for space
+        uint64_t capacity;
+    };
+
+    static_assert ( std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "the ring's atomics must be lock free to be shared between processes" );
+
+    // one direction of a channel.   Not thread safe, there must be exactly one producer and one consumer
+    class dabShmRing
+    {
+        // a zero byte in place of a packet's first byte (MQTT packet type 0 is reserved) means the rest of the ring is unused and the next
+        // packet is at the start
+        constexpr static char WRAP = 0;
+
+        dabShmRingHeader *header = nullptr;
+        char *data = nullptr;
+        uint64_t capacity = 0;
+        int dataFd = -1;                                               // signalled by the producer when the consumer is waiting
+        int spaceFd = -1;                                              // signalled by the consumer when the producer is waiting
+
+        static void signal ( int fd )
+        {
+            uint64_t one = 1;
+            [[maybe_unused]] auto rc = ::write ( fd, &one, sizeof ( one ) );
+        }
+
+        static void clear ( int fd )
+        {
+            uint64_t value;
+            [[maybe_unused]] auto rc = ::read ( fd, &value, sizeof ( value ) );
+        }
+
+        // block on fd until it's signalled or deadline passes.   Also gives up, returning false, if closeFd (when not -1) is readable or has
+        // hung up, nothing is sent on the channel's socket once it is set up so that means the other side has gone
+        static bool sleep ( int fd, std::chrono::time_point<std::chrono::steady_clock> deadline, int closeFd = -1 )
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds> ( deadline - std::chrono::steady_clock::now () ).count ();
+            if ( remaining <= 0 )
+            {
+                return false;
+            }
+            pollfd pfd[2] = {{ fd, POLLIN, 0 }, { closeFd, POLLIN, 0 }};
+            if ( ::poll ( pfd, closeFd < 0 ? 1 : 2, (int) remaining ) > 0 )
+            {
+                if ( pfd[0].revents )
+                {
+                    clear ( fd );
+                }
+                if ( closeFd >= 0 && pfd[1].revents )
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    public:
+        dabShmRing () = default;
+
+        // base is the start of the ring's region of the mapping: the header, then capacity bytes of data
+        dabShmRing ( void *base, uint64_t capacity, int dataFd, int spaceFd ) : header ( static_cast<dabShmRingHeader *> ( base ) ), data ( static_cast<char *> ( base ) + sizeof ( dabShmRingHeader ) ), capacity ( capacity ), dataFd ( dataFd ), spaceFd ( spaceFd )
+        {
+        }
+
+        // the number of bytes a ring of capacity bytes needs in the mapping
+        static size_t regionSize ( uint64_t capacity )
+        {
+            return sizeof ( dabShmRingHeader ) + capacity;
+        }
+
+        // set up the header of a freshly created (zero filled) region
+        static void initialize ( void *base, uint64_t capacity )
+        {
+            auto *h = new ( base ) dabShmRingHeader{};
+            h->capacity = capacity;
+        }
+
+        int dataEvent () const
+        {
+            return dataFd;
+        }
+
+        // the largest packet the ring accepts, a packet may have to skip over the unused end of the ring
+        uint64_t maximumPacket () const
+        {
+            return capacity / 2;
+        }
+
+        // producer: append a packet made up of iov[0..iovCount).   Returns false, having written nothing, if there isn't room
+        bool tryWrite ( iovec const *iov, size_t iovCount )
+        {
+            size_t total = 0;
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                total += iov[loop].iov_len;
+            }
+            if ( !total || total > maximumPacket () )
+            {
+                return false;
+            }
+
+            auto head = header->head.load ( std::memory_order_relaxed );
+            auto tail = header->tail.load ( std::memory_order_acquire );
+            auto pos = head % capacity;
+            // a packet is never split across the end of the ring, so that the consumer can decode it in place
+            auto skip = capacity - pos < total ? capacity - pos : 0;
+            if ( capacity - (head - tail) < skip + total )
+            {
+                return false;
+            }
+            if ( skip )
+            {
+                data[pos] = WRAP;
+                pos = 0;
+            }
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                std::memcpy ( data + pos, iov[loop].iov_base, iov[loop].iov_len );
+                pos += iov[loop].iov_len;
+            }
+            // the seq_cst store orders the head update before our read of consumerWaiting, pairing with the consumer's store of
+            // consumerWaiting before its read of head, so a consumer going to sleep is never missed
+            header->head.store ( head + skip + total, std::memory_order_seq_cst );
+            if ( header->consumerWaiting.load ( std::memory_order_seq_cst ) )
+            {
+                signal ( dataFd );
+            }
+            return true;
+        }
+
+        // producer: as tryWrite, waiting until deadline for the consumer to make room.   The wait ends early if closeFd, the channel's socket,
+        // shows the consumer has gone
+        bool write ( iovec const *iov, size_t iovCount, std::chrono::time_point<std::chrono::steady_clock> deadline, int closeFd = -1 )
+        {
+            size_t total = 0;
+            for ( size_t loop = 0; loop < iovCount; loop++ )
+            {
+                total += iov[loop].iov_len;
+            }
+            if ( total > maximumPacket () )
+            {
+                // no amount of waiting will make room for it
+                return false;
+            }
+            for ( ;; )
+            {
+                if ( tryWrite ( iov, iovCount ) )
+                {
+                    return true;
+                }
+                header->producerWaiting.store ( 1, std::memory_order_seq_cst );
+                if ( tryWrite ( iov, iovCount ) )
+                {
+                    header->producerWaiting.store ( 0, std::memory_order_relaxed );
+                    return true;
+                }
+                auto waited = sleep ( spaceFd, deadline, closeFd );
+                header->producerWaiting.store ( 0, std::memory_order_relaxed );
+                if ( !waited )
+                {
+                    return tryWrite ( iov, iovCount );
+                }
+            }
+        }
+
+        // consumer: call func ( std::string_view packet ) for every packet available, then release their space to the producer.   The views
+        // point into the shared mapping and are only valid during the call.   Returns the number of packets consumed.
+        // head is written by the other process, which we needn't trust.   Anything that doesn't describe whole packets within the ring throws
+        template< typename F >
+        size_t consume ( F &&func )
+        {
+            auto tail = header->tail.load ( std::memory_order_relaxed );
+            auto head = header->head.load ( std::memory_order_acquire );
+            if ( head - tail > capacity )
+            {
+                throw DAB::dabException ( 500, std::string ( "shared memory ring is corrupt" ) );
+            }
+            size_t count = 0;
+            while ( tail != head )
+            {
+                auto pos = tail % capacity;
+                // a packet is never split across the end of the ring
+                auto available = std::min ( head - tail, capacity - pos );
+                if ( data[pos] == WRAP )
+                {
+                    if ( available != capacity - pos )
+                    {
+                        throw DAB::dabException ( 500, std::string ( "shared memory ring is corrupt" ) );
+                    }
+                    tail += capacity - pos;
+                    continue;
+                }
+                size_t headerLen = 0;
+                auto len = mqttFrameLength ( {data + pos, (size_t) available}, headerLen );
+                if ( !len || len == SIZE_MAX || len > available )
+                {
+                    // the producer only ever writes whole packets, this ring is corrupt
+                    throw DAB::dabException ( 500, std::string ( "shared memory ring is corrupt" ) );
+                }
+                func ( std::string_view ( data + pos, len ) );
+                tail += len;
+                count++;
+            }
+            if ( count )
+            {
+                header->tail.store ( tail, std::memory_order_seq_cst );
+                if ( header->producerWaiting.load ( std::memory_order_seq_cst ) )
+                {
+                    signal ( spaceFd );
+                }
+            }
+            return count;
+        }
+
+        // consumer: announce that we're about to sleep on dataEvent ().   Returns false (and withdraws the announcement) if packets arrived in
+        // the meantime, in which case we mustn't sleep
+        bool prepareWait ()
+        {
+            header->consumerWaiting.store ( 1, std::memory_order_seq_cst );
+            if ( header->head.load ( std::memory_order_seq_cst ) != header->tail.load ( std::memory_order_relaxed ) )
+            {
+                header->consumerWaiting.store ( 0, std::memory_order_relaxed );
+                return false;
+            }
+            return true;
+        }
+
+        // consumer: after waking, clear the event and withdraw the announcement
+        void finishWait ()
+        {
+            clear ( dataFd );
+            header->consumerWaiting.store ( 0, std::memory_order_relaxed );
+        }
+
+        // consumer: sleep until packets are available or deadline passes
+        void waitForData ( std::chrono::time_point<std::chrono::steady_clock> deadline )
+        {
+            if ( prepareWait () )
+            {
+                sleep ( dataFd, deadline );
+                header->consumerWaiting.store ( 0, std::memory_order_relaxed );
+            }
+        }
+    };
+
+    // the shared mapping and eventfds of one channel.   The adapter creates them, the controller receives them over the unix socket
+    class dabShmChannel
+    {
+        // the request ring's data and space events, then the response ring's
+        std::array<int, 4> events{ -1, -1, -1, -1 };
+        int memFd = -1;
+        void *mapping = MAP_FAILED;
+        size_t mappingSize = 0;
+        uint64_t capacity = 0;
+
+        constexpr static uint64_t MAGIC = 0x31474e4952424144ull;       // "DABRING1"
+
+        void map ()
+        {
+            mappingSize = 2 * dabShmRing::regionSize ( capacity );
+            mapping = ::mmap ( nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0 );
+            if ( mapping == MAP_FAILED )
+            {
+                throw DAB::dabException ( errno, std::string ( "Failed to map shared memory" ) );
+            }
+            requests = dabShmRing ( mapping, capacity, events[0], events[1] );
+            responses = dabShmRing ( static_cast<char *> ( mapping ) + dabShmRing::regionSize ( capacity ), capacity, events[2], events[3] );
+        }
+
+    public:
+        dabShmRing requests;                                           // controller to adapter
+        dabShmRing responses;                                          // adapter to controller
+
+        dabShmChannel () = default;
+        dabShmChannel ( dabShmChannel const & ) = delete;
+        dabShmChannel &operator= ( dabShmChannel const & ) = delete;
+
+        ~dabShmChannel ()
+        {
+            if ( mapping != MAP_FAILED )
+            {
+                ::munmap ( mapping, mappingSize );
+            }
+            for ( auto fd : events )
+            {
+                if ( fd >= 0 )
+                {
+                    ::close ( fd );
+                }
+            }
+            if ( memFd >= 0 )
+            {
+                ::close ( memFd );
+            }
+        }
+
+        // adapter: create a channel whose rings each hold capacity bytes (rounded up to a multiple of 64)
+        void create ( uint64_t ringCapacity )
+        {
+            capacity = (ringCapacity + 63) & ~(uint64_t) 63;
+            memFd = ::memfd_create ( "dab-shm", MFD_CLOEXEC );
+            if ( memFd < 0 || ::ftruncate ( memFd, (off_t) (2 * dabShmRing::regionSize ( capacity )) ) )
+            {
+                throw DAB::dabException ( errno, std::string ( "Failed to create shared memory" ) );
+            }
+            for ( auto &fd : events )
+            {
+                fd = ::eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+                if ( fd < 0 )
+                {
+                    throw DAB::dabException ( errno, std::string ( "Failed to create eventfd" ) );
+                }
+            }
+            map ();
+            dabShmRing::initialize ( mapping, capacity );
+            dabShmRing::initialize ( static_cast<char *> ( mapping ) + dabShmRing::regionSize ( capacity ), capacity );
+        }
+
+        // adapter: hand the channel to the controller connected to sock
+        bool send ( int sock ) const
+        {
+            uint64_t hello[2] = {MAGIC, capacity};
+            iovec iov{ hello, sizeof ( hello ) };
+            alignas ( cmsghdr ) char control[CMSG_SPACE ( 5 * sizeof ( int ) )]{};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof ( control );
+            auto *cmsg = CMSG_FIRSTHDR ( &msg );
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN ( 5 * sizeof ( int ) );
+            int fds[5] = {memFd, events[0], events[1], events[2], events[3]};
+            std::memcpy ( CMSG_DATA ( cmsg ), fds, sizeof ( fds ) );
+            return ::sendmsg ( sock, &msg, MSG_NOSIGNAL ) == (ssize_t) sizeof ( hello );
+        }
+
+        // controller: receive the channel from the adapter over sock
+        void receive ( int sock )
+        {
+            uint64_t hello[2] = {};
+            iovec iov{ hello, sizeof ( hello ) };
+            alignas ( cmsghdr ) char control[CMSG_SPACE ( 5 * sizeof ( int ) )]{};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof ( control );
+            if ( ::recvmsg ( sock, &msg, MSG_CMSG_CLOEXEC ) != (ssize_t) sizeof ( hello ) || hello[0] != MAGIC )
+            {
+                throw DAB::dabException ( 500, std::string ( "Failed to receive shared memory channel" ) );
+            }
+            auto *cmsg = CMSG_FIRSTHDR ( &msg );
+            if ( !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN ( 5 * sizeof ( int ) ) )
+            {
+                throw DAB::dabException ( 500, std::string ( "Failed to receive shared memory channel" ) );
+            }
+            int fds[5];
+            std::memcpy ( fds, CMSG_DATA ( cmsg ), sizeof ( fds ) );
+            memFd = fds[0];
+            std::copy ( fds + 1, fds + 5, events.begin () );
+            capacity = hello[1];
+            map ();
+        }
+    };
+
+    // the controller's end of a shared memory channel, for a test agent or controller running on the same machine as the adapter.
+    // not thread safe: publish and subscribe from one thread and receive from one thread (the same or another)
+    class dabShmClient
+    {
+        int sock = -1;
+        dabShmChannel channel;
+        std::string packet;
+        mqttPropertyWriter props;
+
+        bool write ( std::chrono::milliseconds timeout )
+        {
+            iovec iov{ packet.data (), packet.size () };
+            return channel.requests.write ( &iov, 1, std::chrono::steady_clock::now () + timeout, sock );
+        }
+
+    public:
+        // a message from the adapter, valid only for the duration of the callback
+        struct delivery
+        {
+            std::string_view topic;
+            std::string_view correlationData;
+            std::string_view payload;
+            bool deflated = false;
+        };
+
+        // socketPath is the adapter's unix socket
+        explicit dabShmClient ( std::string const &socketPath )
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if ( socketPath.size () >= sizeof ( addr.sun_path ) )
+            {
+                throw DAB::dabException ( 400, std::string ( "socket path too long" ) );
+            }
+            std::memcpy ( addr.sun_path, socketPath.data (), socketPath.size () );
+            sock = ::socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+            if ( sock < 0 || ::connect ( sock, (sockaddr *) &addr, sizeof ( addr ) ) )
+            {
+                auto err = errno;
+                if ( sock >= 0 )
+                {
+                    ::close ( sock );
+                }
+                throw DAB::dabException ( err, std::string ( "Failed to connect to " ) + socketPath );
+            }
+            channel.receive ( sock );
+        }
+
+        dabShmClient ( dabShmClient const & ) = delete;
+        dabShmClient &operator= ( dabShmClient const & ) = delete;
+
+        ~dabShmClient ()
+        {
+            ::close ( sock );
+        }
+
+        // receive the adapter's responses and telemetry on topics matching filter
+        bool subscribe ( std::string_view filter, std::chrono::milliseconds timeout = std::chrono::milliseconds ( 1000 ) )
+        {
+            packet.clear ();
+            std::string_view filters[1] = {filter};
+            encodeSubscribe ( packet, 1, std::begin ( filters ), std::end ( filters ), 0 );
+            return write ( timeout );
+        }
+
+        bool unsubscribe ( std::string_view filter, std::chrono::milliseconds timeout = std::chrono::milliseconds ( 1000 ) )
+        {
+            packet.clear ();
+            std::string_view filters[1] = {filter};
+            encodeUnsubscribe ( packet, 1, std::begin ( filters ), std::end ( filters ) );
+            return write ( timeout );
+        }
+
+        // send a request.   Returns false if the adapter didn't make room for it within timeout, or has disconnected us
+        bool publish ( std::string_view topic, std::string_view payload, std::string_view responseTopic = {}, std::string_view correlationData = {}, std::string_view acceptEncoding = {}, std::chrono::milliseconds timeout = std::chrono::milliseconds ( 1000 ) )
+        {
+            props.clear ();
+            if ( !responseTopic.empty () )
+            {
+                props.string ( mqttProperty::responseTopic, responseTopic );
+            }
+            if ( !correlationData.empty () )
+            {
+                props.string ( mqttProperty::correlationData, correlationData );
+            }
+            if ( !acceptEncoding.empty () )
+            {
+                props.userProperty ( acceptEncodingProperty, acceptEncoding );
+            }
+            packet.clear ();
+            encodePublishHeader ( packet, topic, 0, false, 0, props, payload.size () );
+            iovec iov[2] = {{packet.data (),         packet.size ()},
+                            {(void *) payload.data (), payload.size ()}};
+            return channel.requests.write ( iov, payload.empty () ? 1 : 2, std::chrono::steady_clock::now () + timeout, sock );
+        }
+
+        // call func ( delivery const & ) for every message from the adapter, waiting up to timeout for the first.   Returns the number of messages
+        template< typename F >
+        size_t receive ( F &&func, std::chrono::microseconds timeout = std::chrono::microseconds ( 0 ) )
+        {
+            auto consume = [&] ()
+            {
+                return channel.responses.consume ( [&] ( std::string_view pkt )
+                {
+                    size_t headerLen = 0;
+                    mqttFrameLength ( pkt, headerLen );
+                    mqttPublish pub;
+                    if ( ((uint8_t) pkt[0] >> 4) == (uint8_t) mqttPacketType::publish && decodePublish ( (uint8_t) pkt[0] & 0x0F, pkt.substr ( headerLen ), pub ) )
+                    {
+                        func ( delivery{ pub.topic, pub.props.correlationData, pub.payload, pub.props.contentEncoding == deflateEncoding } );
+                    }
+                } );
+            };
+            auto deadline = std::chrono::steady_clock::now () + timeout;
+            for ( ;; )
+            {
+                if ( auto count = consume () )
+                {
+                    return count;
+                }
+                if ( std::chrono::steady_clock::now () >= deadline )
+                {
+                    return 0;
+                }
+                channel.responses.waitForData ( std::chrono::time_point_cast<std::chrono::steady_clock::duration> ( deadline ) );
+            }
+        }
+
+        // the unix socket, readable (with end of file) once the adapter has gone
+        int fd () const
+        {
+            return sock;
+        }
+    };
+}
@@ -0,0 +1,81 @@
+/**
+ Copyright 2023 Amazon.com, Inc. or its affiliates.
+ Copyright 2023 Netflix Inc.
+ Copyright 2023 Google LLC
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+ http://www.apache.org/licenses/LICENSE-2.0
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <type_traits>
+
+#include "dabPolicy.h"
+
+namespace DAB
+{
+    // threading model policies.   Passed like any other policy to dabClient and dabBridge (see dabPolicy.h); the bridge and all of its device classes
+    // must use the same model.
+    //
+    // dabMultiThreaded is the default.   Requests are executed on a pool of workers, telemetry is published from a per-device thread and all
+    // shared state is protected by mutexes and atomics.
+    struct dabMultiThreaded : dabPolicy
+    {
+        constexpr static bool concurrent = true;
+
+        using mutex = std::mutex;
+        using condition_variable = std::condition_variable;
+        template< typename V >
+        using atomic = std::atomic<V>;
+    };
+
+    // dabSingleThreaded is intended for small on-device builds.   Everything runs on the thread that calls dabMQTTInterface::wait(): requests are
+    // executed inline as they are received and telemetry is published from the same loop when it falls due.   There are no worker threads, and
+    // the mutexes and atomics compile away to nothing.
+    struct dabSingleThreaded : dabPolicy
+    {
+        constexpr static bool concurrent = false;
+
+        struct mutex
+        {
+            void lock ()
+            {}
+
+            void unlock ()
+            {}
+
+            bool try_lock ()
+            {
+                return true;
+            }
+        };
+
+        // never waited on, there being no other thread to notify us
+        struct condition_variable
+        {
+            void notify_one ()
+            {}
+
+            void notify_all ()
+            {}
+        };
+
+        template< typename V >
+        using atomic = V;
+    };
+
+    template< typename T >
+    struct isDabThreading : std::bool_constant<std::is_same_v<T, dabMultiThreaded> || std::is_same_v<T, dabSingleThreaded>>
+    {
+    };
+}